@@ -1,6 +1,7 @@
 #
 # "main" pseudo-component makefile.
 #
-# (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
+# (Compiles the source files in 'src', adding 'include' to include path.)
 
-COMPONENT_ADD_INCLUDEDIRS += include
\ No newline at end of file
+COMPONENT_ADD_INCLUDEDIRS += include
+COMPONENT_SRCDIRS := src
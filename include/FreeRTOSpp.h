@@ -7,11 +7,20 @@
  */
 #pragma once
 
+#include "boot_profiler.h"
+#include "creation_profile.h"
+#include "deadline.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
+#include "lock_stats.h"
+#include "memory_accounting.h"
+#include "queue_stats.h"
+#include "sched_latency.h"
 
 namespace FreeRTOSpp {
 
@@ -54,17 +63,33 @@ public:
       ESP_LOGW(tag, "task %s is already created", pcName);
       return false;
     }
+    BootProfiler::Scope scope(BootProfiler::TypeTask, pcName);
     BaseType_t result =
         xTaskCreatePinnedToCore(entry_point, pcName, usStackDepth, this,
                                 uxPriority, &pxCreatedTask, xCoreID);
-    return result == pdPASS;
+    scope.setTask(pxCreatedTask);
+    if (result != pdPASS)
+      return false;
+    this->pcName = pcName;
+    this->usStackDepth = usStackDepth;
+    MemoryAccounting::add("Task", pcName,
+                          MemoryAccounting::taskBytes(usStackDepth), 0);
+    SchedLatency::add(pxCreatedTask, pcName);
+    return true;
   }
+  /**
+   * @brief タスクハンドルを取得する関数
+   */
+  TaskHandle_t getTaskHandle() const { return pxCreatedTask; }
   /**
    * @brief タスクを終了し，削除する関数
    */
   void terminate() {
     if (pxCreatedTask == NULL)
       return;
+    MemoryAccounting::remove("Task", pcName,
+                             MemoryAccounting::taskBytes(usStackDepth), 0);
+    SchedLatency::remove(pxCreatedTask);
     vTaskDelete(pxCreatedTask);
     pxCreatedTask = NULL;
   }
@@ -72,6 +97,8 @@ public:
 private:
   const char *tag = "Task";
   TaskHandle_t pxCreatedTask = NULL; //< タスクのハンドル
+  const char *pcName = NULL;         //< タスク名文字列
+  unsigned short usStackDepth = 0;   //< スタックサイズ
   T *obj = NULL;                     //< thisポインタ
   void (T::*func)() = NULL;          //< メンバ関数ポインタ
 
@@ -80,6 +107,7 @@ private:
    */
   static void entry_point(void *arg) {
     auto task_obj = static_cast<Task *>(arg);
+    BootProfiler::firstRun();
     (task_obj->obj->*task_obj->func)();
   }
 };
@@ -117,15 +145,40 @@ public:
       ESP_LOGW(tag, "task \"%s\" is already created", pcName);
       return false;
     }
+    this->pcName = pcName;
+    this->uxPriority = uxPriority;
+    this->usStackDepth = usStackDepth;
+    this->xCoreID = xCoreID;
+    BootProfiler::Scope scope(BootProfiler::TypeTask, pcName);
     BaseType_t res =
         xTaskCreatePinnedToCore(pxTaskCode, pcName, usStackDepth, this,
                                 uxPriority, &pxCreatedTask, xCoreID);
+    scope.setTask(pxCreatedTask);
     if (res != pdPASS) {
       ESP_LOGW(tag, "couldn't create the task \"%s\"", pcName);
       return false;
     }
+    MemoryAccounting::add("TaskBase", pcName,
+                          MemoryAccounting::taskBytes(usStackDepth), 0);
+    SchedLatency::add(pxCreatedTask, pcName);
     return true;
   }
+  /**
+   * @brief タスクを削除し，指定したコアで同じ設定のまま生成し直す関数
+   * task() は先頭から実行し直されるので，再実行に耐えるタスクでのみ使うこと．
+   *
+   * @param xCoreID 新しい実行コア
+   * @return true 成功
+   * @return false 失敗
+   */
+  bool recreateTask(const BaseType_t xCoreID) {
+    if (pxCreatedTask == NULL) {
+      ESP_LOGW(tag, "task is not created");
+      return false;
+    }
+    deleteTask();
+    return createTask(pcName, uxPriority, usStackDepth, xCoreID);
+  }
   /**
    * @brief タスクを削除する関数
    */
@@ -134,13 +187,33 @@ public:
       ESP_LOGW(tag, "task is not created");
       return;
     }
+    MemoryAccounting::remove("TaskBase", pcName,
+                             MemoryAccounting::taskBytes(usStackDepth), 0);
+    SchedLatency::remove(pxCreatedTask);
     vTaskDelete(pxCreatedTask);
     pxCreatedTask = NULL;
   }
 
+  /**
+   * @brief タスクハンドルを取得する関数
+   */
+  TaskHandle_t getTaskHandle() const { return pxCreatedTask; }
+  /**
+   * @brief タスク名を取得する関数
+   */
+  const char *getTaskName() const { return pcName; }
+  /**
+   * @brief 生成時に指定した実行コアを取得する関数
+   */
+  BaseType_t getCoreID() const { return xCoreID; }
+
 protected:
   const char *tag = "TaskBase";
   TaskHandle_t pxCreatedTask; //< タスクのハンドル
+  const char *pcName = NULL;                       //< タスク名文字列
+  UBaseType_t uxPriority = 0;                      //< タスク優先度
+  uint16_t usStackDepth = configMINIMAL_STACK_SIZE; //< スタックサイズ
+  BaseType_t xCoreID = tskNO_AFFINITY;             //< 実行コア
 
   /**
    * @brief FreeRTOS
@@ -152,6 +225,7 @@ protected:
    * @param pvParameters this ポインタ
    */
   static void pxTaskCode(void *const pvParameters) {
+    BootProfiler::firstRun();
     static_cast<TaskBase *>(pvParameters)->task();
   }
 };
@@ -162,12 +236,19 @@ protected:
 class Semaphore {
 public:
   Semaphore() {
+    BootProfiler::Scope scope(BootProfiler::TypeSemaphore);
     xSemaphore = xSemaphoreCreateBinary();
     if (xSemaphore == NULL) {
       ESP_LOGE(tag, "xSemaphoreCreateBinary() failed");
     }
+    MemoryAccounting::add("Semaphore", NULL,
+                          MemoryAccounting::semaphoreBytes(), sizeof(*this));
+  }
+  ~Semaphore() {
+    MemoryAccounting::remove("Semaphore", NULL,
+                             MemoryAccounting::semaphoreBytes(), sizeof(*this));
+    vSemaphoreDelete(xSemaphore);
   }
-  ~Semaphore() { vSemaphoreDelete(xSemaphore); }
   bool giveFromISR() {
     return pdTRUE == xSemaphoreGiveFromISR(xSemaphore, NULL);
   }
@@ -175,6 +256,10 @@ public:
   bool take(portTickType xBlockTime = portMAX_DELAY) {
     return pdTRUE == xSemaphoreTake(xSemaphore, xBlockTime);
   }
+  bool take(const Deadline &deadline) {
+    return take(deadline.remaining());
+  }
+  SemaphoreHandle_t getHandle() const { return xSemaphore; }
 
 private:
   const char *tag = "Semaphore";
@@ -187,23 +272,290 @@ private:
 class Mutex {
 public:
   Mutex() {
+    BootProfiler::Scope scope(BootProfiler::TypeMutex);
     xSemaphore = xSemaphoreCreateMutex();
     if (xSemaphore == NULL) {
       ESP_LOGE(tag, "xSemaphoreCreateMutex() failed");
     }
+    MemoryAccounting::add("Mutex", NULL, MemoryAccounting::semaphoreBytes(),
+                          sizeof(*this));
+  }
+  ~Mutex() {
+    MemoryAccounting::remove("Mutex", NULL, MemoryAccounting::semaphoreBytes(),
+                             sizeof(*this));
+    vSemaphoreDelete(xSemaphore);
   }
-  ~Mutex() { vSemaphoreDelete(xSemaphore); }
   bool giveFromISR() {
     return pdTRUE == xSemaphoreGiveFromISR(xSemaphore, NULL);
   }
   bool give() { return pdTRUE == xSemaphoreGive(xSemaphore); }
   bool take(portTickType xBlockTime = portMAX_DELAY) {
+#if FREERTOSPP_LOCK_STATS
+    return stats.take(xSemaphore, xBlockTime);
+#else
     return pdTRUE == xSemaphoreTake(xSemaphore, xBlockTime);
+#endif
+  }
+  bool take(const Deadline &deadline) {
+    return take(deadline.remaining());
   }
+  /**
+   * @brief 競合の統計に表示する名前を設定する関数
+   */
+  void setName(const char *name) {
+#if FREERTOSPP_LOCK_STATS
+    stats.setName(name);
+#else
+    (void)name;
+#endif
+  }
+  SemaphoreHandle_t getHandle() const { return xSemaphore; }
 
 private:
   const char *tag = "Mutex";
   SemaphoreHandle_t xSemaphore = NULL;
+#if FREERTOSPP_LOCK_STATS
+  LockStats stats;
+#endif
+};
+
+/**
+ * @brief C++ Wrapper for Queue function
+ *
+ * @tparam T 要素の型
+ */
+template <typename T> class Queue {
+public:
+  explicit Queue(UBaseType_t uxLength)
+      : uxLength(uxLength)
+#if FREERTOSPP_QUEUE_STATS
+        , stats(uxLength)
+#endif
+  {
+    xQueue = xQueueCreate(uxLength, sizeof(T));
+    if (xQueue == NULL) {
+      ESP_LOGE(tag, "xQueueCreate() failed");
+    }
+    MemoryAccounting::add("Queue", NULL,
+                          MemoryAccounting::queueBytes(uxLength, sizeof(T)),
+                          sizeof(*this));
+  }
+  ~Queue() {
+    MemoryAccounting::remove("Queue", NULL,
+                             MemoryAccounting::queueBytes(uxLength, sizeof(T)),
+                             sizeof(*this));
+    vQueueDelete(xQueue);
+  }
+  Queue(const Queue &) = delete;
+  Queue &operator=(const Queue &) = delete;
+
+  bool send(const T &item, TickType_t xBlockTime = portMAX_DELAY) {
+#if FREERTOSPP_QUEUE_STATS
+    if (pdTRUE != xQueueSendToBack(xQueue, &item, 0)) {
+      stats.full();
+      if (xBlockTime == 0 ||
+          pdTRUE != xQueueSendToBack(xQueue, &item, xBlockTime))
+        return false;
+    }
+    stats.sent();
+    return true;
+#else
+    return pdTRUE == xQueueSendToBack(xQueue, &item, xBlockTime);
+#endif
+  }
+  bool send(const T &item, const Deadline &deadline) {
+    return send(item, deadline.remaining());
+  }
+  bool sendToFront(const T &item, TickType_t xBlockTime = portMAX_DELAY) {
+#if FREERTOSPP_QUEUE_STATS
+    if (pdTRUE != xQueueSendToFront(xQueue, &item, 0)) {
+      stats.full();
+      if (xBlockTime == 0 ||
+          pdTRUE != xQueueSendToFront(xQueue, &item, xBlockTime))
+        return false;
+    }
+    stats.sentToFront();
+    return true;
+#else
+    return pdTRUE == xQueueSendToFront(xQueue, &item, xBlockTime);
+#endif
+  }
+  bool sendToFront(const T &item, const Deadline &deadline) {
+    return sendToFront(item, deadline.remaining());
+  }
+  bool sendFromISR(const T &item,
+                   BaseType_t *pxHigherPriorityTaskWoken = NULL) {
+#if FREERTOSPP_QUEUE_STATS
+    if (pdTRUE !=
+        xQueueSendFromISR(xQueue, &item, pxHigherPriorityTaskWoken)) {
+      stats.full();
+      return false;
+    }
+    stats.sentFromISR();
+    return true;
+#else
+    return pdTRUE ==
+           xQueueSendFromISR(xQueue, &item, pxHigherPriorityTaskWoken);
+#endif
+  }
+  bool receive(T &item, TickType_t xBlockTime = portMAX_DELAY) {
+#if FREERTOSPP_QUEUE_STATS
+    if (pdTRUE != xQueueReceive(xQueue, &item, 0)) {
+      stats.empty();
+      if (xBlockTime == 0 ||
+          pdTRUE != xQueueReceive(xQueue, &item, xBlockTime))
+        return false;
+    }
+    stats.received();
+    return true;
+#else
+    return pdTRUE == xQueueReceive(xQueue, &item, xBlockTime);
+#endif
+  }
+  bool receive(T &item, const Deadline &deadline) {
+    return receive(item, deadline.remaining());
+  }
+  bool peek(T &item, TickType_t xBlockTime = 0) {
+    return pdTRUE == xQueuePeek(xQueue, &item, xBlockTime);
+  }
+  bool peek(T &item, const Deadline &deadline) {
+    return peek(item, deadline.remaining());
+  }
+  UBaseType_t size() const { return uxQueueMessagesWaiting(xQueue); }
+  UBaseType_t capacity() const { return uxLength; }
+  QueueHandle_t getHandle() const { return xQueue; }
+  /**
+   * @brief 統計に表示する名前を設定する関数
+   */
+  void setName(const char *name) {
+#if FREERTOSPP_QUEUE_STATS
+    stats.setName(name);
+#else
+    (void)name;
+#endif
+  }
+
+private:
+  const char *tag = "Queue";
+  QueueHandle_t xQueue = NULL;
+  UBaseType_t uxLength;
+#if FREERTOSPP_QUEUE_STATS
+  QueueStats stats;
+#endif
+};
+
+/**
+ * @brief C++ Wrapper for EventGroup function
+ */
+class EventGroup {
+public:
+  EventGroup() {
+    xEventGroup = xEventGroupCreate();
+    if (xEventGroup == NULL) {
+      ESP_LOGE(tag, "xEventGroupCreate() failed");
+    }
+    MemoryAccounting::add("EventGroup", NULL, sizeof(StaticEventGroup_t),
+                          sizeof(*this));
+  }
+  ~EventGroup() {
+    MemoryAccounting::remove("EventGroup", NULL, sizeof(StaticEventGroup_t),
+                             sizeof(*this));
+    vEventGroupDelete(xEventGroup);
+    if (xSignal != NULL)
+      vSemaphoreDelete(xSignal);
+  }
+  EventGroup(const EventGroup &) = delete;
+  EventGroup &operator=(const EventGroup &) = delete;
+
+  /**
+   * @brief ビットを立てる関数
+   * WaitSet に登録されていれば，待っているタスクも起こす．
+   */
+  EventBits_t setBits(EventBits_t uxBits) {
+    const EventBits_t res = xEventGroupSetBits(xEventGroup, uxBits);
+    portENTER_CRITICAL(&signalMux);
+    const SemaphoreHandle_t xSignal = this->xSignal;
+    if (xSignal != NULL)
+      ++uxSignalUsers;
+    portEXIT_CRITICAL(&signalMux);
+    if (xSignal != NULL) {
+      xSemaphoreGive(xSignal);
+      portENTER_CRITICAL(&signalMux);
+      --uxSignalUsers;
+      portEXIT_CRITICAL(&signalMux);
+    }
+    return res;
+  }
+  /**
+   * @brief 割り込みからビットを立てる関数
+   * xEventGroupSetBitsFromISR() と同じくタイマタスクに setBits() を頼むので，
+   * WaitSet にはビットが立った後に通知される．
+   */
+  bool setBitsFromISR(EventBits_t uxBits,
+                      BaseType_t *pxHigherPriorityTaskWoken = NULL) {
+    return pdPASS == xTimerPendFunctionCallFromISR(setBitsCallback, this,
+                                                   uxBits,
+                                                   pxHigherPriorityTaskWoken);
+  }
+  EventBits_t clearBits(EventBits_t uxBits) {
+    return xEventGroupClearBits(xEventGroup, uxBits);
+  }
+  EventBits_t getBits() const { return xEventGroupGetBits(xEventGroup); }
+  /**
+   * @brief ビットが立つまで待つ関数
+   *
+   * @return 戻る直前のビット．条件を満たさなければ時間切れ
+   */
+  EventBits_t waitBits(EventBits_t uxBits, bool clearOnExit = true,
+                       bool waitForAll = false,
+                       TickType_t xBlockTime = portMAX_DELAY) {
+    return xEventGroupWaitBits(xEventGroup, uxBits, clearOnExit, waitForAll,
+                               xBlockTime);
+  }
+  EventBits_t waitBits(EventBits_t uxBits, bool clearOnExit, bool waitForAll,
+                       const Deadline &deadline) {
+    return waitBits(uxBits, clearOnExit, waitForAll, deadline.remaining());
+  }
+  EventGroupHandle_t getHandle() const { return xEventGroup; }
+
+private:
+  template <size_t N> friend class WaitSet;
+  const char *tag = "EventGroup";
+  EventGroupHandle_t xEventGroup = NULL;
+  /* xSignal は WaitSet に登録したときの通知用．setBits() は signalMux の
+     中で写して使用中の数を増やすので，外すときは NULL にしてから使用中の
+     ものがなくなるのを待って削除する */
+  portMUX_TYPE signalMux = portMUX_INITIALIZER_UNLOCKED;
+  SemaphoreHandle_t xSignal = NULL;
+  UBaseType_t uxSignalUsers = 0;
+
+  static void setBitsCallback(void *pvParameter, uint32_t ulParameter) {
+    static_cast<EventGroup *>(pvParameter)->setBits(ulParameter);
+  }
+  bool hasSignal() {
+    portENTER_CRITICAL(&signalMux);
+    const bool res = xSignal != NULL;
+    portEXIT_CRITICAL(&signalMux);
+    return res;
+  }
+  void setSignal(SemaphoreHandle_t xSignal) {
+    portENTER_CRITICAL(&signalMux);
+    this->xSignal = xSignal;
+    portEXIT_CRITICAL(&signalMux);
+  }
+  /**
+   * @brief 通知用のセマフォを外し，setBits() が使い終わるまで待つ
+   */
+  void clearSignal() {
+    portENTER_CRITICAL(&signalMux);
+    xSignal = NULL;
+    while (uxSignalUsers > 0) {
+      portEXIT_CRITICAL(&signalMux);
+      vTaskDelay(1);
+      portENTER_CRITICAL(&signalMux);
+    }
+    portEXIT_CRITICAL(&signalMux);
+  }
 };
 
 } // namespace FreeRTOSpp
\ No newline at end of file
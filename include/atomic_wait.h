@@ -0,0 +1,189 @@
+/**
+ * @brief Wait on the address of an atomic variable, like C++20 atomic::wait
+ *
+ * @file atomic_wait.h
+ */
+#pragma once
+
+#ifndef FREERTOSPP_ATOMIC_WAIT_BUCKETS
+#define FREERTOSPP_ATOMIC_WAIT_BUCKETS 32
+#endif
+
+#include "deadline.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief アドレスをキーにした待ち行列の表
+ *
+ * 待つタスクは自分のスタックに置いた節をアドレスのハッシュで選んだ
+ * バケットにつなぎ，節の中に静的に作ったバイナリセマフォで眠る．
+ * タスク通知は使わないので，利用者のコードが使う通知の値や数には触れない．
+ * 表は全体で1つなので，これを使う同期プリミティブはカーネルオブジェクトを
+ * 持たなくてよい (configSUPPORT_STATIC_ALLOCATION が必要)．
+ */
+class AtomicWait {
+public:
+  /**
+   * @brief pred() が true の間，addr への通知を待つ関数
+   *
+   * pred() はバケットのロックの中でも呼ばれるので，短く，ブロックしないこと．
+   * 通知する側は，値を変えてから notifyOne() / notifyAll() を呼ぶこと．
+   *
+   * @return true pred() が false になった
+   * @return false 時間切れ
+   */
+  template <typename Pred>
+  static bool wait(const void *addr, Pred pred,
+                   TickType_t xBlockTime = portMAX_DELAY) {
+    return wait(addr, pred, Deadline(xBlockTime));
+  }
+  template <typename Pred>
+  static bool wait(const void *addr, Pred pred, const Deadline &deadline) {
+    if (!pred())
+      return true;
+    Bucket &b = bucket(addr);
+    Waiter w(addr);
+    while (1) {
+      w.notified = false;
+      portENTER_CRITICAL(&b.mux);
+      /* 値を変えてから通知されるので，ロックの中で確かめれば取りこぼさない */
+      if (!pred()) {
+        portEXIT_CRITICAL(&b.mux);
+        return true;
+      }
+      w.next = b.head;
+      b.head = &w;
+      portEXIT_CRITICAL(&b.mux);
+      while (pdTRUE != xSemaphoreTake(w.xSignal, deadline.remaining())) {
+        if (!deadline.expired())
+          continue;
+        portENTER_CRITICAL(&b.mux);
+        const bool notified = w.notified;
+        if (!notified)
+          unlink(b, &w);
+        portEXIT_CRITICAL(&b.mux);
+        if (!notified)
+          return !pred();
+        /* 外された後は与えられるまで w を破棄できないので，受け取っておく */
+        xSemaphoreTake(w.xSignal, portMAX_DELAY);
+        break;
+      }
+      if (!pred())
+        return true;
+    }
+  }
+  /**
+   * @brief addr を待っているタスクを1つ起こす関数
+   */
+  static void notifyOne(const void *addr) { notify(addr, false); }
+  /**
+   * @brief addr を待っているタスクをすべて起こす関数
+   */
+  static void notifyAll(const void *addr) { notify(addr, true); }
+
+private:
+  /**
+   * @brief 待つタスクのスタックに置く節
+   * notify() が列から外して notified を立てた後は，セマフォを与えるまで
+   * 節に触れるので，待つ側はセマフォを受け取るまで破棄しない．
+   */
+  struct Waiter {
+    explicit Waiter(const void *addr)
+        : addr(addr), xSignal(xSemaphoreCreateBinaryStatic(&buffer)) {}
+    ~Waiter() { vSemaphoreDelete(xSignal); }
+    Waiter(const Waiter &) = delete;
+    Waiter &operator=(const Waiter &) = delete;
+
+    const void *addr;
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t xSignal;
+    bool notified = false; //< バケットのロックの中で読み書きする
+    Waiter *next = nullptr;
+  };
+  struct Bucket {
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    Waiter *head = nullptr;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static Bucket &bucket(const void *addr) {
+    static Bucket buckets[FREERTOSPP_ATOMIC_WAIT_BUCKETS];
+    uintptr_t h = uintptr_t(addr) >> 2;
+    h ^= h >> 7;
+    h ^= h >> 13;
+    return buckets[h % FREERTOSPP_ATOMIC_WAIT_BUCKETS];
+  }
+  static void unlink(Bucket &b, Waiter *w) {
+    for (Waiter **p = &b.head; *p != nullptr; p = &(*p)->next) {
+      if (*p == w) {
+        *p = w->next;
+        return;
+      }
+    }
+  }
+  static void notify(const void *addr, bool all) {
+    Bucket &b = bucket(addr);
+    Waiter *woken = nullptr;
+    portENTER_CRITICAL(&b.mux);
+    for (Waiter **p = &b.head; *p != nullptr;) {
+      Waiter *w = *p;
+      if (w->addr != addr) {
+        p = &w->next;
+        continue;
+      }
+      *p = w->next;
+      w->notified = true;
+      w->next = woken;
+      woken = w;
+      if (!all)
+        break;
+    }
+    portEXIT_CRITICAL(&b.mux);
+    while (woken != nullptr) {
+      /* 与えた時点で w は待ち側のスタックから消えうる */
+      Waiter *w = woken;
+      woken = w->next;
+      xSemaphoreGive(w->xSignal);
+    }
+  }
+};
+
+/**
+ * @brief obj の値が old でなくなるまで待つ関数 (std::atomic::wait 相当)
+ *
+ * @return false 時間切れ
+ */
+template <typename T>
+bool atomicWait(const std::atomic<T> &obj, T old,
+                TickType_t xBlockTime = portMAX_DELAY) {
+  return AtomicWait::wait(
+      &obj, [&]() { return obj.load(std::memory_order_acquire) == old; },
+      xBlockTime);
+}
+template <typename T>
+bool atomicWait(const std::atomic<T> &obj, T old, const Deadline &deadline) {
+  return AtomicWait::wait(
+      &obj, [&]() { return obj.load(std::memory_order_acquire) == old; },
+      deadline);
+}
+/**
+ * @brief obj を待っているタスクを1つ起こす関数 (std::atomic::notify_one 相当)
+ */
+template <typename T> void atomicNotifyOne(const std::atomic<T> &obj) {
+  AtomicWait::notifyOne(&obj);
+}
+/**
+ * @brief obj を待っているタスクをすべて起こす関数
+ * (std::atomic::notify_all 相当)
+ */
+template <typename T> void atomicNotifyAll(const std::atomic<T> &obj) {
+  AtomicWait::notifyAll(&obj);
+}
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,273 @@
+/**
+ * @brief Startup timeline of task and primitive creation
+ *
+ * @file boot_profiler.h
+ *
+ * FREERTOSPP_BOOT_PROFILER を 1 にして全体をビルドすると有効になる．
+ * 無効のときはすべての記録が空の関数になる．生成時間の計測は
+ * BootProfiler::Scope にまとめてあり，同期プリミティブの分は
+ * CreationProfile (FREERTOSPP_CREATION_PROFILE) の集計にも加える．
+ */
+#pragma once
+
+#ifndef FREERTOSPP_BOOT_PROFILER
+#define FREERTOSPP_BOOT_PROFILER 0
+#endif
+#ifndef FREERTOSPP_BOOT_PROFILER_EVENTS
+#define FREERTOSPP_BOOT_PROFILER_EVENTS 128
+#endif
+
+#include "creation_profile.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if FREERTOSPP_BOOT_PROFILER || FREERTOSPP_CREATION_PROFILE
+#include "esp_timer.h"
+#endif
+#if FREERTOSPP_BOOT_PROFILER
+#include <atomic>
+#include <cstring>
+#endif
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 起動時のタスクと同期プリミティブの生成を時系列で記録するクラス
+ *
+ * 生成にかかった時間と，各タスクが初めて実行された時刻を記録する．
+ * print() は時系列を表示し，最後の出来事に至るまでの依存の連鎖
+ * (クリティカルパス) に印をつける．
+ */
+class BootProfiler {
+public:
+  enum Type {
+    TypeTask,          //< Task<T>::start, TaskBase::createTask
+    TypeThread,        //< Thread の生成
+    TypeSemaphore,     //< Semaphore の生成
+    TypeMutex,         //< Mutex の生成
+    TypeLazySemaphore, //< LazySemaphore の初回使用
+    TypeLazyMutex,     //< LazyMutex の初回使用
+    TypeFirstRun,      //< タスクの初回実行
+    TypeMark,          //< mark() による目印
+  };
+
+#if FREERTOSPP_BOOT_PROFILER || FREERTOSPP_CREATION_PROFILE
+  /**
+   * @brief 生成にかかった時間を記録する RAII オブジェクト
+   * 同期プリミティブの生成は CreationProfile の集計にも加える．
+   */
+  class Scope {
+  public:
+    Scope(Type type, const char *name = "")
+        : type(type), name(name), start(esp_timer_get_time()) {}
+    ~Scope() {
+      const int64_t end = esp_timer_get_time();
+#if FREERTOSPP_CREATION_PROFILE
+      const CreationProfile::Kind kind = creationKind(type);
+      if (kind != CreationProfile::KindCount)
+        CreationProfile::record(kind, end - start);
+#endif
+#if FREERTOSPP_BOOT_PROFILER
+      BootProfiler::append(type, name, start, end, task);
+#endif
+    }
+    /**
+     * @brief 生成したタスクを設定する関数
+     */
+    void setTask(TaskHandle_t task) { this->task = task; }
+
+  private:
+    Type type;
+    const char *name;
+    int64_t start;
+    TaskHandle_t task = NULL;
+
+    static CreationProfile::Kind creationKind(Type type) {
+      switch (type) {
+      case TypeSemaphore:
+        return CreationProfile::KindSemaphore;
+      case TypeMutex:
+        return CreationProfile::KindMutex;
+      case TypeLazySemaphore:
+        return CreationProfile::KindLazySemaphore;
+      case TypeLazyMutex:
+        return CreationProfile::KindLazyMutex;
+      default:
+        return CreationProfile::KindCount;
+      }
+    }
+  };
+#else
+  class Scope {
+  public:
+    Scope(Type, const char * = "") {}
+    void setTask(TaskHandle_t) {}
+  };
+#endif
+
+#if FREERTOSPP_BOOT_PROFILER
+
+  /**
+   * @brief 現在のタスクの初回実行を記録する関数
+   */
+  static void firstRun() {
+    const int64_t now = esp_timer_get_time();
+    append(TypeFirstRun, pcTaskGetTaskName(NULL), now, now,
+           xTaskGetCurrentTaskHandle());
+  }
+  /**
+   * @brief 任意の目印を記録する関数．最初のパケットの送信などに使う．
+   */
+  static void mark(const char *name) {
+    const int64_t now = esp_timer_get_time();
+    append(TypeMark, name, now, now, NULL);
+  }
+  /**
+   * @brief 記録を止める関数．以降の生成は記録されない．
+   */
+  static void stop() { state().stopped = true; }
+  /**
+   * @brief 時系列とクリティカルパスを表示する関数
+   * 書き込み中の出来事は表示しない．
+   */
+  static void print() {
+    const char *tag = "BootProfiler";
+    static const char *const types[] = {"task",   "thread",   "semaphore",
+                                        "mutex",  "lazy-sem", "lazy-mutex",
+                                        "run",    "mark"};
+    State &s = state();
+    const int next = s.next.load(std::memory_order_relaxed);
+    const int slots = next < FREERTOSPP_BOOT_PROFILER_EVENTS
+                          ? next
+                          : FREERTOSPP_BOOT_PROFILER_EVENTS;
+    /* 書き終えた出来事だけを開始時刻順に並べる */
+    int order[FREERTOSPP_BOOT_PROFILER_EVENTS];
+    int n = 0;
+    for (int i = 0; i < slots; ++i) {
+      if (!s.events[i].ready.load(std::memory_order_acquire))
+        continue;
+      int j = n++;
+      for (; j > 0 && s.events[order[j - 1]].start > s.events[i].start; --j)
+        order[j] = order[j - 1];
+      order[j] = i;
+    }
+    markCriticalPath(order, n);
+    for (int i = 0; i < n; ++i) {
+      const Event &e = s.events[order[i]];
+      ESP_LOGI(tag, "%c %8lld us %+6lld us %-10s %-16s by %s",
+               e.critical ? '*' : ' ', (long long)e.start,
+               (long long)(e.end - e.start), types[e.type], e.name,
+               e.creatorName);
+    }
+    if (next > FREERTOSPP_BOOT_PROFILER_EVENTS)
+      ESP_LOGW(tag, "%d events were dropped",
+               next - FREERTOSPP_BOOT_PROFILER_EVENTS);
+    if (n < slots)
+      ESP_LOGW(tag, "%d events are still being recorded", slots - n);
+  }
+
+private:
+  struct Event {
+    int64_t start;
+    int64_t end;
+    Type type;
+    const char *name;
+    TaskHandle_t creator;     //< 記録したタスク
+    char creatorName[16];     //< 記録したタスクの名前
+    TaskHandle_t task;        //< 生成した，または実行を始めたタスク
+    bool critical;
+    std::atomic<bool> ready;  //< 書き終えた．それまでは読まない
+  };
+  struct State {
+    Event events[FREERTOSPP_BOOT_PROFILER_EVENTS];
+    std::atomic<int> next; //< 次に割り当てる番号
+    volatile bool stopped;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static State &state() {
+    static State s;
+    return s;
+  }
+  static void append(Type type, const char *name, int64_t start, int64_t end,
+                     TaskHandle_t task) {
+    State &s = state();
+    if (s.stopped)
+      return;
+    const int i = s.next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= FREERTOSPP_BOOT_PROFILER_EVENTS)
+      return;
+    Event &e = s.events[i];
+    e.start = start;
+    e.end = end;
+    e.type = type;
+    e.name = name != NULL ? name : "";
+    /* スケジューラ開始前はタスクがない */
+    const bool running =
+        xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED;
+    e.creator = running ? xTaskGetCurrentTaskHandle() : NULL;
+    strncpy(e.creatorName, running ? pcTaskGetTaskName(NULL) : "(init)",
+            sizeof(e.creatorName) - 1);
+    e.task = task;
+    e.critical = false;
+    e.ready.store(true, std::memory_order_release);
+  }
+  /**
+   * @brief 最後の出来事から依存を遡ってクリティカルパスに印をつける
+   *
+   * 初回実行の前にはそのタスクの生成があり，生成の前には同じタスクの
+   * 直前の出来事 (なければそのタスクの初回実行) がある．生成の記録は
+   * 生成関数が戻ってから閉じるので，優先度の高いタスクや他のコアの
+   * タスクはその前に走り始める．そのため初回実行と生成はハンドルだけで
+   * 結びつける．
+   * 目印があれば最後の目印を，なければ最後に終わった出来事を終点とする．
+   */
+  static void markCriticalPath(const int *idx, const int n) {
+    Event *events = state().events;
+    int cur = -1;
+    for (int k = 0; k < n; ++k) {
+      const int i = idx[k];
+      events[i].critical = false;
+      const bool mark = events[i].type == TypeMark;
+      const bool curMark = cur >= 0 && events[cur].type == TypeMark;
+      if (cur < 0 || (mark && !curMark) ||
+          (mark == curMark && events[i].end > events[cur].end))
+        cur = i;
+    }
+    while (cur >= 0) {
+      Event &e = events[cur];
+      e.critical = true;
+      int prev = -1;
+      if (e.type == TypeFirstRun) {
+        for (int k = 0; k < n; ++k) {
+          const int i = idx[k];
+          if (events[i].type != TypeFirstRun && events[i].task == e.task)
+            prev = i;
+        }
+      } else {
+        for (int k = 0; k < n; ++k) {
+          const int i = idx[k];
+          if (i != cur && events[i].type != TypeFirstRun &&
+              events[i].creator == e.creator && events[i].end <= e.start &&
+              (prev < 0 || events[i].end > events[prev].end))
+            prev = i;
+        }
+        if (prev < 0 && e.creator != NULL)
+          for (int k = 0; k < n; ++k) {
+            const int i = idx[k];
+            if (events[i].type == TypeFirstRun && events[i].task == e.creator)
+              prev = i;
+          }
+      }
+      cur = (prev >= 0 && !events[prev].critical) ? prev : -1;
+    }
+  }
+#else
+  static void firstRun() {}
+  static void mark(const char *) {}
+  static void stop() {}
+  static void print() {}
+#endif
+};
+
+} // namespace FreeRTOSpp
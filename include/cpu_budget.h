@@ -0,0 +1,257 @@
+/**
+ * @brief Per-task CPU budgets enforced by demotion or suspension
+ *
+ * @file cpu_budget.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "runtime_stats.h"
+
+#include <utility>
+#include <vector>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 登録されたタスクの CPU 使用時間を補充周期ごとに制限するタスク
+ *
+ * 各タスクは補充周期のうち予算 [%] だけ実行できる．予算を使い切った
+ * タスクは周期の残りの間，優先度を下げられる (Demote) か停止される
+ * (Suspend)．周期の始めに使用時間は 0 に戻り，元の状態に戻される．
+ * 監視タスクは登録するタスクより高い優先度で動かすこと．
+ * 使用時間は監視周期ごとにしか測れないので，超過は最大で監視周期1回分ある．
+ */
+class CpuBudget : public TaskBase {
+public:
+  /**
+   * @brief 予算を使い切ったときの扱い
+   */
+  enum Action {
+    Demote,  //< 優先度を下げる
+    Suspend, //< 停止する．Mutex を持ったまま止まりうるので注意
+  };
+  /**
+   * @brief タスクごとの統計
+   */
+  struct Stats {
+    const char *pcName;     //< タスク名
+    uint8_t ucBudget;       //< 予算 [%]
+    uint8_t ucLoad;         //< 直前の補充周期での使用率 [%]
+    bool throttled;         //< 制限中かどうか
+    uint32_t ulThrottles;   //< 制限した回数
+    TickType_t xThrottled;  //< 制限されていた時間の合計
+  };
+
+  /**
+   * @brief Construct a new Cpu Budget object
+   *
+   * @param xPeriod 補充周期
+   * @param xCheckPeriod 使用時間を測る周期
+   */
+  CpuBudget(TickType_t xPeriod = pdMS_TO_TICKS(100),
+            TickType_t xCheckPeriod = pdMS_TO_TICKS(10))
+      : xPeriod(xPeriod),
+        xCheckPeriod(xCheckPeriod < 1 ? 1
+                     : xCheckPeriod > xPeriod ? xPeriod
+                                              : xCheckPeriod) {}
+  /**
+   * @brief 監視タスクを開始する関数
+   */
+  bool start(UBaseType_t uxPriority = configMAX_PRIORITIES - 2,
+             const uint16_t usStackDepth = 4096,
+             const BaseType_t xCoreID = tskNO_AFFINITY) {
+    return createTask("CpuBudget", uxPriority, usStackDepth, xCoreID);
+  }
+  /**
+   * @brief TaskBase に予算を設定する関数
+   *
+   * @param ucBudget 補充周期あたりの予算 [%]
+   * @param eAction 予算を使い切ったときの扱い
+   * @param uxDemotePriority Demote のときに下げる先の優先度
+   */
+  bool add(TaskBase &task, uint8_t ucBudget, Action eAction = Demote,
+           UBaseType_t uxDemotePriority = tskIDLE_PRIORITY) {
+    return add(task.getTaskHandle(), task.getTaskName(), ucBudget, eAction,
+               uxDemotePriority);
+  }
+  /**
+   * @brief タスクハンドルに予算を設定する関数
+   */
+  bool add(TaskHandle_t xHandle, const char *pcName, uint8_t ucBudget,
+           Action eAction = Demote,
+           UBaseType_t uxDemotePriority = tskIDLE_PRIORITY) {
+    if (xHandle == NULL) {
+      ESP_LOGW(tag, "task is not created");
+      return false;
+    }
+    if (xHandle == pxCreatedTask) {
+      ESP_LOGW(tag, "couldn't add the monitor itself");
+      return false;
+    }
+    mutex.take();
+    for (auto &e : entries) {
+      if (e.xHandle == xHandle) {
+        restore(e, xTaskGetTickCount());
+        e.ucBudget = ucBudget;
+        e.eAction = eAction;
+        e.uxDemotePriority = uxDemotePriority;
+        mutex.give();
+        return true;
+      }
+    }
+    Entry e = {};
+    e.xHandle = xHandle;
+    e.pcName = pcName;
+    e.ucBudget = ucBudget;
+    e.eAction = eAction;
+    e.uxDemotePriority = uxDemotePriority;
+    entries.push_back(e);
+    mutex.give();
+    return true;
+  }
+  /**
+   * @brief 予算を解除する関数．制限中なら元に戻す．タスクを削除する前に呼ぶこと．
+   */
+  void remove(TaskHandle_t xHandle) {
+    mutex.take();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      if (it->xHandle == xHandle) {
+        restore(*it, xTaskGetTickCount());
+        entries.erase(it);
+        break;
+      }
+    }
+    mutex.give();
+  }
+  /**
+   * @brief タスクの統計を取得する関数
+   *
+   * @return false 登録されていない
+   */
+  bool getStats(TaskHandle_t xHandle, Stats &stats) {
+    mutex.take();
+    bool found = false;
+    for (const auto &e : entries) {
+      if (e.xHandle == xHandle) {
+        stats = toStats(e);
+        found = true;
+        break;
+      }
+    }
+    mutex.give();
+    return found;
+  }
+  /**
+   * @brief 全タスクの統計を表示する関数
+   */
+  void print() {
+    mutex.take();
+    for (const auto &e : entries) {
+      const Stats s = toStats(e);
+      ESP_LOGI(tag, "%-16s budget %3u%% load %3u%% throttles %u (%u ticks)%s",
+               s.pcName, s.ucBudget, s.ucLoad, (unsigned)s.ulThrottles,
+               (unsigned)s.xThrottled, s.throttled ? " throttled" : "");
+    }
+    mutex.give();
+  }
+
+protected:
+  const char *tag = "CpuBudget";
+
+  struct Entry {
+    TaskHandle_t xHandle;
+    const char *pcName;
+    uint8_t ucBudget;
+    Action eAction;
+    UBaseType_t uxDemotePriority;
+    UBaseType_t uxPriority;  //< 制限前の優先度
+    uint32_t ulUsed;         //< 現在の補充周期での実行時間
+    uint8_t ucLoad;          //< 直前の補充周期での使用率 [%]
+    bool throttled;
+    TickType_t xThrottledAt; //< 制限を始めた時刻
+    uint32_t ulThrottles;
+    TickType_t xThrottled;
+  };
+
+  Mutex mutex;
+  std::vector<Entry> entries;
+  TickType_t xPeriod;
+  TickType_t xCheckPeriod;
+
+  virtual void task() override {
+    RuntimeSnapshot prev, curr;
+    prev.update();
+    uint32_t ulElapsed = 0; //< 現在の補充周期の経過時間 (実行時間の単位)
+    TickType_t xPeriodStart = xTaskGetTickCount();
+    TickType_t xLastWakeTime = xPeriodStart;
+    while (1) {
+      vTaskDelayUntil(&xLastWakeTime, xCheckPeriod);
+      if (!curr.update())
+        continue;
+      const uint32_t ulCheck = RuntimeSnapshot::elapsed(prev, curr);
+      ulElapsed += ulCheck;
+      const bool replenish = xLastWakeTime - xPeriodStart >= xPeriod;
+      /* 補充周期の長さを実行時間の単位で見積もる */
+      const uint64_t ullPeriod = uint64_t(ulCheck) * xPeriod / xCheckPeriod;
+      mutex.take();
+      for (auto &e : entries) {
+        e.ulUsed += RuntimeSnapshot::runtime(prev, curr, e.xHandle);
+        if (replenish) {
+          e.ucLoad = ulElapsed ? uint64_t(e.ulUsed) * 100 / ulElapsed : 0;
+          e.ulUsed = 0;
+          restore(e, xLastWakeTime);
+        } else if (!e.throttled &&
+                   uint64_t(e.ulUsed) * 100 >= ullPeriod * e.ucBudget) {
+          throttle(e, curr, xLastWakeTime);
+        }
+      }
+      mutex.give();
+      if (replenish) {
+        xPeriodStart = xLastWakeTime;
+        ulElapsed = 0;
+      }
+      std::swap(prev, curr);
+    }
+  }
+
+  void throttle(Entry &e, const RuntimeSnapshot &curr, TickType_t xNow) {
+    const TaskStatus_t *s = curr.find(e.xHandle);
+    if (s == NULL || s->eCurrentState == eDeleted)
+      return;
+    e.throttled = true;
+    e.xThrottledAt = xNow;
+    ++e.ulThrottles;
+    if (e.eAction == Suspend) {
+      vTaskSuspend(e.xHandle);
+    } else {
+      /* Mutex の優先度継承中の値ではなく，本来の優先度を覚えておく */
+      e.uxPriority = s->uxBasePriority;
+      vTaskPrioritySet(e.xHandle, e.uxDemotePriority);
+    }
+  }
+  void restore(Entry &e, TickType_t xNow) {
+    if (!e.throttled)
+      return;
+    e.throttled = false;
+    e.xThrottled += xNow - e.xThrottledAt;
+    if (e.eAction == Suspend)
+      vTaskResume(e.xHandle);
+    else
+      vTaskPrioritySet(e.xHandle, e.uxPriority);
+  }
+  static Stats toStats(const Entry &e) {
+    Stats s;
+    s.pcName = e.pcName;
+    s.ucBudget = e.ucBudget;
+    s.ucLoad = e.ucLoad;
+    s.throttled = e.throttled;
+    s.ulThrottles = e.ulThrottles;
+    s.xThrottled = e.xThrottled;
+    if (e.throttled)
+      s.xThrottled += xTaskGetTickCount() - e.xThrottledAt;
+    return s;
+  }
+};
+
+} // namespace FreeRTOSpp
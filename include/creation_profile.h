@@ -0,0 +1,82 @@
+/**
+ * @brief Time spent creating kernel objects for synchronisation primitives
+ *
+ * @file creation_profile.h
+ *
+ * FREERTOSPP_CREATION_PROFILE を 1 にして全体をビルドすると有効になる．
+ * 時間は BootProfiler::Scope が計って record() に渡す．
+ */
+#pragma once
+
+#ifndef FREERTOSPP_CREATION_PROFILE
+#define FREERTOSPP_CREATION_PROFILE 0
+#endif
+
+#include "esp_log.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 同期プリミティブのカーネルオブジェクト生成にかかった時間の集計
+ * 起動時の静的初期化でどれだけ時間を使っているかを調べるために使う．
+ */
+class CreationProfile {
+public:
+  enum Kind {
+    KindSemaphore,
+    KindMutex,
+    KindLazySemaphore,
+    KindLazyMutex,
+    KindCount,
+  };
+  /**
+   * @brief 種類ごとの集計
+   */
+  struct Entry {
+    uint32_t count; //< 生成した数
+    uint32_t us;    //< 生成にかかった時間の合計 [us]
+  };
+
+  static void record(Kind kind, uint32_t us) {
+    counters()[kind].count.fetch_add(1, std::memory_order_relaxed);
+    counters()[kind].us.fetch_add(us, std::memory_order_relaxed);
+  }
+  static Entry get(Kind kind) {
+    Entry e;
+    e.count = counters()[kind].count.load(std::memory_order_relaxed);
+    e.us = counters()[kind].us.load(std::memory_order_relaxed);
+    return e;
+  }
+  /**
+   * @brief 集計を表示する関数
+   */
+  static void print() {
+    const char *tag = "CreationProfile";
+    static const char *const names[KindCount] = {"Semaphore", "Mutex",
+                                                 "LazySemaphore", "LazyMutex"};
+    uint32_t total = 0;
+    for (int i = 0; i < KindCount; ++i) {
+      const Entry e = get(Kind(i));
+      total += e.us;
+      ESP_LOGI(tag, "%-14s %5u created, %7u us", names[i], (unsigned)e.count,
+               (unsigned)e.us);
+    }
+    ESP_LOGI(tag, "total %u us", (unsigned)total);
+  }
+
+private:
+  struct Counter {
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> us;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static Counter *counters() {
+    static Counter c[KindCount];
+    return c;
+  }
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,233 @@
+/**
+ * @brief Credit-based flow-controlled channel between tasks
+ *
+ * @file credit_channel.h
+ */
+#pragma once
+
+#include "deadline.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "memory_accounting.h"
+#include "queue_stats.h"
+
+#include <atomic>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief クレジット方式の流量制御付きチャネル
+ *
+ * 送信側は1つ送るごとにクレジットを1つ消費し，クレジットがなければ
+ * 待つか (send) 捨てる (trySend)．受信側は受け取った数を貯めておき，
+ * uxBatch 個ごと，または受信待ちに入る前にまとめてクレジットを返す．
+ * 使用メモリは常に uxCapacity 個分に収まる．
+ *
+ * @tparam T 要素の型
+ */
+template <typename T> class CreditChannel {
+public:
+  /**
+   * @brief 統計情報
+   */
+  struct Stats {
+    uint32_t sent;              //< 送信した数
+    uint32_t shed;              //< クレジットがなく捨てた数
+    uint32_t received;          //< 受信した数
+    uint32_t grants;            //< クレジットを返した回数
+    TickType_t producerStall;   //< 送信側がクレジットを待った時間の合計
+    TickType_t consumerStall;   //< 受信側が空のキューを待った時間の合計
+    UBaseType_t maxInFlight;    //< 未返却クレジットの最大数
+    uint8_t utilisation;        //< 受信時点のキュー使用率の平均 [%]
+  };
+
+  /**
+   * @brief Construct a new Credit Channel object
+   *
+   * @param uxCapacity 容量 (= クレジットの総数)
+   * @param uxBatch まとめて返すクレジットの数
+   */
+  CreditChannel(UBaseType_t uxCapacity, UBaseType_t uxBatch = 1)
+      : uxCapacity(uxCapacity), uxBatch(uxBatch ? uxBatch : 1)
+#if FREERTOSPP_QUEUE_STATS
+        , queueStats(uxCapacity)
+#endif
+  {
+    xQueue = xQueueCreate(uxCapacity, sizeof(T));
+    xCredits = xSemaphoreCreateCounting(uxCapacity, uxCapacity);
+    if (xQueue == NULL || xCredits == NULL) {
+      ESP_LOGE(tag, "xQueueCreate() or xSemaphoreCreateCounting() failed");
+    }
+    MemoryAccounting::add("CreditChannel", NULL, heapBytes(), sizeof(*this));
+  }
+  ~CreditChannel() {
+    MemoryAccounting::remove("CreditChannel", NULL, heapBytes(),
+                             sizeof(*this));
+    if (xQueue != NULL)
+      vQueueDelete(xQueue);
+    if (xCredits != NULL)
+      vSemaphoreDelete(xCredits);
+  }
+  /**
+   * @brief クレジットを待って送信する関数
+   *
+   * @param xBlockTime クレジットを待つ時間
+   * @return true 送信した
+   * @return false タイムアウトして捨てた
+   */
+  bool send(const T &item, TickType_t xBlockTime = portMAX_DELAY) {
+    if (xSemaphoreTake(xCredits, 0) != pdTRUE) {
+#if FREERTOSPP_QUEUE_STATS
+      queueStats.full();
+#endif
+      if (xBlockTime == 0)
+        return shed();
+      const TickType_t xStart = xTaskGetTickCount();
+      const bool res = xSemaphoreTake(xCredits, xBlockTime) == pdTRUE;
+      producerStall.fetch_add(xTaskGetTickCount() - xStart,
+                              std::memory_order_relaxed);
+      if (!res)
+        return shed();
+    }
+    /* クレジットがあるので必ず空きがある */
+    xQueueSend(xQueue, &item, 0);
+#if FREERTOSPP_QUEUE_STATS
+    queueStats.sent();
+#endif
+    sent.fetch_add(1, std::memory_order_relaxed);
+    updateInFlight();
+    return true;
+  }
+  bool send(const T &item, const Deadline &deadline) {
+    return send(item, deadline.remaining());
+  }
+  /**
+   * @brief クレジットがなければ捨てる送信関数
+   */
+  bool trySend(const T &item) { return send(item, 0); }
+  /**
+   * @brief 受信する関数
+   * キューが空なら，待つ前に貯めていたクレジットを返す．
+   *
+   * @param xBlockTime 待ち時間
+   * @return true 受信した
+   * @return false タイムアウト
+   */
+  bool receive(T &item, TickType_t xBlockTime = portMAX_DELAY) {
+    if (xQueueReceive(xQueue, &item, 0) != pdTRUE) {
+#if FREERTOSPP_QUEUE_STATS
+      queueStats.empty();
+#endif
+      grant();
+      if (xBlockTime == 0)
+        return false;
+      const TickType_t xStart = xTaskGetTickCount();
+      const bool res = xQueueReceive(xQueue, &item, xBlockTime) == pdTRUE;
+      consumerStall.fetch_add(xTaskGetTickCount() - xStart,
+                              std::memory_order_relaxed);
+      if (!res)
+        return false;
+    }
+#if FREERTOSPP_QUEUE_STATS
+    queueStats.received();
+#endif
+    const UBaseType_t uxOccupancy = uxQueueMessagesWaiting(xQueue) + 1;
+    portENTER_CRITICAL(&mux);
+    occupancySum += uxOccupancy;
+    ++occupancyCount;
+    portEXIT_CRITICAL(&mux);
+    received.fetch_add(1, std::memory_order_relaxed);
+    if (++uxPending >= uxBatch)
+      grant();
+    return true;
+  }
+  bool receive(T &item, const Deadline &deadline) {
+    return receive(item, deadline.remaining());
+  }
+  /**
+   * @brief 貯めていたクレジットを送信側に返す関数 (受信側)
+   */
+  void grant() {
+    if (uxPending == 0)
+      return;
+    for (; uxPending > 0; --uxPending)
+      xSemaphoreGive(xCredits);
+    grants.fetch_add(1, std::memory_order_relaxed);
+  }
+  /**
+   * @brief 統計情報を取得する関数
+   */
+  Stats getStats() const {
+    Stats s;
+    s.sent = sent.load(std::memory_order_relaxed);
+    s.shed = shedCount.load(std::memory_order_relaxed);
+    s.received = received.load(std::memory_order_relaxed);
+    s.grants = grants.load(std::memory_order_relaxed);
+    s.producerStall = producerStall.load(std::memory_order_relaxed);
+    s.consumerStall = consumerStall.load(std::memory_order_relaxed);
+    s.maxInFlight = maxInFlight.load(std::memory_order_relaxed);
+    portENTER_CRITICAL(&mux);
+    const uint64_t sum = occupancySum;
+    const uint32_t count = occupancyCount;
+    portEXIT_CRITICAL(&mux);
+    s.utilisation = count ? sum * 100 / (uint64_t(count) * uxCapacity) : 0;
+    return s;
+  }
+  /**
+   * @brief 送信側が現在使えるクレジットの数
+   */
+  UBaseType_t getCredits() const { return uxSemaphoreGetCount(xCredits); }
+  /**
+   * @brief 統計 (FREERTOSPP_QUEUE_STATS) に表示する名前を設定する関数
+   */
+  void setName(const char *name) {
+#if FREERTOSPP_QUEUE_STATS
+    queueStats.setName(name);
+#else
+    (void)name;
+#endif
+  }
+
+private:
+  const char *tag = "CreditChannel";
+  QueueHandle_t xQueue = NULL;
+  SemaphoreHandle_t xCredits = NULL;
+  const UBaseType_t uxCapacity;
+  const UBaseType_t uxBatch;
+  UBaseType_t uxPending = 0; //< 受信側が貯めているクレジット
+  /* 32 ビットの CPU では 64 ビットの読み書きが分かれるので mux で守る */
+  mutable portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  uint64_t occupancySum = 0;   //< 受信側のみ更新
+  uint32_t occupancyCount = 0; //< occupancySum に加えた数
+  std::atomic<uint32_t> sent{0};
+  std::atomic<uint32_t> shedCount{0};
+  std::atomic<uint32_t> received{0};
+  std::atomic<uint32_t> grants{0};
+  std::atomic<TickType_t> producerStall{0};
+  std::atomic<TickType_t> consumerStall{0};
+  std::atomic<UBaseType_t> maxInFlight{0};
+#if FREERTOSPP_QUEUE_STATS
+  QueueStats queueStats;
+#endif
+
+  size_t heapBytes() const {
+    return MemoryAccounting::queueBytes(uxCapacity, sizeof(T)) +
+           MemoryAccounting::semaphoreBytes();
+  }
+  bool shed() {
+    shedCount.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  void updateInFlight() {
+    const UBaseType_t n = uxCapacity - uxSemaphoreGetCount(xCredits);
+    UBaseType_t m = maxInFlight.load(std::memory_order_relaxed);
+    while (n > m && !maxInFlight.compare_exchange_weak(
+                        m, n, std::memory_order_relaxed))
+      ;
+  }
+};
+
+} // namespace FreeRTOSpp
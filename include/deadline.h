@@ -0,0 +1,52 @@
+/**
+ * @brief Deadline shared by several blocking calls
+ *
+ * @file deadline.h
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 複数の待ちにまたがる期限
+ *
+ * 待ちを伴う関数に渡すと，その時点での残り時間だけ待つ．
+ * 期限を過ぎていても待たずに1回は試すので，Deadline(0) はポーリングになる．
+ * expired() は待ち直すかどうかの判断にだけ使う．
+ */
+class Deadline {
+public:
+  /**
+   * @brief 現在から xTimeout 後を期限とする
+   *
+   * @param xTimeout 持ち時間，portMAX_DELAY なら期限なし
+   */
+  explicit Deadline(TickType_t xTimeout)
+      : xStart(xTaskGetTickCount()), xTimeout(xTimeout) {}
+  /**
+   * @brief 期限なし
+   */
+  static Deadline never() { return Deadline(portMAX_DELAY); }
+  /**
+   * @brief 残り時間
+   */
+  TickType_t remaining() const {
+    if (xTimeout == portMAX_DELAY)
+      return portMAX_DELAY;
+    const TickType_t xElapsed = xTaskGetTickCount() - xStart;
+    return xElapsed >= xTimeout ? 0 : xTimeout - xElapsed;
+  }
+  /**
+   * @brief 期限を過ぎたかどうか
+   */
+  bool expired() const { return remaining() == 0; }
+
+private:
+  TickType_t xStart;   //< 開始時刻
+  TickType_t xTimeout; //< 持ち時間
+};
+
+} // namespace FreeRTOSpp
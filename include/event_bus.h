@@ -0,0 +1,344 @@
+/**
+ * @brief Zero-copy publish/subscribe topic with fixed subscriber tables
+ *
+ * @file event_bus.h
+ */
+#pragma once
+
+#include "deadline.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "memory_accounting.h"
+#include "queue_stats.h"
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 購読者のキューが満杯のときの動作
+ */
+enum class DropPolicy {
+  DropOldest, //< 最も古いメッセージを捨てて追加する
+  DropNewest, //< 新しいメッセージを捨てる
+  Block,      //< 空くまで待つ
+};
+
+/**
+ * @brief 購読者の設定
+ */
+struct SubscriberConfig {
+  UBaseType_t uxDepth; //< キューの長さ
+  DropPolicy policy;   //< 満杯のときの動作
+};
+
+template <typename T, size_t Slots, size_t Subscribers> class Topic;
+
+/**
+ * @brief 参照カウント付きのメッセージ格納領域
+ */
+template <typename T> struct TopicSlot {
+  std::atomic<uint16_t> refs{0};
+  T value;
+
+  void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+  void release() { refs.fetch_sub(1, std::memory_order_acq_rel); }
+};
+
+/**
+ * @brief 受信したメッセージへの参照．破棄すると領域を解放する．
+ */
+template <typename T> class TopicRef {
+public:
+  TopicRef() {}
+  TopicRef(TopicRef &&other) : slot(other.slot) { other.slot = NULL; }
+  TopicRef &operator=(TopicRef &&other) {
+    reset();
+    slot = other.slot;
+    other.slot = NULL;
+    return *this;
+  }
+  TopicRef(const TopicRef &) = delete;
+  TopicRef &operator=(const TopicRef &) = delete;
+  ~TopicRef() { reset(); }
+  const T &operator*() const { return slot->value; }
+  const T *operator->() const { return &slot->value; }
+  explicit operator bool() const { return slot != NULL; }
+  /**
+   * @brief 参照を手放す関数
+   */
+  void reset() {
+    if (slot != NULL)
+      slot->release();
+    slot = NULL;
+  }
+
+private:
+  template <typename U> friend class TopicSubscriber;
+  TopicSlot<T> *slot = NULL;
+};
+
+/**
+ * @brief 購読者．メッセージ領域へのポインタのキューを持つ．
+ */
+template <typename T> class TopicSubscriber {
+public:
+  ~TopicSubscriber() {
+    if (xQueue == NULL)
+      return;
+    TopicSlot<T> *slot;
+    while (xQueueReceive(xQueue, &slot, 0) == pdTRUE)
+      slot->release();
+    MemoryAccounting::remove("TopicSubscriber", NULL, heapBytes(), 0);
+    vQueueDelete(xQueue);
+  }
+  /**
+   * @brief メッセージを受信する関数
+   *
+   * @param ref 受信したメッセージへの参照
+   * @param xBlockTime 待ち時間
+   * @return true 受信した
+   * @return false タイムアウト
+   */
+  bool receive(TopicRef<T> &ref, TickType_t xBlockTime = portMAX_DELAY) {
+    if (xQueue == NULL) {
+      ESP_LOGW(tag, "subscriber is not created");
+      return false;
+    }
+    TopicSlot<T> *slot;
+#if FREERTOSPP_QUEUE_STATS
+    if (xQueueReceive(xQueue, &slot, 0) != pdTRUE) {
+      stats.empty();
+      if (xBlockTime == 0 ||
+          xQueueReceive(xQueue, &slot, xBlockTime) != pdTRUE)
+        return false;
+    }
+    stats.received();
+#else
+    if (xQueueReceive(xQueue, &slot, xBlockTime) != pdTRUE)
+      return false;
+#endif
+    ref.reset();
+    ref.slot = slot;
+    return true;
+  }
+  bool receive(TopicRef<T> &ref, const Deadline &deadline) {
+    return receive(ref, deadline.remaining());
+  }
+  /**
+   * @brief キューが満杯で捨てられたメッセージの数
+   */
+  uint32_t getDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+  UBaseType_t getWaiting() const {
+    return xQueue != NULL ? uxQueueMessagesWaiting(xQueue) : 0;
+  }
+  /**
+   * @brief キューを生成できたかどうか．できなかった購読者には配信しない
+   */
+  bool isCreated() const { return xQueue != NULL; }
+  /**
+   * @brief 統計 (FREERTOSPP_QUEUE_STATS) に表示する名前を設定する関数
+   */
+  void setName(const char *name) {
+#if FREERTOSPP_QUEUE_STATS
+    stats.setName(name);
+#else
+    (void)name;
+#endif
+  }
+
+private:
+  template <typename U, size_t S, size_t N> friend class Topic;
+  const char *tag = "TopicSubscriber";
+  QueueHandle_t xQueue = NULL;
+  UBaseType_t uxDepth = 0;
+  DropPolicy policy = DropPolicy::DropOldest;
+  std::atomic<uint32_t> dropped{0};
+#if FREERTOSPP_QUEUE_STATS
+  QueueStats stats;
+#endif
+
+  bool init(const SubscriberConfig &config) {
+    policy = config.policy;
+    uxDepth = config.uxDepth;
+#if FREERTOSPP_QUEUE_STATS
+    stats.setCapacity(uxDepth);
+#endif
+    xQueue = xQueueCreate(uxDepth, sizeof(TopicSlot<T> *));
+    if (xQueue == NULL) {
+      ESP_LOGE(tag, "xQueueCreate() failed");
+      return false;
+    }
+    MemoryAccounting::add("TopicSubscriber", NULL, heapBytes(), 0);
+    return true;
+  }
+  size_t heapBytes() const {
+    return MemoryAccounting::queueBytes(uxDepth, sizeof(TopicSlot<T> *));
+  }
+  bool deliver(TopicSlot<T> *slot, const Deadline &deadline) {
+    if (xQueue == NULL)
+      return false;
+    slot->retain();
+#if FREERTOSPP_QUEUE_STATS
+    if (uxQueueSpacesAvailable(xQueue) == 0)
+      stats.full();
+#endif
+    bool res = false;
+    switch (policy) {
+    case DropPolicy::Block:
+      res = xQueueSend(xQueue, &slot, deadline.remaining()) == pdTRUE;
+      break;
+    case DropPolicy::DropNewest:
+      res = xQueueSend(xQueue, &slot, 0) == pdTRUE;
+      break;
+    case DropPolicy::DropOldest:
+      while (xQueueSend(xQueue, &slot, 0) != pdTRUE) {
+        TopicSlot<T> *oldest;
+        if (xQueueReceive(xQueue, &oldest, 0) == pdTRUE) {
+#if FREERTOSPP_QUEUE_STATS
+          stats.received(false);
+#endif
+          oldest->release();
+          dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      res = true;
+      break;
+    }
+    if (res) {
+#if FREERTOSPP_QUEUE_STATS
+      stats.sent();
+#endif
+      return true;
+    }
+    slot->release();
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+};
+
+/**
+ * @brief 型付きのトピック
+ *
+ * 配信者は1回だけメッセージ領域に書き込み，各購読者のキューには
+ * その領域へのポインタだけを入れる．コンパイル時に決まるのは型，
+ * 領域の数と購読者の数だけで，各購読者のキューの長さと満杯のときの
+ * 動作 (配信の経路) は生成時に実行時の値で決まり，その後は変わらない．
+ * キューを生成できなかった購読者は isCreated() が false になり，配信から
+ * 外される．
+ *
+ * @tparam T メッセージの型
+ * @tparam Slots 同時に存在できるメッセージの数
+ * @tparam Subscribers 購読者の数
+ */
+template <typename T, size_t Slots, size_t Subscribers> class Topic {
+public:
+  /**
+   * @brief 書き込み中のメッセージ領域
+   */
+  class Loan {
+  public:
+    Loan(Loan &&other) : slot(other.slot) { other.slot = NULL; }
+    Loan(const Loan &) = delete;
+    ~Loan() {
+      if (slot != NULL)
+        slot->release();
+    }
+    T &operator*() { return slot->value; }
+    T *operator->() { return &slot->value; }
+    explicit operator bool() const { return slot != NULL; }
+
+  private:
+    friend class Topic;
+    explicit Loan(TopicSlot<T> *slot) : slot(slot) {}
+    TopicSlot<T> *slot;
+  };
+
+  /**
+   * @brief Construct a new Topic object
+   *
+   * @param config 各購読者の設定
+   */
+  Topic(const SubscriberConfig (&config)[Subscribers]) {
+    for (size_t i = 0; i < Subscribers; ++i)
+      subscribers[i].init(config[i]);
+    MemoryAccounting::add("Topic", NULL, 0, sizeof(*this));
+  }
+  ~Topic() { MemoryAccounting::remove("Topic", NULL, 0, sizeof(*this)); }
+  /**
+   * @brief すべての購読者のキューを生成できたかどうか
+   */
+  bool isCreated() const {
+    for (size_t i = 0; i < Subscribers; ++i)
+      if (!subscribers[i].isCreated())
+        return false;
+    return true;
+  }
+  /**
+   * @brief 購読者を取得する関数
+   */
+  TopicSubscriber<T> &subscriber(size_t index) { return subscribers[index]; }
+  /**
+   * @brief 空いているメッセージ領域を借りる関数
+   * 領域がすべて使用中なら空の Loan を返す．
+   */
+  Loan loan() {
+    for (size_t i = 0; i < Slots; ++i) {
+      uint16_t expected = 0;
+      if (slots[i].refs.compare_exchange_strong(expected, 1,
+                                                std::memory_order_acquire))
+        return Loan(&slots[i]);
+    }
+    return Loan(NULL);
+  }
+  /**
+   * @brief 借りた領域を全購読者に配信する関数
+   *
+   * @param deadline DropPolicy::Block の購読者を待つ期限 (全購読者で共通)
+   * @return 配信できた購読者の数
+   */
+  size_t publish(Loan &&loan, const Deadline &deadline) {
+    if (!loan)
+      return 0;
+    size_t delivered = 0;
+    for (size_t i = 0; i < Subscribers; ++i)
+      delivered += subscribers[i].deliver(loan.slot, deadline);
+    Loan released(std::move(loan));
+    return delivered;
+  }
+  /**
+   * @param xBlockTime DropPolicy::Block の購読者を待つ時間 (全購読者で合計)
+   */
+  size_t publish(Loan &&loan, TickType_t xBlockTime = portMAX_DELAY) {
+    return publish(std::move(loan), Deadline(xBlockTime));
+  }
+  /**
+   * @brief メッセージをコピーして全購読者に配信する関数
+   *
+   * @return 配信できた購読者の数
+   */
+  size_t publish(const T &value, const Deadline &deadline) {
+    Loan l = loan();
+    if (!l) {
+      ESP_LOGW(tag, "no free slot");
+      return 0;
+    }
+    *l = value;
+    return publish(std::move(l), deadline);
+  }
+  size_t publish(const T &value, TickType_t xBlockTime = portMAX_DELAY) {
+    return publish(value, Deadline(xBlockTime));
+  }
+
+private:
+  const char *tag = "Topic";
+  TopicSlot<T> slots[Slots];
+  TopicSubscriber<T> subscribers[Subscribers];
+};
+
+} // namespace FreeRTOSpp
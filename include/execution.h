@@ -0,0 +1,572 @@
+/**
+ * @brief Minimal senders/receivers over worker tasks and the timer service
+ *
+ * @file execution.h
+ *
+ * sender は「まだ始まっていない非同期処理」を表す値で，then() などで
+ * つないでから syncWait() などで受け手 (receiver) と結びつけて開始する．
+ * 結びつけた結果の状態 (operation) は各 sender の入れ子の型
+ * Operation<R> で，呼び出し側のスタックなどに置かれる．つないだ処理の
+ * 状態はすべてその中に入れ子に含まれるので，ヒープは使わない．
+ *
+ * sender は value_type 型の値を1つ送る (値がないときは Void)．
+ * receiver は setValue(値) と setStopped() をもつ．
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "atomic_wait.h"
+#include "timer_service.h"
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 値をもたない sender が送る値
+ */
+struct Void {};
+
+/**
+ * @brief sender S と receiver R を結びつけた状態の型
+ */
+template <typename S, typename R>
+using OperationState = typename std::decay<S>::type::template Operation<R>;
+
+namespace detail {
+
+template <typename T>
+struct IsVoid : std::is_same<typename std::decay<T>::type, Void> {};
+
+/* f に値を渡して呼ぶ．Void なら引数なしで呼ぶ */
+template <bool NoArgument> struct Call {
+  template <typename F, typename T>
+  static auto invoke(F &f, T &&v) -> decltype(f(std::forward<T>(v))) {
+    return f(std::forward<T>(v));
+  }
+};
+template <> struct Call<true> {
+  template <typename F, typename T>
+  static auto invoke(F &f, T &&) -> decltype(f()) {
+    return f();
+  }
+};
+template <typename F, typename T> struct ResultOf {
+  typedef decltype(Call<IsVoid<T>::value>::invoke(std::declval<F &>(),
+                                                   std::declval<T>())) type;
+};
+template <typename T> struct ValueOf { typedef T type; };
+template <> struct ValueOf<void> { typedef Void type; };
+
+/* f の戻り値を receiver に送る．void なら Void を送る */
+template <typename Result> struct Deliver {
+  template <typename F, typename T, typename R>
+  static void apply(F &f, T &&v, R &r) {
+    r.setValue(Call<IsVoid<T>::value>::invoke(f, std::forward<T>(v)));
+  }
+};
+template <> struct Deliver<void> {
+  template <typename F, typename T, typename R>
+  static void apply(F &f, T &&v, R &r) {
+    Call<IsVoid<T>::value>::invoke(f, std::forward<T>(v));
+    r.setValue(Void());
+  }
+};
+
+/* 後から構築する値の置き場 */
+template <typename T> class Slot {
+public:
+  Slot() {}
+  ~Slot() { reset(); }
+  Slot(const Slot &) = delete;
+  Slot &operator=(const Slot &) = delete;
+  template <typename... Args> T &emplace(Args &&...args) {
+    reset();
+    T *p = new (&storage) T(std::forward<Args>(args)...);
+    constructed = true;
+    return *p;
+  }
+  T &get() { return *reinterpret_cast<T *>(&storage); }
+  void reset() {
+    if (constructed)
+      get().~T();
+    constructed = false;
+  }
+
+private:
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  bool constructed = false;
+};
+
+} // namespace detail
+
+/**
+ * @brief value を送る sender
+ */
+template <typename T> class JustSender {
+public:
+  typedef T value_type;
+  explicit JustSender(T value) : value(std::move(value)) {}
+
+  template <typename R> class Operation {
+  public:
+    Operation(JustSender &&sender, R r)
+        : value(std::move(sender.value)), r(std::move(r)) {}
+    void start() { r.setValue(std::move(value)); }
+
+  private:
+    T value;
+    R r;
+  };
+
+private:
+  T value;
+};
+template <typename T>
+JustSender<typename std::decay<T>::type> just(T &&value) {
+  return JustSender<typename std::decay<T>::type>(std::forward<T>(value));
+}
+inline JustSender<Void> just() { return JustSender<Void>(Void()); }
+
+/**
+ * @brief S の値を f に渡し，f の戻り値を送る sender
+ */
+template <typename S, typename F> class ThenSender {
+public:
+  typedef typename detail::ResultOf<F, typename S::value_type>::type result_type;
+  typedef typename detail::ValueOf<result_type>::type value_type;
+  ThenSender(S s, F f) : s(std::move(s)), f(std::move(f)) {}
+
+  template <typename R> class Operation {
+  public:
+    Operation(ThenSender &&sender, R r)
+        : f(std::move(sender.f)), r(std::move(r)),
+          op(std::move(sender.s), Receiver{this}) {}
+    void start() { op.start(); }
+
+  private:
+    struct Receiver {
+      Operation *self;
+      template <typename T> void setValue(T &&v) {
+        detail::Deliver<result_type>::apply(self->f, std::forward<T>(v),
+                                            self->r);
+      }
+      void setStopped() { self->r.setStopped(); }
+    };
+    F f;
+    R r;
+    OperationState<S, Receiver> op;
+  };
+
+private:
+  S s;
+  F f;
+};
+template <typename S, typename F>
+ThenSender<typename std::decay<S>::type, typename std::decay<F>::type>
+then(S &&s, F &&f) {
+  return ThenSender<typename std::decay<S>::type, typename std::decay<F>::type>(
+      std::forward<S>(s), std::forward<F>(f));
+}
+
+/**
+ * @brief S の値を f に渡し，f が返した sender を続けて実行する sender
+ * 値は f が返した sender が完了するまで状態の中に保持される．
+ */
+template <typename S, typename F> class LetValueSender {
+public:
+  typedef typename S::value_type input_type;
+  typedef typename std::decay<
+      typename detail::ResultOf<F, input_type &>::type>::type inner_type;
+  typedef typename inner_type::value_type value_type;
+  LetValueSender(S s, F f) : s(std::move(s)), f(std::move(f)) {}
+
+  template <typename R> class Operation {
+  public:
+    Operation(LetValueSender &&sender, R r)
+        : f(std::move(sender.f)), r(std::move(r)),
+          op(std::move(sender.s), Receiver{this}) {}
+    ~Operation() { inner.reset(); }
+    void start() { op.start(); }
+
+  private:
+    struct InnerReceiver {
+      Operation *self;
+      template <typename T> void setValue(T &&v) {
+        self->r.setValue(std::forward<T>(v));
+      }
+      void setStopped() { self->r.setStopped(); }
+    };
+    struct Receiver {
+      Operation *self;
+      template <typename T> void setValue(T &&v) {
+        input_type &value = self->value.emplace(std::forward<T>(v));
+        self->inner
+            .emplace(detail::Call<detail::IsVoid<input_type>::value>::invoke(
+                         self->f, value),
+                     InnerReceiver{self})
+            .start();
+      }
+      void setStopped() { self->r.setStopped(); }
+    };
+    F f;
+    R r;
+    detail::Slot<input_type> value;
+    detail::Slot<OperationState<inner_type, InnerReceiver>> inner;
+    OperationState<S, Receiver> op;
+  };
+
+private:
+  S s;
+  F f;
+};
+template <typename S, typename F>
+LetValueSender<typename std::decay<S>::type, typename std::decay<F>::type>
+letValue(S &&s, F &&f) {
+  return LetValueSender<typename std::decay<S>::type,
+                        typename std::decay<F>::type>(std::forward<S>(s),
+                                                      std::forward<F>(f));
+}
+
+/**
+ * @brief S1 と S2 を両方開始し，両方の値を std::pair で送る sender
+ * どちらかが停止したら，両方の完了を待ってから停止を送る．
+ * 3つ以上は入れ子にする．
+ */
+template <typename S1, typename S2> class WhenAllSender {
+public:
+  typedef typename S1::value_type first_type;
+  typedef typename S2::value_type second_type;
+  typedef std::pair<first_type, second_type> value_type;
+  WhenAllSender(S1 s1, S2 s2) : s1(std::move(s1)), s2(std::move(s2)) {}
+
+  template <typename R> class Operation {
+  public:
+    Operation(WhenAllSender &&sender, R r)
+        : r(std::move(r)), op1(std::move(sender.s1), Receiver1{this}),
+          op2(std::move(sender.s2), Receiver2{this}) {}
+    void start() {
+      op1.start();
+      op2.start();
+    }
+
+  private:
+    struct Receiver1 {
+      Operation *self;
+      template <typename T> void setValue(T &&v) {
+        self->first.emplace(std::forward<T>(v));
+        self->complete();
+      }
+      void setStopped() { self->stop(); }
+    };
+    struct Receiver2 {
+      Operation *self;
+      template <typename T> void setValue(T &&v) {
+        self->second.emplace(std::forward<T>(v));
+        self->complete();
+      }
+      void setStopped() { self->stop(); }
+    };
+    R r;
+    std::atomic<uint8_t> remaining{2};
+    std::atomic<bool> stopped{false};
+    detail::Slot<first_type> first;
+    detail::Slot<second_type> second;
+    OperationState<S1, Receiver1> op1;
+    OperationState<S2, Receiver2> op2;
+
+    void stop() {
+      stopped.store(true, std::memory_order_relaxed);
+      complete();
+    }
+    /* 後から完了した側が結果を送る */
+    void complete() {
+      if (remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+      if (stopped.load(std::memory_order_relaxed))
+        r.setStopped();
+      else
+        r.setValue(value_type(std::move(first.get()), std::move(second.get())));
+    }
+  };
+
+private:
+  S1 s1;
+  S2 s2;
+};
+template <typename S1, typename S2>
+WhenAllSender<typename std::decay<S1>::type, typename std::decay<S2>::type>
+whenAll(S1 &&s1, S2 &&s2) {
+  return WhenAllSender<typename std::decay<S1>::type,
+                       typename std::decay<S2>::type>(std::forward<S1>(s1),
+                                                      std::forward<S2>(s2));
+}
+
+/**
+ * @brief パイプで書くための then(f), letValue(f)
+ *
+ * 例: syncWait(schedule(sch) | then(f) | letValue(g), result);
+ */
+template <typename F> struct ThenClosure { F f; };
+template <typename F> struct LetValueClosure { F f; };
+template <typename F>
+ThenClosure<typename std::decay<F>::type> then(F &&f) {
+  return ThenClosure<typename std::decay<F>::type>{std::forward<F>(f)};
+}
+template <typename F>
+LetValueClosure<typename std::decay<F>::type> letValue(F &&f) {
+  return LetValueClosure<typename std::decay<F>::type>{std::forward<F>(f)};
+}
+template <typename S, typename F>
+ThenSender<typename std::decay<S>::type, F> operator|(S &&s,
+                                                      ThenClosure<F> c) {
+  return ThenSender<typename std::decay<S>::type, F>(std::forward<S>(s),
+                                                     std::move(c.f));
+}
+template <typename S, typename F>
+LetValueSender<typename std::decay<S>::type, F>
+operator|(S &&s, LetValueClosure<F> c) {
+  return LetValueSender<typename std::decay<S>::type, F>(std::forward<S>(s),
+                                                         std::move(c.f));
+}
+
+/**
+ * @brief scheduler の schedule() を呼ぶ関数
+ */
+template <typename Scheduler>
+auto schedule(const Scheduler &scheduler) -> decltype(scheduler.schedule()) {
+  return scheduler.schedule();
+}
+
+namespace detail {
+
+template <typename T> struct SyncWaitReceiver {
+  enum State : uint8_t { Running, Done, Stopped };
+  std::atomic<uint8_t> *state;
+  T *value;
+  template <typename U> void setValue(U &&v) {
+    if (value != NULL)
+      *value = std::forward<U>(v);
+    finish(Done);
+  }
+  void setStopped() { finish(Stopped); }
+  void finish(State to) {
+    /* これ以降 state は待つ側で破棄されうるので，通知にはアドレスだけを使う */
+    state->store(to, std::memory_order_release);
+    atomicNotifyAll(*state);
+  }
+};
+
+} // namespace detail
+
+/**
+ * @brief sender を開始し，完了するまで呼んだタスクを眠らせる関数
+ *
+ * @param value 送られた値の格納先
+ * @return false 停止した
+ */
+template <typename S>
+bool syncWait(S sender, typename S::value_type &value) {
+  typedef detail::SyncWaitReceiver<typename S::value_type> Receiver;
+  std::atomic<uint8_t> state{Receiver::Running};
+  OperationState<S, Receiver> op(std::move(sender), Receiver{&state, &value});
+  op.start();
+  atomicWait(state, uint8_t(Receiver::Running));
+  return state.load(std::memory_order_acquire) == Receiver::Done;
+}
+template <typename S> bool syncWait(S sender) {
+  typedef detail::SyncWaitReceiver<typename S::value_type> Receiver;
+  std::atomic<uint8_t> state{Receiver::Running};
+  OperationState<S, Receiver> op(std::move(sender), Receiver{&state, NULL});
+  op.start();
+  atomicWait(state, uint8_t(Receiver::Running));
+  return state.load(std::memory_order_acquire) == Receiver::Done;
+}
+
+/**
+ * @brief 投入された処理を順に実行するタスク
+ *
+ * コアごとに1つ作り，getScheduler() で得た scheduler で処理を載せる．
+ * 処理の記憶領域は operation の中にあり，キューは割り当てを行わない．
+ */
+class WorkerContext : public TaskBase {
+public:
+  /**
+   * @brief キューにつなぐ処理
+   */
+  struct Work {
+    Work *next = NULL;
+    void (*execute)(Work *) = NULL;
+  };
+  class Scheduler;
+
+  bool start(const char *pcName = "Worker",
+             UBaseType_t uxPriority = tskIDLE_PRIORITY + 1,
+             const uint16_t usStackDepth = 4096,
+             const BaseType_t xCoreID = tskNO_AFFINITY) {
+    return createTask(pcName, uxPriority, usStackDepth, xCoreID);
+  }
+  /**
+   * @brief 処理をキューの末尾につなぐ関数
+   *
+   * @return false タスクが生成されていないので，つながなかった
+   */
+  bool post(Work &work) {
+    if (pxCreatedTask == NULL) {
+      ESP_LOGW(tag, "worker task is not created");
+      return false;
+    }
+    work.next = NULL;
+    portENTER_CRITICAL(&mux);
+    if (tail != NULL)
+      tail->next = &work;
+    else
+      head = &work;
+    tail = &work;
+    portEXIT_CRITICAL(&mux);
+    xTaskNotifyGive(pxCreatedTask);
+    return true;
+  }
+  inline Scheduler getScheduler();
+
+protected:
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  Work *head = NULL;
+  Work *tail = NULL;
+
+  virtual void task() override {
+    while (1) {
+      /* 処理の中で待つとタスク通知を消費しうるので，通知ではなく
+         キューが空かどうかで眠るかを決める */
+      portENTER_CRITICAL(&mux);
+      Work *work = head;
+      head = tail = NULL;
+      portEXIT_CRITICAL(&mux);
+      if (work == NULL) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+      while (work != NULL) {
+        /* execute() の後は work が破棄されうる */
+        Work *next = work->next;
+        work->execute(work);
+        work = next;
+      }
+    }
+  }
+};
+
+/**
+ * @brief WorkerContext のタスクで続きを実行する scheduler
+ */
+class WorkerContext::Scheduler {
+public:
+  class Sender {
+  public:
+    typedef Void value_type;
+    explicit Sender(WorkerContext *context) : context(context) {}
+
+    template <typename R> class Operation : private Work {
+    public:
+      Operation(Sender &&sender, R r)
+          : context(sender.context), r(std::move(r)) {
+        execute = run;
+      }
+      void start() {
+        if (!context->post(*this))
+          r.setStopped();
+      }
+
+    private:
+      WorkerContext *context;
+      R r;
+      static void run(Work *work) {
+        static_cast<Operation *>(work)->r.setValue(Void());
+      }
+    };
+
+  private:
+    WorkerContext *context;
+  };
+
+  explicit Scheduler(WorkerContext &context) : context(&context) {}
+  Sender schedule() const { return Sender(context); }
+  bool operator==(const Scheduler &other) const {
+    return context == other.context;
+  }
+  bool operator!=(const Scheduler &other) const { return !(*this == other); }
+
+private:
+  WorkerContext *context;
+};
+
+inline WorkerContext::Scheduler WorkerContext::getScheduler() {
+  return Scheduler(*this);
+}
+
+/**
+ * @brief TimerService の1回だけのタイマで続きを実行する scheduler
+ *
+ * 続きは TimerService のタスクで実行されるので，重い処理は letValue()
+ * で WorkerContext に移すこと．
+ */
+class TimerScheduler {
+public:
+  class Sender {
+  public:
+    typedef Void value_type;
+    Sender(TimerService *service, TickType_t xDelay, TickType_t xSlack)
+        : service(service), xDelay(xDelay), xSlack(xSlack) {}
+
+    template <typename R> class Operation {
+    public:
+      Operation(Sender &&sender, R r)
+          : service(sender.service), xDelay(sender.xDelay), r(std::move(r)),
+            timer([this]() { this->r.setValue(Void()); }, 0, sender.xSlack) {}
+      void start() {
+        if (!service->add(timer, xDelay))
+          r.setStopped();
+      }
+
+    private:
+      TimerService *service;
+      TickType_t xDelay;
+      R r;
+      CoalescingTimer timer;
+    };
+
+  private:
+    TimerService *service;
+    TickType_t xDelay;
+    TickType_t xSlack;
+  };
+
+  /**
+   * @param xSlack 満了を遅らせてよい幅．他のタイマとまとめて起床できる
+   */
+  explicit TimerScheduler(TimerService &service, TickType_t xSlack = 0)
+      : service(&service), xSlack(xSlack) {}
+  Sender schedule() const { return Sender(service, 0, xSlack); }
+  /**
+   * @brief xDelay 後に完了する sender
+   */
+  Sender scheduleAfter(TickType_t xDelay) const {
+    return Sender(service, xDelay, xSlack);
+  }
+  bool operator==(const TimerScheduler &other) const {
+    return service == other.service;
+  }
+  bool operator!=(const TimerScheduler &other) const {
+    return !(*this == other);
+  }
+
+private:
+  TimerService *service;
+  TickType_t xSlack;
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,431 @@
+/**
+ * @brief Stackful fibers scheduled cooperatively within one FreeRTOS task
+ *
+ * @file fiber.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#if defined(__XTENSA__)
+extern "C" {
+/**
+ * @brief 切り替え時に保存するレジスタ (src/fiber_xtensa.S)
+ */
+struct freertospp_fiber_context {
+  void *a0; //< 戻り番地
+  void *a1; //< スタックポインタ
+};
+void freertospp_fiber_switch(freertospp_fiber_context *from,
+                             freertospp_fiber_context *to);
+void freertospp_fiber_start(freertospp_fiber_context *from, void *sp,
+                            void (*entry)(void *), void *arg);
+}
+#else
+#include <ucontext.h>
+#endif
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief ファイバの実行コンテキスト
+ */
+class FiberContext {
+public:
+  /**
+   * @brief 現在のコンテキストを保存して to に切り替える関数
+   */
+  void switchTo(FiberContext &to) {
+#if defined(__XTENSA__)
+    freertospp_fiber_switch(&ctx, &to.ctx);
+#else
+    swapcontext(&ctx, &to.ctx);
+#endif
+  }
+  /**
+   * @brief 現在のコンテキストを保存し，新しいスタックで entry(arg)
+   * を開始する関数．entry は戻ってはならない．
+   *
+   * @param to 新しいコンテキスト
+   */
+  void startOn(FiberContext &to, void *stack, size_t size,
+               void (*entry)(void *), void *arg) {
+#if defined(__XTENSA__)
+    (void)to;
+    void *sp = (void *)((uintptr_t(stack) + size) & ~uintptr_t(15));
+    freertospp_fiber_start(&ctx, sp, entry, arg);
+#else
+    getcontext(&to.ctx);
+    to.ctx.uc_stack.ss_sp = stack;
+    to.ctx.uc_stack.ss_size = size;
+    to.ctx.uc_link = NULL;
+    pending().entry = entry;
+    pending().arg = arg;
+    makecontext(&to.ctx, trampoline, 0);
+    swapcontext(&ctx, &to.ctx);
+#endif
+  }
+
+private:
+#if defined(__XTENSA__)
+  freertospp_fiber_context ctx = {NULL, NULL};
+#else
+  ucontext_t ctx;
+
+  /* makecontext() にはポインタを渡せないので，開始直前に置いておく */
+  struct Pending {
+    void (*entry)(void *);
+    void *arg;
+  };
+  static Pending &pending() {
+    static thread_local Pending p;
+    return p;
+  }
+  static void trampoline() {
+    const Pending p = pending();
+    p.entry(p.arg);
+  }
+#endif
+};
+
+class FiberScheduler;
+
+/**
+ * @brief 小さなスタックを持つユーザレベルのスレッド
+ * FiberScheduler に登録すると，そのタスクの中で協調的に実行される．
+ */
+class Fiber {
+public:
+  enum State {
+    Created,  //< 未実行
+    Ready,    //< 実行可能
+    Running,  //< 実行中
+    Sleeping, //< 時刻を待っている
+    Polling,  //< カーネルオブジェクトを待っている
+    Finished, //< 終了した
+  };
+
+  /**
+   * @brief Construct a new Fiber object
+   *
+   * @param func 実行する関数
+   * @param stackSize スタックサイズ [byte]
+   * @param stack スタック領域，NULL ならヒープから確保する
+   */
+  Fiber(std::function<void()> func, size_t stackSize = 2048,
+        void *stack = NULL)
+      : func(func), stackSize(stackSize), ownStack(stack == NULL) {
+    this->stack = ownStack ? new uint8_t[stackSize] : (uint8_t *)stack;
+    MemoryAccounting::add("Fiber", NULL, ownStack ? stackSize : 0,
+                          sizeof(*this) + (ownStack ? 0 : stackSize));
+  }
+  ~Fiber() {
+    MemoryAccounting::remove("Fiber", NULL, ownStack ? stackSize : 0,
+                             sizeof(*this) + (ownStack ? 0 : stackSize));
+    if (ownStack)
+      delete[] stack;
+  }
+  Fiber(const Fiber &) = delete;
+  Fiber &operator=(const Fiber &) = delete;
+
+  State getState() const { return state; }
+  /**
+   * @brief スタックの最小残量 [byte]
+   */
+  size_t getStackHighWaterMark() const {
+    size_t n = 0;
+    while (n < stackSize && stack[n] == StackFill)
+      ++n;
+    return n;
+  }
+
+  /**
+   * @brief 実行中のファイバ．ファイバの外なら NULL
+   */
+  static Fiber *current() { return currentRef(); }
+  /**
+   * @brief 他のファイバに実行を譲る関数
+   * ファイバの外ではタスクの yield になる．
+   */
+  static void yield() { suspend(Ready); }
+  /**
+   * @brief 指定時間だけ他のファイバを実行する関数
+   * ファイバの外では vTaskDelay() になる．
+   */
+  static void sleep(TickType_t xTicksToDelay) {
+    Fiber *self = current();
+    if (self == NULL) {
+      vTaskDelay(xTicksToDelay);
+      return;
+    }
+    self->xWakeTick = xTaskGetTickCount() + xTicksToDelay;
+    suspend(Sleeping);
+  }
+  /**
+   * @brief 他のファイバを止めずにセマフォを待つ関数
+   * ファイバの外では通常の take() になる．
+   */
+  static bool take(Semaphore &semaphore, TickType_t xBlockTime = portMAX_DELAY) {
+    return poll([&]() { return semaphore.take(0); },
+                [&](TickType_t t) { return semaphore.take(t); }, xBlockTime);
+  }
+  /**
+   * @brief 他のファイバを止めずにミューテックスを待つ関数
+   * ミューテックスの所有者はファイバではなくタスクなので，
+   * 同じスケジューラのファイバどうしの排他には使えないことに注意．
+   */
+  static bool take(Mutex &mutex, TickType_t xBlockTime = portMAX_DELAY) {
+    return poll([&]() { return mutex.take(0); },
+                [&](TickType_t t) { return mutex.take(t); }, xBlockTime);
+  }
+  static bool take(Semaphore &semaphore, const Deadline &deadline) {
+    return take(semaphore, deadline.remaining());
+  }
+  static bool take(Mutex &mutex, const Deadline &deadline) {
+    return take(mutex, deadline.remaining());
+  }
+
+protected:
+  friend class FiberScheduler;
+  static constexpr uint8_t StackFill = 0xa5;
+
+  FiberContext ctx;
+  std::function<void()> func;
+  uint8_t *stack;
+  size_t stackSize;
+  bool ownStack;
+  volatile State state = Created;
+  bool started = false;
+  TickType_t xWakeTick = 0;
+  FiberScheduler *scheduler = NULL;
+  Fiber *next = NULL;
+
+  static Fiber *&currentRef() {
+    static thread_local Fiber *fiber = NULL;
+    return fiber;
+  }
+  static void suspend(State state);
+  static void entry_point(void *arg);
+  template <typename Try, typename Block>
+  static bool poll(Try tryTake, Block blockTake, TickType_t xBlockTime) {
+    if (current() == NULL)
+      return blockTake(xBlockTime);
+    const TickType_t xStart = xTaskGetTickCount();
+    while (!tryTake()) {
+      if (xBlockTime != portMAX_DELAY &&
+          xTaskGetTickCount() - xStart >= xBlockTime)
+        return false;
+      suspend(Polling);
+    }
+    return true;
+  }
+};
+
+/**
+ * @brief ファイバを協調的に実行するタスク
+ *
+ * 実行可能なファイバを順に実行し，すべてのファイバが
+ * カーネルオブジェクト待ちのときは1ティックだけタスクを休ませる．
+ * ファイバのメモリは登録した側が管理し，終了後に解放すること．
+ */
+class FiberScheduler : public TaskBase {
+public:
+  /**
+   * @brief スケジューラのタスクを開始する関数
+   */
+  bool start(const char *pcName = "Fibers", UBaseType_t uxPriority = 0,
+             const uint16_t usStackDepth = 4096,
+             const BaseType_t xCoreID = tskNO_AFFINITY) {
+    return createTask(pcName, uxPriority, usStackDepth, xCoreID);
+  }
+  /**
+   * @brief ファイバを登録する関数．どのタスクからも呼べる．
+   */
+  bool add(Fiber &fiber) {
+    if (fiber.state != Fiber::Created) {
+      ESP_LOGW(tag, "fiber is already added");
+      return false;
+    }
+    fiber.scheduler = this;
+    fiber.state = Fiber::Ready;
+    portENTER_CRITICAL(&mux);
+    fiber.next = incoming;
+    incoming = &fiber;
+    portEXIT_CRITICAL(&mux);
+    if (pxCreatedTask != NULL)
+      xTaskNotifyGive(pxCreatedTask);
+    return true;
+  }
+  /**
+   * @brief 登録されていて終了していないファイバの数
+   */
+  size_t getFiberCount() const { return uxFibers; }
+  /**
+   * @brief ファイバを切り替えた回数
+   */
+  uint32_t getSwitchCount() const { return ulSwitches; }
+
+protected:
+  friend class Fiber;
+  const char *tag = "FiberScheduler";
+  FiberContext ctx;
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  Fiber *incoming = NULL; //< 他のタスクから登録されたファイバ
+  Fiber *readyHead = NULL;
+  Fiber *readyTail = NULL;
+  Fiber *sleeping = NULL;
+  size_t uxReady = 0;
+  volatile size_t uxFibers = 0;
+  volatile uint32_t ulSwitches = 0;
+
+  virtual void task() override {
+    while (1) {
+      acceptIncoming();
+      const TickType_t xNow = xTaskGetTickCount();
+      TickType_t xNext = wakeSleepers(xNow);
+      if (uxReady == 0) {
+        ulTaskNotifyTake(pdTRUE, sleeping ? xNext - xNow : portMAX_DELAY);
+        continue;
+      }
+      /* 実行可能なファイバを一巡する */
+      bool progress = false;
+      for (size_t n = uxReady; n > 0; --n) {
+        Fiber *f = popReady();
+        resume(f);
+        switch (f->state) {
+        case Fiber::Finished:
+          --uxFibers;
+          progress = true;
+          break;
+        case Fiber::Sleeping:
+          f->next = sleeping;
+          sleeping = f;
+          progress = true;
+          break;
+        case Fiber::Polling:
+          pushReady(f);
+          break;
+        default:
+          pushReady(f);
+          progress = true;
+          break;
+        }
+      }
+      /* 全員がカーネルオブジェクト待ちなら空回りしないよう休む */
+      if (!progress)
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+  }
+  void resume(Fiber *f) {
+    f->state = Fiber::Running;
+    Fiber::currentRef() = f;
+    ++ulSwitches;
+    if (!f->started) {
+      f->started = true;
+      memset(f->stack, Fiber::StackFill, f->stackSize);
+      ctx.startOn(f->ctx, f->stack, f->stackSize, Fiber::entry_point, f);
+    } else {
+      ctx.switchTo(f->ctx);
+    }
+    Fiber::currentRef() = NULL;
+  }
+  void acceptIncoming() {
+    portENTER_CRITICAL(&mux);
+    Fiber *list = incoming;
+    incoming = NULL;
+    portEXIT_CRITICAL(&mux);
+    while (list != NULL) {
+      Fiber *f = list;
+      list = list->next;
+      ++uxFibers;
+      pushReady(f);
+    }
+  }
+  /**
+   * @brief 時刻になったファイバを実行可能にする
+   * @return 次に起こすべき時刻
+   */
+  TickType_t wakeSleepers(const TickType_t xNow) {
+    TickType_t xNext = xNow + portMAX_DELAY / 2;
+    Fiber **pp = &sleeping;
+    while (*pp != NULL) {
+      Fiber *f = *pp;
+      if (TickType_t(xNow - f->xWakeTick) < portMAX_DELAY / 2) {
+        *pp = f->next;
+        f->state = Fiber::Ready;
+        pushReady(f);
+        continue;
+      }
+      if (TickType_t(f->xWakeTick - xNow) < TickType_t(xNext - xNow))
+        xNext = f->xWakeTick;
+      pp = &f->next;
+    }
+    return xNext;
+  }
+  void pushReady(Fiber *f) {
+    f->next = NULL;
+    if (readyTail != NULL)
+      readyTail->next = f;
+    else
+      readyHead = f;
+    readyTail = f;
+    ++uxReady;
+  }
+  Fiber *popReady() {
+    Fiber *f = readyHead;
+    readyHead = f->next;
+    if (readyHead == NULL)
+      readyTail = NULL;
+    --uxReady;
+    return f;
+  }
+};
+
+inline void Fiber::suspend(State state) {
+  Fiber *self = current();
+  if (self == NULL) {
+    taskYIELD();
+    return;
+  }
+  self->state = state;
+  self->ctx.switchTo(self->scheduler->ctx);
+}
+
+inline void Fiber::entry_point(void *arg) {
+  Fiber *self = static_cast<Fiber *>(arg);
+  self->func();
+  self->state = Finished;
+  self->ctx.switchTo(self->scheduler->ctx);
+}
+
+/**
+ * @brief ファイバの切り替え1回あたりの時間を測る関数
+ *
+ * @param n 往復する回数
+ * @return 切り替え1回あたりの時間 [ns]
+ */
+inline uint32_t benchmarkFiberSwitch(uint32_t n = 10000) {
+  struct Bench {
+    FiberContext main, fiber;
+    static void entry_point(void *arg) {
+      Bench *b = static_cast<Bench *>(arg);
+      while (1)
+        b->fiber.switchTo(b->main);
+    }
+  } b;
+  static uint8_t stack[1024];
+  b.main.startOn(b.fiber, stack, sizeof(stack), Bench::entry_point, &b);
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < n; ++i)
+    b.main.switchTo(b.fiber);
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+         (2 * uint64_t(n ? n : 1));
+}
+
+} // namespace FreeRTOSpp
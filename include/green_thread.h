@@ -0,0 +1,456 @@
+/**
+ * @brief M:N green-thread scheduler over per-core worker tasks
+ *
+ * @file green_thread.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "fiber.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace FreeRTOSpp {
+
+class GreenScheduler;
+
+/**
+ * @brief コア間を移動しながら実行される軽量スレッド
+ * GreenScheduler::spawn() で登録する．
+ */
+class GreenThread {
+public:
+  /**
+   * @brief Construct a new Green Thread object
+   *
+   * @param func 実行する関数
+   * @param stackSize スタックサイズ [byte]
+   * @param stack スタック領域，NULL ならヒープから確保する
+   */
+  GreenThread(std::function<void()> func, size_t stackSize = 1024,
+              void *stack = NULL)
+      : func(func), stackSize(stackSize), ownStack(stack == NULL) {
+    this->stack = ownStack ? new uint8_t[stackSize] : (uint8_t *)stack;
+    MemoryAccounting::add("GreenThread", NULL, ownStack ? stackSize : 0,
+                          sizeof(*this) + (ownStack ? 0 : stackSize));
+  }
+  ~GreenThread() {
+    MemoryAccounting::remove("GreenThread", NULL, ownStack ? stackSize : 0,
+                             sizeof(*this) + (ownStack ? 0 : stackSize));
+    if (ownStack)
+      delete[] stack;
+  }
+  GreenThread(const GreenThread &) = delete;
+  GreenThread &operator=(const GreenThread &) = delete;
+
+  bool finished() const { return state == Finished; }
+  /**
+   * @brief 実行中のグリーンスレッド．グリーンスレッドの外なら NULL
+   */
+  static GreenThread *current() { return currentRef(); }
+  /**
+   * @brief 他のグリーンスレッドに実行を譲る関数
+   */
+  static void yield() {
+    GreenThread *self = current();
+    if (self == NULL) {
+      taskYIELD();
+      return;
+    }
+    self->suspend(Ready);
+  }
+  /**
+   * @brief カーネルの待ちを含む処理を実行する関数
+   *
+   * 実行中はコアの実行権をこのワーカから手放し，同じコアの待機中の
+   * ワーカに他のグリーンスレッドを実行させる．戻ったときに実行権が
+   * 取れなければ，このグリーンスレッドは実行待ちの列に戻される．
+   *
+   * @param fn ブロックしうる処理
+   */
+  template <typename F> static void blocking(F fn) {
+    GreenThread *self = current();
+    if (self == NULL) {
+      fn();
+      return;
+    }
+    self->handOff();
+    fn();
+    self->reacquire();
+  }
+
+protected:
+  friend class GreenScheduler;
+  enum State { Ready, Running, Requeue, Finished };
+
+  FiberContext ctx;
+  std::function<void()> func;
+  uint8_t *stack;
+  size_t stackSize;
+  bool ownStack;
+  std::atomic<bool> spawned{false}; //< spawn() 済み．二重に並べないため
+  bool started = false;
+  volatile State state = Ready;
+  void *worker = NULL; //< 実行中のワーカ (GreenScheduler::Worker)
+  GreenThread *next = NULL;
+
+  static GreenThread *&currentRef() {
+    static thread_local GreenThread *thread = NULL;
+    return thread;
+  }
+  inline void suspend(State state);
+  inline void handOff();
+  inline void reacquire();
+  inline static void entry_point(void *arg);
+};
+
+/**
+ * @brief グリーンスレッドを各コアのワーカタスクで実行するスケジューラ
+ *
+ * 各コアは実行権 (token) と実行待ちの列を1つずつ持ち，実行権を持つ
+ * ワーカだけがグリーンスレッドを実行する．自分の列が空のワーカは
+ * 他のコアの列から盗む．GreenThread::blocking() の間は同じコアの
+ * 待機中のワーカが実行権を引き継ぐので，コアが止まらない．
+ */
+class GreenScheduler {
+public:
+  static constexpr int MaxWorkersPerCore = 4;
+
+  /**
+   * @brief 統計情報
+   */
+  struct Stats {
+    uint32_t spawned;  //< 登録された数
+    uint32_t finished; //< 終了した数
+    uint32_t switches; //< 切り替えた回数
+    uint32_t steals;   //< 他のコアから盗んだ回数
+    uint32_t handoffs; //< ブロックにより実行権を引き継いだ回数
+  };
+
+  /**
+   * @brief Construct a new Green Scheduler object
+   *
+   * @param uxWorkersPerCore 各コアのワーカタスクの数 (1つが実行中，残りは待機)
+   */
+  GreenScheduler(UBaseType_t uxWorkersPerCore = 2)
+      : uxWorkersPerCore(uxWorkersPerCore < 1 ? 1
+                         : uxWorkersPerCore > MaxWorkersPerCore
+                             ? MaxWorkersPerCore
+                             : uxWorkersPerCore) {
+    for (int c = 0; c < portNUM_PROCESSORS; ++c) {
+      cores[c].token.give();
+      for (int i = 0; i < MaxWorkersPerCore; ++i) {
+        cores[c].workers[i].scheduler = this;
+        cores[c].workers[i].core = c;
+      }
+    }
+  }
+  /**
+   * @brief ワーカタスクを生成する関数
+   */
+  bool start(UBaseType_t uxPriority = 1, const uint16_t usStackDepth = 4096) {
+    for (int c = 0; c < portNUM_PROCESSORS; ++c)
+      for (UBaseType_t i = 0; i < uxWorkersPerCore; ++i)
+        if (!cores[c].workers[i].createTask("Green", uxPriority,
+                                            usStackDepth, c))
+          return false;
+    return true;
+  }
+  /**
+   * @brief グリーンスレッドを登録する関数．どのタスクからも呼べる．
+   *
+   * @param xCoreID 最初に並べるコア．tskNO_AFFINITY なら列の短い方
+   */
+  bool spawn(GreenThread &thread, const BaseType_t xCoreID = tskNO_AFFINITY) {
+    if (xCoreID != tskNO_AFFINITY &&
+        (xCoreID < 0 || xCoreID >= portNUM_PROCESSORS)) {
+      ESP_LOGW(tag, "invalid core %d", (int)xCoreID);
+      return false;
+    }
+    if (thread.spawned.exchange(true)) {
+      ESP_LOGW(tag, "green thread is already spawned");
+      return false;
+    }
+    int c = xCoreID;
+    if (xCoreID == tskNO_AFFINITY) {
+      c = 0;
+      for (int i = 1; i < portNUM_PROCESSORS; ++i)
+        if (cores[i].uxQueued < cores[c].uxQueued)
+          c = i;
+    }
+    thread.state = GreenThread::Ready;
+    spawned.fetch_add(1, std::memory_order_relaxed);
+    push(c, &thread);
+    return true;
+  }
+  Stats getStats() const {
+    Stats s;
+    s.spawned = spawned.load(std::memory_order_relaxed);
+    s.finished = finished.load(std::memory_order_relaxed);
+    s.switches = switches.load(std::memory_order_relaxed);
+    s.steals = steals.load(std::memory_order_relaxed);
+    s.handoffs = handoffs.load(std::memory_order_relaxed);
+    return s;
+  }
+
+protected:
+  friend class GreenThread;
+  const char *tag = "GreenScheduler";
+
+  class Worker : public TaskBase {
+  public:
+    GreenScheduler *scheduler = NULL;
+    int core = 0;
+    bool hasToken = false;
+    FiberContext ctx;
+
+  protected:
+    virtual void task() override { scheduler->run(*this); }
+  };
+
+  struct Core {
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    GreenThread *head = NULL;
+    GreenThread *tail = NULL;
+    volatile UBaseType_t uxQueued = 0;
+    Semaphore token; //< 実行権
+    volatile TaskHandle_t active = NULL; //< 実行権を持つワーカ
+    Worker workers[MaxWorkersPerCore];
+  };
+
+  const UBaseType_t uxWorkersPerCore;
+  Core cores[portNUM_PROCESSORS];
+  std::atomic<uint32_t> spawned{0};
+  std::atomic<uint32_t> finished{0};
+  std::atomic<uint32_t> switches{0};
+  std::atomic<uint32_t> steals{0};
+  std::atomic<uint32_t> handoffs{0};
+
+  void push(int c, GreenThread *g) {
+    Core &core = cores[c];
+    g->next = NULL;
+    portENTER_CRITICAL(&core.mux);
+    if (core.tail != NULL)
+      core.tail->next = g;
+    else
+      core.head = g;
+    core.tail = g;
+    ++core.uxQueued;
+    const TaskHandle_t active = core.active;
+    portEXIT_CRITICAL(&core.mux);
+    if (active != NULL)
+      xTaskNotifyGive(active);
+  }
+  GreenThread *pop(int c) {
+    Core &core = cores[c];
+    portENTER_CRITICAL(&core.mux);
+    GreenThread *g = core.head;
+    if (g != NULL) {
+      core.head = g->next;
+      if (core.head == NULL)
+        core.tail = NULL;
+      --core.uxQueued;
+    }
+    portEXIT_CRITICAL(&core.mux);
+    return g;
+  }
+  GreenThread *next(int c) {
+    GreenThread *g = pop(c);
+    if (g != NULL)
+      return g;
+    for (int i = 1; i < portNUM_PROCESSORS; ++i) {
+      const int victim = (c + i) % portNUM_PROCESSORS;
+      if (cores[victim].uxQueued == 0)
+        continue;
+      g = pop(victim);
+      if (g != NULL) {
+        steals.fetch_add(1, std::memory_order_relaxed);
+        return g;
+      }
+    }
+    return NULL;
+  }
+  void acquire(Worker &w) {
+    Core &core = cores[w.core];
+    core.token.take();
+    core.active = w.getTaskHandle();
+    w.hasToken = true;
+  }
+  void release(Worker &w) {
+    Core &core = cores[w.core];
+    w.hasToken = false;
+    core.active = NULL;
+    core.token.give();
+  }
+  void run(Worker &w) {
+    while (1) {
+      if (!w.hasToken)
+        acquire(w);
+      GreenThread *g = next(w.core);
+      if (g == NULL) {
+        /* 他のコアから盗めるよう1ティックごとに見直す */
+        ulTaskNotifyTake(pdTRUE, 1);
+        continue;
+      }
+      g->worker = &w;
+      g->state = GreenThread::Running;
+      GreenThread::currentRef() = g;
+      switches.fetch_add(1, std::memory_order_relaxed);
+      if (!g->started) {
+        g->started = true;
+        w.ctx.startOn(g->ctx, g->stack, g->stackSize, GreenThread::entry_point,
+                      g);
+      } else {
+        w.ctx.switchTo(g->ctx);
+      }
+      GreenThread::currentRef() = NULL;
+      switch (g->state) {
+      case GreenThread::Finished:
+        finished.fetch_add(1, std::memory_order_relaxed);
+        break;
+      default:
+        push(w.core, g);
+        break;
+      }
+    }
+  }
+};
+
+inline void GreenThread::suspend(State state) {
+  this->state = state;
+  auto w = static_cast<GreenScheduler::Worker *>(worker);
+  ctx.switchTo(w->ctx);
+}
+
+inline void GreenThread::handOff() {
+  auto w = static_cast<GreenScheduler::Worker *>(worker);
+  w->scheduler->handoffs.fetch_add(1, std::memory_order_relaxed);
+  w->scheduler->release(*w);
+}
+
+inline void GreenThread::reacquire() {
+  auto w = static_cast<GreenScheduler::Worker *>(worker);
+  GreenScheduler::Core &core = w->scheduler->cores[w->core];
+  if (core.token.take(0)) {
+    core.active = w->getTaskHandle();
+    w->hasToken = true;
+    return;
+  }
+  /* 実行権は待機中のワーカに移ったので，列に戻って順番を待つ */
+  suspend(Requeue);
+}
+
+inline void GreenThread::entry_point(void *arg) {
+  GreenThread *self = static_cast<GreenThread *>(arg);
+  self->func();
+  self->suspend(Finished);
+}
+
+/**
+ * @brief benchmarkGreenThreads() の結果
+ */
+struct GreenThreadBenchmark {
+  uint32_t threads;       //< 同時に存在したグリーンスレッドの数
+  uint32_t switches;      //< グリーンスレッドの切り替えの回数
+  uint32_t elapsedUs;     //< すべてが終わるまでの時間 [us]
+  uint32_t greenSwitchNs; //< グリーンスレッドの切り替え1回あたり [ns]
+  uint32_t taskSwitchNs;  //< 同じコアのタスクの切り替え1回あたり [ns]
+};
+
+/**
+ * @brief グリーンスレッドとタスクの切り替えの時間を比べる関数
+ *
+ * uxThreads 個のグリーンスレッドを同時に登録し，それぞれが uxYields 回
+ * yield() してから終わるまでの時間を測る．比較として，同じコアの
+ * 同じ優先度の2つのタスクが通知で n 往復する時間を測る．
+ * スタックは uxThreads * stackSize バイト (既定で約 2MB) をヒープから
+ * 確保するので，PSRAM のある環境で測ること．確保できなくなったら
+ * そこまでの数で測り，実際の数を threads に返す．
+ *
+ * @param scheduler start() 済みで，他のグリーンスレッドのないもの
+ */
+inline GreenThreadBenchmark
+benchmarkGreenThreads(GreenScheduler &scheduler, uint32_t uxThreads = 2000,
+                      uint32_t uxYields = 10, size_t stackSize = 1024,
+                      uint32_t n = 10000) {
+  typedef std::chrono::steady_clock Clock;
+  GreenThreadBenchmark result = {};
+  std::vector<std::unique_ptr<uint8_t[]>> stacks;
+  stacks.reserve(uxThreads);
+  for (uint32_t i = 0; i < uxThreads; ++i) {
+    uint8_t *stack = new (std::nothrow) uint8_t[stackSize];
+    if (stack == NULL) {
+      ESP_LOGW("GreenThread", "only %u stacks are allocated", (unsigned)i);
+      uxThreads = i;
+      break;
+    }
+    stacks.push_back(std::unique_ptr<uint8_t[]>(stack));
+  }
+  std::atomic<uint32_t> remaining{uxThreads};
+  std::atomic<bool> done{uxThreads == 0};
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start;
+  std::vector<std::unique_ptr<GreenThread>> threads;
+  threads.reserve(uxThreads);
+  for (uint32_t i = 0; i < uxThreads; ++i)
+    threads.push_back(std::unique_ptr<GreenThread>(new GreenThread(
+        [uxYields, &remaining, &done, &end]() {
+          for (uint32_t j = 0; j < uxYields; ++j)
+            GreenThread::yield();
+          /* 待つ側のポーリングの間隔を含めないよう，最後の1つが時刻を残す */
+          if (remaining.fetch_sub(1) == 1) {
+            end = Clock::now();
+            done.store(true, std::memory_order_release);
+          }
+        },
+        stackSize, stacks[i].get())));
+  result.threads = uxThreads;
+
+  const GreenScheduler::Stats before = scheduler.getStats();
+  start = Clock::now();
+  for (auto &t : threads)
+    scheduler.spawn(*t);
+  while (!done.load(std::memory_order_acquire) ||
+         scheduler.getStats().finished - before.finished < uxThreads)
+    vTaskDelay(1);
+  Clock::duration elapsed = end - start;
+  result.switches = scheduler.getStats().switches - before.switches;
+  result.elapsedUs =
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  result.greenSwitchNs =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+      (result.switches ? result.switches : 1);
+
+  /* 同じコアの2つのタスクで通知を往復させる */
+  struct Pong : public TaskBase {
+    TaskHandle_t ping = NULL;
+    virtual void task() override {
+      while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xTaskNotifyGive(ping);
+      }
+    }
+  } pong;
+  pong.ping = xTaskGetCurrentTaskHandle();
+  pong.createTask("Pong", uxTaskPriorityGet(NULL), 2048, xPortGetCoreID());
+  start = Clock::now();
+  for (uint32_t i = 0; i < n; ++i) {
+    xTaskNotifyGive(pong.getTaskHandle());
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  elapsed = Clock::now() - start;
+  /* pong のタスクは ~TaskBase() が削除する */
+  result.taskSwitchNs =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+      (2 * uint64_t(n ? n : 1));
+  return result;
+}
+
+} // namespace FreeRTOSpp
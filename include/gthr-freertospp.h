@@ -0,0 +1,267 @@
+/**
+ * @brief libgcc/libstdc++ threading backend (gthreads) on FreeRTOSpp
+ *
+ * @file gthr-freertospp.h
+ *
+ * std::thread, std::mutex, std::condition_variable, std::call_once などを
+ * ESP-IDF の pthread を通さずに FreeRTOSpp の仕組みで動かすための
+ * gthreads 実装．ミューテックスと条件変数は静的に初期化できる int 1つで，
+ * 競合しなければカーネルを呼ばず，待つときだけ AtomicWait の表で眠る．
+ * オブジェクトごとのヒープ確保もカーネルオブジェクトの生成もしない．
+ * 待つときはタスク通知を使わないので，std::mutex を取るタスクが
+ * 自身の通知を失うことはない．
+ *
+ * 注意: ミューテックスは持ち主を記録しないので優先度継承をしない．
+ * ESP-IDF の pthread (xSemaphoreCreateMutex) と違い，優先度の低い持ち主を
+ * 待つ高優先度のタスクは，中くらいの優先度のタスクが走り続ける間ずっと
+ * 待たされうる．優先度の異なるタスクが共有し，応答時間が重要なロックには
+ * FreeRTOSpp::Mutex を使うこと．
+ *
+ * 使い方: libstdc++ の組み込み部分 (std::thread の起動，call_once，
+ * condition_variable など) はツールチェインのビルド時に gthr-default.h
+ * の型で固定されるので，このヘッダだけ差し替えても混ぜて使えない (ABI
+ * が異なる)．このファイルを gthr-default.h としてツールチェイン (libgcc
+ * と libstdc++) を再ビルドし，アプリでは FREERTOSPP_GTHREADS=1 を定義して
+ * src/gthr_freertospp.cpp をリンクすること．
+ *
+ * ツールチェインのビルドで読まれるので，C からも読め，FreeRTOS の
+ * ヘッダには依存しない．カーネルを呼ぶ部分は src/gthr_freertospp.cpp．
+ */
+#ifndef GCC_GTHR_FREERTOSPP_H
+#define GCC_GTHR_FREERTOSPP_H
+
+#include <errno.h>
+#include <time.h>
+
+#define __GTHREADS 1
+#define __GTHREADS_CXX0X 1
+#define __GTHREAD_HAS_COND 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct freertospp_gthr_task *__gthread_t;
+typedef int __gthread_key_t;
+typedef struct {
+  int state;
+} __gthread_once_t;
+typedef struct {
+  int state; /* 0: 空き，1: 使用中，2: 使用中で待ちあり */
+} __gthread_mutex_t;
+typedef struct {
+  __gthread_mutex_t mutex;
+  void *owner;
+  unsigned count;
+} __gthread_recursive_mutex_t;
+typedef struct {
+  int seq; /* 通知のたびに進める */
+} __gthread_cond_t;
+typedef struct timespec __gthread_time_t;
+
+#define __GTHREAD_MUTEX_INIT {0}
+#define __GTHREAD_RECURSIVE_MUTEX_INIT {{0}, 0, 0}
+#define __GTHREAD_ONCE_INIT {0}
+#define __GTHREAD_COND_INIT {0}
+
+/* src/gthr_freertospp.cpp */
+int freertospp_gthr_wait(int *addr, int expected,
+                         const __gthread_time_t *abs_timeout);
+void freertospp_gthr_wake(int *addr, int all);
+void *freertospp_gthr_current(void);
+int freertospp_gthr_create(__gthread_t *thread, void *(*func)(void *),
+                           void *args);
+int freertospp_gthr_join(__gthread_t thread, void **value_ptr);
+int freertospp_gthr_detach(__gthread_t thread);
+__gthread_t freertospp_gthr_self(void);
+int freertospp_gthr_yield(void);
+int freertospp_gthr_once(__gthread_once_t *once, void (*func)(void));
+int freertospp_gthr_key_create(__gthread_key_t *key, void (*dtor)(void *));
+int freertospp_gthr_key_delete(__gthread_key_t key);
+void *freertospp_gthr_getspecific(__gthread_key_t key);
+int freertospp_gthr_setspecific(__gthread_key_t key, const void *ptr);
+
+static inline int __gthread_active_p(void) { return 1; }
+
+/* スレッド */
+
+static inline int __gthread_create(__gthread_t *thread, void *(*func)(void *),
+                                   void *args) {
+  return freertospp_gthr_create(thread, func, args);
+}
+static inline int __gthread_join(__gthread_t thread, void **value_ptr) {
+  return freertospp_gthr_join(thread, value_ptr);
+}
+static inline int __gthread_detach(__gthread_t thread) {
+  return freertospp_gthr_detach(thread);
+}
+static inline int __gthread_equal(__gthread_t t1, __gthread_t t2) {
+  return t1 == t2;
+}
+static inline __gthread_t __gthread_self(void) {
+  return freertospp_gthr_self();
+}
+static inline int __gthread_yield(void) { return freertospp_gthr_yield(); }
+
+/* 一度だけの実行．完了後は acquire の読み込み1回だけ */
+
+static inline int __gthread_once(__gthread_once_t *once, void (*func)(void)) {
+  if (__atomic_load_n(&once->state, __ATOMIC_ACQUIRE) == 2)
+    return 0;
+  return freertospp_gthr_once(once, func);
+}
+
+/* スレッドローカルなキー */
+
+static inline int __gthread_key_create(__gthread_key_t *key,
+                                       void (*dtor)(void *)) {
+  return freertospp_gthr_key_create(key, dtor);
+}
+static inline int __gthread_key_delete(__gthread_key_t key) {
+  return freertospp_gthr_key_delete(key);
+}
+static inline void *__gthread_getspecific(__gthread_key_t key) {
+  return freertospp_gthr_getspecific(key);
+}
+static inline int __gthread_setspecific(__gthread_key_t key, const void *ptr) {
+  return freertospp_gthr_setspecific(key, ptr);
+}
+
+/* ミューテックス．競合しなければ CAS 1回で取れ，放すのも1回 */
+
+static inline int __gthread_mutex_destroy(__gthread_mutex_t *mutex) {
+  (void)mutex;
+  return 0;
+}
+static inline int __gthread_mutex_trylock(__gthread_mutex_t *mutex) {
+  int c = 0;
+  return __atomic_compare_exchange_n(&mutex->state, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)
+             ? 0
+             : EBUSY;
+}
+static inline int __gthread_mutex_timedlock(__gthread_mutex_t *mutex,
+                                            const __gthread_time_t *abs_timeout) {
+  int c = 0;
+  if (__atomic_compare_exchange_n(&mutex->state, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                  __ATOMIC_RELAXED))
+    return 0;
+  /* 待つときは 2 にして，放す側に起こしてもらう */
+  if (c != 2)
+    c = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+    const int res = freertospp_gthr_wait(&mutex->state, 2, abs_timeout);
+    c = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    if (c != 0 && res == ETIMEDOUT)
+      return ETIMEDOUT;
+  }
+  return 0;
+}
+static inline int __gthread_mutex_lock(__gthread_mutex_t *mutex) {
+  return __gthread_mutex_timedlock(mutex, 0);
+}
+static inline int __gthread_mutex_unlock(__gthread_mutex_t *mutex) {
+  if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) != 1) {
+    __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+    freertospp_gthr_wake(&mutex->state, 0);
+  }
+  return 0;
+}
+
+/* 再帰ミューテックス */
+
+static inline int
+__gthread_recursive_mutex_destroy(__gthread_recursive_mutex_t *mutex) {
+  (void)mutex;
+  return 0;
+}
+static inline int
+__gthread_recursive_mutex_timedlock(__gthread_recursive_mutex_t *mutex,
+                                    const __gthread_time_t *abs_timeout) {
+  void *self = freertospp_gthr_current();
+  if (__atomic_load_n(&mutex->owner, __ATOMIC_RELAXED) == self) {
+    ++mutex->count;
+    return 0;
+  }
+  const int res = __gthread_mutex_timedlock(&mutex->mutex, abs_timeout);
+  if (res != 0)
+    return res;
+  __atomic_store_n(&mutex->owner, self, __ATOMIC_RELAXED);
+  mutex->count = 1;
+  return 0;
+}
+static inline int
+__gthread_recursive_mutex_lock(__gthread_recursive_mutex_t *mutex) {
+  return __gthread_recursive_mutex_timedlock(mutex, 0);
+}
+static inline int
+__gthread_recursive_mutex_trylock(__gthread_recursive_mutex_t *mutex) {
+  void *self = freertospp_gthr_current();
+  if (__atomic_load_n(&mutex->owner, __ATOMIC_RELAXED) == self) {
+    ++mutex->count;
+    return 0;
+  }
+  if (__gthread_mutex_trylock(&mutex->mutex) != 0)
+    return EBUSY;
+  __atomic_store_n(&mutex->owner, self, __ATOMIC_RELAXED);
+  mutex->count = 1;
+  return 0;
+}
+static inline int
+__gthread_recursive_mutex_unlock(__gthread_recursive_mutex_t *mutex) {
+  if (--mutex->count == 0) {
+    __atomic_store_n(&mutex->owner, (void *)0, __ATOMIC_RELAXED);
+    __gthread_mutex_unlock(&mutex->mutex);
+  }
+  return 0;
+}
+
+/* 条件変数．通知は待つタスクがいなければ加算1回だけ */
+
+static inline int __gthread_cond_destroy(__gthread_cond_t *cond) {
+  (void)cond;
+  return 0;
+}
+static inline int __gthread_cond_signal(__gthread_cond_t *cond) {
+  __atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+  freertospp_gthr_wake(&cond->seq, 0);
+  return 0;
+}
+static inline int __gthread_cond_broadcast(__gthread_cond_t *cond) {
+  __atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+  freertospp_gthr_wake(&cond->seq, 1);
+  return 0;
+}
+static inline int __gthread_cond_timedwait(__gthread_cond_t *cond,
+                                           __gthread_mutex_t *mutex,
+                                           const __gthread_time_t *abs_timeout) {
+  /* ロックを放す前に読むので，その後の通知は取りこぼさない */
+  const int seq = __atomic_load_n(&cond->seq, __ATOMIC_RELAXED);
+  __gthread_mutex_unlock(mutex);
+  const int res = freertospp_gthr_wait(&cond->seq, seq, abs_timeout);
+  __gthread_mutex_lock(mutex);
+  return res;
+}
+static inline int __gthread_cond_wait(__gthread_cond_t *cond,
+                                      __gthread_mutex_t *mutex) {
+  __gthread_cond_timedwait(cond, mutex, 0);
+  return 0;
+}
+static inline int
+__gthread_cond_wait_recursive(__gthread_cond_t *cond,
+                              __gthread_recursive_mutex_t *mutex) {
+  const unsigned count = mutex->count;
+  void *owner = mutex->owner;
+  mutex->count = 0;
+  __atomic_store_n(&mutex->owner, (void *)0, __ATOMIC_RELAXED);
+  __gthread_cond_timedwait(cond, &mutex->mutex, 0);
+  __atomic_store_n(&mutex->owner, owner, __ATOMIC_RELAXED);
+  mutex->count = count;
+  return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GCC_GTHR_FREERTOSPP_H */
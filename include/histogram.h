@@ -0,0 +1,125 @@
+/**
+ * @brief Fixed-memory log-linear histogram for latencies and depths
+ *
+ * @file histogram.h
+ */
+#pragma once
+
+#include "esp_log.h"
+
+#include <cstdint>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 固定メモリの対数線形ヒストグラム
+ *
+ * 16 未満は 1 刻み，それ以上は 2 倍ごとの区間を 8 等分した幅
+ * (相対誤差 12.5% 以内) で数える．2^24 以上は最後のバケットに入る．
+ * 記録は割り当ても分岐の多い処理も行わず，呼び出し元に展開されるので，
+ * IRAM に置いたトレースフックなどからも呼べる．書き込むのは1つの
+ * タスクに限ること．コンストラクタは constexpr なので，静的に置けば
+ * 定数初期化される．
+ */
+class Histogram {
+public:
+  /* 16 未満，2^4 から 2^24 までの 20 区間，2^24 以上 */
+  static constexpr int Buckets = 16 + 20 * 8 + 1;
+
+  constexpr Histogram() : counts(), n(0), sum(0), maxValue(0) {}
+  void reset() {
+    for (int i = 0; i < Buckets; ++i)
+      counts[i] = 0;
+    n = 0;
+    sum = 0;
+    maxValue = 0;
+  }
+  /**
+   * @brief 値を1つ記録する関数
+   *
+   * @param weight 重み．時間で重みづけするときなどに使う
+   */
+  __attribute__((always_inline)) void record(uint32_t value,
+                                             uint32_t weight = 1) {
+    counts[index(value)] += weight;
+    n += weight;
+    sum += uint64_t(value) * weight;
+    if (value > maxValue)
+      maxValue = value;
+  }
+  /**
+   * @brief 他のヒストグラムを加える関数
+   */
+  void merge(const Histogram &other) {
+    for (int i = 0; i < Buckets; ++i)
+      counts[i] += other.counts[i];
+    n += other.n;
+    sum += other.sum;
+    if (other.maxValue > maxValue)
+      maxValue = other.maxValue;
+  }
+  uint64_t count() const { return n; }
+  uint32_t max() const { return maxValue; }
+  uint32_t mean() const { return n == 0 ? 0 : sum / n; }
+  /**
+   * @brief 百分位数．その値が入ったバケットの上端を返す
+   *
+   * @param permille 千分率．500 で中央値，990 で 99 パーセンタイル
+   */
+  uint32_t percentile(uint32_t permille) const {
+    if (n == 0)
+      return 0;
+    const uint64_t rank = (n * permille + 999) / 1000;
+    uint64_t acc = 0;
+    for (int i = 0; i < Buckets; ++i) {
+      acc += counts[i];
+      if (acc >= rank && acc > 0) {
+        const uint32_t upper = upperBound(i);
+        return upper < maxValue ? upper : maxValue;
+      }
+    }
+    return maxValue;
+  }
+  /**
+   * @brief バケットの範囲と数．表示や送信に使う
+   */
+  uint32_t bucketCount(int i) const { return counts[i]; }
+  static uint32_t lowerBound(int i) {
+    if (i < 16)
+      return i;
+    const int e = (i - 16) / 8 + 4;
+    return uint32_t(8 + (i - 16) % 8) << (e - 3);
+  }
+  static uint32_t upperBound(int i) {
+    if (i < 16)
+      return i;
+    if (i == Buckets - 1)
+      return UINT32_MAX;
+    return lowerBound(i + 1) - 1;
+  }
+  __attribute__((always_inline)) static int index(uint32_t value) {
+    if (value < 16)
+      return value;
+    const int e = 31 - __builtin_clz(value);
+    if (e >= 24)
+      return Buckets - 1;
+    return 16 + (e - 4) * 8 + ((value >> (e - 3)) & 7);
+  }
+  /**
+   * @brief 要約を1行で表示する関数
+   */
+  void print(const char *tag, const char *name, const char *unit) const {
+    ESP_LOGI(tag, "%s: n %u, mean %u, p50 %u, p99 %u, p99.9 %u, max %u [%s]",
+             name, (unsigned)n, (unsigned)mean(), (unsigned)percentile(500),
+             (unsigned)percentile(990), (unsigned)percentile(999),
+             (unsigned)maxValue, unit);
+  }
+
+private:
+  uint32_t counts[Buckets];
+  uint64_t n;
+  uint64_t sum;
+  uint32_t maxValue;
+};
+
+} // namespace FreeRTOSpp
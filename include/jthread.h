@@ -0,0 +1,296 @@
+/**
+ * @brief Thread that requests stop and joins on destruction
+ *
+ * @file jthread.h
+ */
+#pragma once
+
+#include "atomic_wait.h"
+#include "boot_profiler.h"
+#include "esp_log.h"
+#include "memory_accounting.h"
+#include "sched_latency.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <functional>
+#include <utility>
+
+namespace FreeRTOSpp {
+
+class StopSource;
+class StopToken;
+
+/**
+ * @brief 停止が要求されたときに呼ばれる関数の登録 (StopCallback の基底)
+ */
+class StopCallbackBase {
+protected:
+  friend class StopSource;
+  StopCallbackBase *next = NULL;
+  StopCallbackBase *prev = NULL;
+  StopSource *source = NULL;
+  std::atomic<bool> done{false}; //< 要求した側で呼び終えた
+  virtual void invoke() = 0;
+  inline void attach(const StopToken &token);
+  inline void detach();
+  ~StopCallbackBase() {}
+};
+
+/**
+ * @brief 停止の要求を出す側
+ *
+ * 割り当てを避けるため状態は StopSource 自身がもつ．StopToken と
+ * StopCallback は StopSource より先に破棄すること．
+ */
+class StopSource {
+public:
+  StopSource() {}
+  StopSource(const StopSource &) = delete;
+  StopSource &operator=(const StopSource &) = delete;
+
+  /**
+   * @brief 停止を要求する関数
+   * 登録された StopCallback はこの関数を呼んだタスクで順に呼ばれる．
+   *
+   * @return false すでに要求されていた
+   */
+  bool requestStop() {
+    portENTER_CRITICAL(&mux);
+    if (stopped.load(std::memory_order_relaxed)) {
+      portEXIT_CRITICAL(&mux);
+      return false;
+    }
+    stopped.store(true, std::memory_order_release);
+    requester = xTaskGetCurrentTaskHandle();
+    while (head != NULL) {
+      StopCallbackBase *cb = head;
+      unlink(cb);
+      running = cb;
+      portEXIT_CRITICAL(&mux);
+      cb->invoke();
+      portENTER_CRITICAL(&mux);
+      running = NULL;
+      portEXIT_CRITICAL(&mux);
+      /* これ以降 cb は破棄されうるので，通知にはアドレスだけを使う */
+      cb->done.store(true, std::memory_order_release);
+      atomicNotifyAll(cb->done);
+      portENTER_CRITICAL(&mux);
+    }
+    portEXIT_CRITICAL(&mux);
+    atomicNotifyAll(stopped);
+    return true;
+  }
+  bool stopRequested() const {
+    return stopped.load(std::memory_order_acquire);
+  }
+  inline StopToken getToken();
+
+private:
+  friend class StopToken;
+  friend class StopCallbackBase;
+  std::atomic<bool> stopped{false};
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  StopCallbackBase *head = NULL;
+  StopCallbackBase *running = NULL; //< 呼び出し中の StopCallback
+  TaskHandle_t requester = NULL;
+
+  void unlink(StopCallbackBase *cb) {
+    if (cb->prev != NULL)
+      cb->prev->next = cb->next;
+    else
+      head = cb->next;
+    if (cb->next != NULL)
+      cb->next->prev = cb->prev;
+    cb->next = cb->prev = NULL;
+  }
+};
+
+/**
+ * @brief 停止の要求を調べる側．StopSource::getToken() で得る．
+ */
+class StopToken {
+public:
+  StopToken() {}
+  /**
+   * @brief 停止が要求されたかどうか．atomic の読み込み1回だけ．
+   */
+  bool stopRequested() const {
+    return source != NULL && source->stopRequested();
+  }
+  bool stopPossible() const { return source != NULL; }
+  /**
+   * @brief 停止が要求されるまで最大 xBlockTime だけ眠る関数
+   *
+   * @return true 停止が要求された
+   */
+  bool sleep(TickType_t xBlockTime) const {
+    return sleep(Deadline(xBlockTime));
+  }
+  bool sleep(const Deadline &deadline) const {
+    if (source == NULL) {
+      vTaskDelay(deadline.remaining());
+      return false;
+    }
+    atomicWait(source->stopped, false, deadline);
+    return stopRequested();
+  }
+
+private:
+  friend class StopSource;
+  friend class StopCallbackBase;
+  StopSource *source = NULL;
+  explicit StopToken(StopSource *source) : source(source) {}
+};
+
+inline StopToken StopSource::getToken() { return StopToken(this); }
+
+/**
+ * @brief 停止が要求されたときに呼ばれる関数を登録する RAII オブジェクト
+ *
+ * すでに要求されていればコンストラクタの中で呼ぶ．ブロックしている
+ * タスクを起こす (セマフォを give する，タスク通知を送るなど) のに使う．
+ * 破棄は呼び出し中なら呼び終わるまで待つ．
+ *
+ * @tparam F 関数の型
+ */
+template <typename F> class StopCallback : public StopCallbackBase {
+public:
+  StopCallback(const StopToken &token, F func) : func(std::move(func)) {
+    attach(token);
+  }
+  ~StopCallback() { detach(); }
+  StopCallback(const StopCallback &) = delete;
+  StopCallback &operator=(const StopCallback &) = delete;
+
+private:
+  F func;
+  virtual void invoke() override { func(); }
+};
+
+inline void StopCallbackBase::attach(const StopToken &token) {
+  StopSource *s = token.source;
+  if (s == NULL)
+    return;
+  portENTER_CRITICAL(&s->mux);
+  if (!s->stopped.load(std::memory_order_relaxed)) {
+    source = s;
+    next = s->head;
+    if (next != NULL)
+      next->prev = this;
+    s->head = this;
+  }
+  portEXIT_CRITICAL(&s->mux);
+  if (source == NULL)
+    invoke();
+}
+
+inline void StopCallbackBase::detach() {
+  StopSource *s = source;
+  if (s == NULL)
+    return;
+  portENTER_CRITICAL(&s->mux);
+  const bool linked = prev != NULL || s->head == this;
+  if (linked)
+    s->unlink(this);
+  const bool self =
+      s->running == this && s->requester == xTaskGetCurrentTaskHandle();
+  portEXIT_CRITICAL(&s->mux);
+  /* 他のタスクで呼び出し中なら呼び終わるまで待つ．
+   * 自分の呼び出しの中から破棄されたときは待たない */
+  if (!linked && !self)
+    atomicWait(done, false);
+}
+
+/**
+ * @brief 破棄するときに停止を要求して終了を待つスレッド
+ *
+ * 関数には StopToken が渡されるので，stopRequested() を調べて
+ * 自分から戻ること．タスクを外から削除しないので，関数の中で
+ * 確保した資源は関数が戻るときに解放される．join() や
+ * StopToken::sleep() は AtomicWait で眠るので，呼んだタスクの
+ * タスク通知には触れない．
+ */
+class JThread {
+public:
+  JThread(std::function<void(StopToken)> func,
+          const char *const pcName = "unknown",
+          unsigned short usStackDepth = 8192,
+          unsigned portBASE_TYPE uxPriority = 0,
+          const BaseType_t xCoreID = tskNO_AFFINITY)
+      : pcName(pcName), usStackDepth(usStackDepth), func(func) {
+    BootProfiler::Scope scope(BootProfiler::TypeThread, pcName);
+    if (pdPASS != xTaskCreatePinnedToCore(entry_point, pcName, usStackDepth,
+                                          this, uxPriority, &pxCreatedTask,
+                                          xCoreID)) {
+      ESP_LOGW(tag, "couldn't create the task \"%s\"", pcName);
+      pxCreatedTask = NULL;
+      return;
+    }
+    scope.setTask(pxCreatedTask);
+    MemoryAccounting::add("JThread", pcName,
+                          MemoryAccounting::taskBytes(usStackDepth),
+                          sizeof(*this));
+  }
+  /**
+   * @brief 停止を要求し，終了を待つ
+   */
+  ~JThread() {
+    if (!joinable())
+      return;
+    requestStop();
+    join();
+  }
+  JThread(const JThread &) = delete;
+  JThread &operator=(const JThread &) = delete;
+
+  bool joinable() const { return pxCreatedTask != NULL; }
+  /**
+   * @brief 関数が戻るまで待つ関数
+   *
+   * @return false 時間切れ
+   */
+  bool join(TickType_t xBlockTime = portMAX_DELAY) {
+    return join(Deadline(xBlockTime));
+  }
+  bool join(const Deadline &deadline) {
+    if (!joinable())
+      return true;
+    if (!atomicWait(finished, false, deadline))
+      return false;
+    MemoryAccounting::remove("JThread", pcName,
+                             MemoryAccounting::taskBytes(usStackDepth),
+                             sizeof(*this));
+    pxCreatedTask = NULL;
+    return true;
+  }
+  bool requestStop() { return stopSource.requestStop(); }
+  StopToken getStopToken() { return stopSource.getToken(); }
+  StopSource &getStopSource() { return stopSource; }
+  TaskHandle_t getTaskHandle() const { return pxCreatedTask; }
+
+private:
+  const char *tag = "JThread";
+  const char *pcName;
+  unsigned short usStackDepth;
+  TaskHandle_t pxCreatedTask = NULL;
+  std::function<void(StopToken)> func;
+  StopSource stopSource;
+  std::atomic<bool> finished{false};
+
+  static void entry_point(void *arg) {
+    auto obj = static_cast<JThread *>(arg);
+    BootProfiler::firstRun();
+    /* 生成した側より先に終わることがあるので，自分で登録する */
+    SchedLatency::add(xTaskGetCurrentTaskHandle(), obj->pcName);
+    obj->func(obj->stopSource.getToken());
+    SchedLatency::remove(xTaskGetCurrentTaskHandle());
+    /* これ以降 obj は破棄されうるので触らない */
+    obj->finished.store(true, std::memory_order_release);
+    atomicNotifyAll(obj->finished);
+    vTaskDelete(NULL);
+  }
+};
+
+} // namespace FreeRTOSpp
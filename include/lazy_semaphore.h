@@ -0,0 +1,151 @@
+/**
+ * @brief Semaphore and Mutex that create their kernel objects on first use
+ *
+ * @file lazy_semaphore.h
+ */
+#pragma once
+
+#include "boot_profiler.h"
+#include "creation_profile.h"
+#include "deadline.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "memory_accounting.h"
+
+#include <atomic>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 初回使用時にカーネルオブジェクトを生成するハンドル
+ *
+ * コンストラクタは constexpr なので，グローバル変数は定数初期化され，
+ * 起動時にカーネルオブジェクトを生成しない．同時に初回使用されたときは
+ * 先に登録した方を使い，負けた方は自分の生成したものを削除する．
+ *
+ * @tparam Create カーネルオブジェクトを生成する関数
+ * @tparam Type 生成時間の記録に使う種類
+ * @tparam Name メモリの集計に使う種類名
+ */
+template <SemaphoreHandle_t (*Create)(), BootProfiler::Type Type,
+          const char *(*Name)()>
+class LazySemaphoreHandle {
+public:
+  constexpr LazySemaphoreHandle() : xSemaphore(nullptr) {}
+  ~LazySemaphoreHandle() {
+    SemaphoreHandle_t h = xSemaphore.load(std::memory_order_acquire);
+    if (h == NULL)
+      return;
+    MemoryAccounting::remove(Name(), NULL, MemoryAccounting::semaphoreBytes(),
+                             0);
+    vSemaphoreDelete(h);
+  }
+  LazySemaphoreHandle(const LazySemaphoreHandle &) = delete;
+  LazySemaphoreHandle &operator=(const LazySemaphoreHandle &) = delete;
+
+  /**
+   * @brief ハンドルを取得する関数．なければ生成する．
+   * 割り込みからは呼ばないこと．
+   */
+  SemaphoreHandle_t get() {
+    SemaphoreHandle_t h = xSemaphore.load(std::memory_order_acquire);
+    return h != NULL ? h : create();
+  }
+  /**
+   * @brief すでに生成されていればハンドルを取得する関数．割り込みから呼べる．
+   */
+  SemaphoreHandle_t peek() const {
+    return xSemaphore.load(std::memory_order_acquire);
+  }
+
+private:
+  std::atomic<SemaphoreHandle_t> xSemaphore;
+
+  SemaphoreHandle_t create() {
+    SemaphoreHandle_t h;
+    {
+      BootProfiler::Scope scope(Type);
+      h = Create();
+    }
+    if (h == NULL) {
+      ESP_LOGE("LazySemaphore", "creating kernel object failed");
+      return NULL;
+    }
+    SemaphoreHandle_t expected = NULL;
+    if (!xSemaphore.compare_exchange_strong(expected, h,
+                                            std::memory_order_acq_rel)) {
+      vSemaphoreDelete(h);
+      return expected;
+    }
+    MemoryAccounting::add(Name(), NULL, MemoryAccounting::semaphoreBytes(), 0);
+    return h;
+  }
+};
+
+namespace detail {
+inline SemaphoreHandle_t createBinary() { return xSemaphoreCreateBinary(); }
+inline SemaphoreHandle_t createMutex() { return xSemaphoreCreateMutex(); }
+inline const char *nameLazySemaphore() { return "LazySemaphore"; }
+inline const char *nameLazyMutex() { return "LazyMutex"; }
+} // namespace detail
+
+/**
+ * @brief 初回使用時に生成される Semaphore
+ * 生成前の giveFromISR() は失敗する．割り込みから使う場合は，
+ * あらかじめタスクから init() を呼んでおくこと．
+ */
+class LazySemaphore {
+public:
+  constexpr LazySemaphore() {}
+  /**
+   * @brief カーネルオブジェクトを今すぐ生成する関数
+   */
+  bool init() { return handle.get() != NULL; }
+  bool giveFromISR() {
+    SemaphoreHandle_t h = handle.peek();
+    return h != NULL && pdTRUE == xSemaphoreGiveFromISR(h, NULL);
+  }
+  bool give() { return pdTRUE == xSemaphoreGive(handle.get()); }
+  bool take(portTickType xBlockTime = portMAX_DELAY) {
+    return pdTRUE == xSemaphoreTake(handle.get(), xBlockTime);
+  }
+  bool take(const Deadline &deadline) {
+    return take(deadline.remaining());
+  }
+
+private:
+  LazySemaphoreHandle<detail::createBinary, BootProfiler::TypeLazySemaphore,
+                      detail::nameLazySemaphore>
+      handle;
+};
+
+/**
+ * @brief 初回使用時に生成される Mutex
+ */
+class LazyMutex {
+public:
+  constexpr LazyMutex() {}
+  /**
+   * @brief カーネルオブジェクトを今すぐ生成する関数
+   */
+  bool init() { return handle.get() != NULL; }
+  bool giveFromISR() {
+    SemaphoreHandle_t h = handle.peek();
+    return h != NULL && pdTRUE == xSemaphoreGiveFromISR(h, NULL);
+  }
+  bool give() { return pdTRUE == xSemaphoreGive(handle.get()); }
+  bool take(portTickType xBlockTime = portMAX_DELAY) {
+    return pdTRUE == xSemaphoreTake(handle.get(), xBlockTime);
+  }
+  bool take(const Deadline &deadline) {
+    return take(deadline.remaining());
+  }
+
+private:
+  LazySemaphoreHandle<detail::createMutex, BootProfiler::TypeLazyMutex,
+                      detail::nameLazyMutex>
+      handle;
+};
+
+} // namespace FreeRTOSpp
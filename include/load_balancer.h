@@ -0,0 +1,265 @@
+/**
+ * @brief Runtime load balancer for tasks created by FreeRTOSpp
+ *
+ * @file load_balancer.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "runtime_stats.h"
+
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 各コアの使用率を監視し，登録されたタスクをコア間で移動するタスク
+ *
+ * SMP カーネル (configUSE_CORE_AFFINITY) では vTaskCoreAffinitySet()
+ * でコアを付け替える．それ以外では TaskBase::recreateTask()
+ * により移動先のコアでタスクを生成し直すので，TaskBase
+ * の場合は再実行に耐えるタスクだけを登録すること．
+ */
+class LoadBalancer : public TaskBase {
+public:
+  /**
+   * @brief タスクの移動記録
+   */
+  struct Migration {
+    TickType_t xTick;    //< 移動した時刻
+    const char *pcName;  //< タスク名
+    BaseType_t xFrom;    //< 移動元コア (tskNO_AFFINITY はコア未指定)
+    BaseType_t xTo;      //< 移動先コア
+    uint8_t ucLoadFrom;  //< 移動前の移動元コアの使用率 [%]
+    uint8_t ucLoadTo;    //< 移動前の移動先コアの使用率 [%]
+    uint8_t ucTaskLoad;  //< 移動したタスクの使用率 [%]
+  };
+  static constexpr int MigrationLogSize = 16;
+
+  /**
+   * @brief Construct a new Load Balancer object
+   *
+   * @param xPeriod 監視周期
+   * @param ucHysteresis コア間の使用率の差がこれ未満なら移動しない [%]
+   * @param ucCooldown 移動後に移動を控える周期数
+   */
+  LoadBalancer(TickType_t xPeriod = pdMS_TO_TICKS(1000),
+               uint8_t ucHysteresis = 15, uint8_t ucCooldown = 3)
+      : xPeriod(xPeriod), ucHysteresis(ucHysteresis), ucCooldown(ucCooldown) {
+  }
+  /**
+   * @brief 監視タスクを開始する関数
+   */
+  bool start(UBaseType_t uxPriority = 1, const uint16_t usStackDepth = 4096,
+             const BaseType_t xCoreID = tskNO_AFFINITY) {
+    return createTask("LoadBalancer", uxPriority, usStackDepth, xCoreID);
+  }
+  /**
+   * @brief 移動対象として TaskBase を登録する関数
+   */
+  bool add(TaskBase &task) {
+    if (task.getTaskHandle() == NULL) {
+      ESP_LOGW(tag, "task is not created");
+      return false;
+    }
+    Entry e = {&task, task.getTaskHandle(), task.getTaskName(),
+               task.getCoreID(), 0};
+    return add(e);
+  }
+#if defined(configUSE_CORE_AFFINITY) && configUSE_CORE_AFFINITY
+  /**
+   * @brief 移動対象としてタスクハンドルを登録する関数 (SMP カーネルのみ)
+   */
+  bool add(TaskHandle_t xHandle, const char *pcName,
+           const BaseType_t xCoreID = tskNO_AFFINITY) {
+    if (xHandle == NULL) {
+      ESP_LOGW(tag, "task is not created");
+      return false;
+    }
+    Entry e = {NULL, xHandle, pcName, xCoreID, 0};
+    return add(e);
+  }
+#endif
+  /**
+   * @brief 登録を解除する関数．タスクを削除する前に呼ぶこと．
+   */
+  void remove(TaskHandle_t xHandle) {
+    mutex.take();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      if (it->xHandle == xHandle) {
+        entries.erase(it);
+        break;
+      }
+    }
+    mutex.give();
+  }
+  /**
+   * @brief 直近の周期での各コアの使用率 [%]
+   */
+  uint8_t getCoreLoad(UBaseType_t core) const {
+    return core < portNUM_PROCESSORS ? ucCoreLoad[core] : 0;
+  }
+  /**
+   * @brief 移動記録を新しい順に取得する関数
+   *
+   * @return 取得した記録の数
+   */
+  int getMigrations(Migration *pxBuffer, int n) {
+    mutex.take();
+    int count = 0;
+    for (; count < n && count < xMigrationCount &&
+           count < MigrationLogSize;
+         ++count)
+      pxBuffer[count] =
+          xMigrations[(xMigrationCount - 1 - count) % MigrationLogSize];
+    mutex.give();
+    return count;
+  }
+  /**
+   * @brief 移動記録を表示する関数
+   */
+  void printMigrations() {
+    Migration m[MigrationLogSize];
+    const int n = getMigrations(m, MigrationLogSize);
+    for (int i = n - 1; i >= 0; --i)
+      ESP_LOGI(tag, "%u: \"%s\" core %d(%u%%) -> core %d(%u%%), load %u%%",
+               (unsigned)m[i].xTick, m[i].pcName, (int)m[i].xFrom,
+               m[i].ucLoadFrom, (int)m[i].xTo, m[i].ucLoadTo, m[i].ucTaskLoad);
+  }
+
+protected:
+  const char *tag = "LoadBalancer";
+
+  /**
+   * @brief 登録されたタスクの情報
+   */
+  struct Entry {
+    TaskBase *pxTask;       //< 生成し直すためのタスク (NULL ならハンドルのみ)
+    TaskHandle_t xHandle;   //< タスクのハンドル
+    const char *pcName;     //< タスク名
+    BaseType_t xCoreID;     //< 現在の実行コア
+    uint8_t ucLoad;         //< 直近の周期での使用率 [%]
+  };
+
+  Mutex mutex;
+  std::vector<Entry> entries;
+  TickType_t xPeriod;
+  uint8_t ucHysteresis;
+  uint8_t ucCooldown;
+  uint8_t ucCoreLoad[portNUM_PROCESSORS] = {};
+  Migration xMigrations[MigrationLogSize];
+  int xMigrationCount = 0;
+
+  bool add(const Entry &e) {
+    mutex.take();
+    for (const auto &it : entries) {
+      if (it.xHandle == e.xHandle) {
+        mutex.give();
+        ESP_LOGW(tag, "task \"%s\" is already added", e.pcName);
+        return false;
+      }
+    }
+    entries.push_back(e);
+    mutex.give();
+    return true;
+  }
+
+  virtual void task() override {
+    RuntimeSnapshot prev, curr;
+    prev.update();
+    uint8_t cooldown = 0;
+    TickType_t xLastWakeTime = xTaskGetTickCount();
+    while (1) {
+      vTaskDelayUntil(&xLastWakeTime, xPeriod);
+      if (!curr.update())
+        continue;
+      mutex.take();
+      measure(prev, curr);
+      if (cooldown > 0)
+        --cooldown;
+      else if (balance())
+        cooldown = ucCooldown;
+      mutex.give();
+      std::swap(prev, curr);
+    }
+  }
+
+  void measure(const RuntimeSnapshot &prev, const RuntimeSnapshot &curr) {
+    for (int i = 0; i < portNUM_PROCESSORS; ++i)
+      ucCoreLoad[i] = RuntimeSnapshot::coreLoad(prev, curr, i);
+    const uint32_t total = RuntimeSnapshot::elapsed(prev, curr);
+    for (auto &e : entries) {
+      const uint32_t rt = RuntimeSnapshot::runtime(prev, curr, e.xHandle);
+      e.ucLoad = total ? uint64_t(rt) * 100 / total : 0;
+    }
+  }
+
+  /**
+   * @brief 最も混んでいるコアから最も空いているコアへ1つのタスクを移動する
+   *
+   * 使用率 x のタスクを移動するとコア間の差 d は |d - 2x| になる．
+   * 差がヒステリシス幅の半分以上縮まるタスクの中で最も差を小さくするものを選ぶ．
+   *
+   * @return true 移動した
+   */
+  bool balance() {
+    int busiest = 0, idlest = 0;
+    for (int i = 1; i < portNUM_PROCESSORS; ++i) {
+      if (ucCoreLoad[i] > ucCoreLoad[busiest])
+        busiest = i;
+      if (ucCoreLoad[i] < ucCoreLoad[idlest])
+        idlest = i;
+    }
+    const int diff = ucCoreLoad[busiest] - ucCoreLoad[idlest];
+    if (diff < ucHysteresis)
+      return false;
+    Entry *best = NULL;
+    int best_diff = diff - ucHysteresis / 2;
+    for (auto &e : entries) {
+      /* コア未指定のタスクはどちらのコアで動いているかわからないので，
+       * 混んでいるコアにいるものとして扱い，固定する */
+      if (e.xCoreID != busiest && e.xCoreID != tskNO_AFFINITY)
+        continue;
+      const int new_diff = std::abs(diff - 2 * e.ucLoad);
+      if (new_diff < best_diff) {
+        best_diff = new_diff;
+        best = &e;
+      }
+    }
+    if (best == NULL)
+      return false;
+    Migration &m = xMigrations[xMigrationCount++ % MigrationLogSize];
+    m.xTick = xTaskGetTickCount();
+    m.pcName = best->pcName;
+    m.xFrom = best->xCoreID;
+    m.xTo = idlest;
+    m.ucLoadFrom = ucCoreLoad[busiest];
+    m.ucLoadTo = ucCoreLoad[idlest];
+    m.ucTaskLoad = best->ucLoad;
+    if (!migrate(*best, idlest)) {
+      ESP_LOGW(tag, "couldn't migrate the task \"%s\"", best->pcName);
+      --xMigrationCount;
+      return false;
+    }
+    ESP_LOGI(tag, "migrated \"%s\" (%u%%) to core %d, loads %u%% / %u%%",
+             best->pcName, best->ucLoad, idlest, ucCoreLoad[busiest],
+             ucCoreLoad[idlest]);
+    return true;
+  }
+
+  bool migrate(Entry &e, const BaseType_t xCoreID) {
+#if defined(configUSE_CORE_AFFINITY) && configUSE_CORE_AFFINITY
+    vTaskCoreAffinitySet(e.xHandle, UBaseType_t(1) << xCoreID);
+#else
+    if (e.pxTask == NULL || !e.pxTask->recreateTask(xCoreID))
+      return false;
+    e.xHandle = e.pxTask->getTaskHandle();
+#endif
+    e.xCoreID = xCoreID;
+    return true;
+  }
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,275 @@
+/**
+ * @brief Synthetic periodic workload for capacity planning
+ *
+ * @file load_generator.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "atomic_wait.h"
+#include "esp_timer.h"
+#include "histogram.h"
+#include "runtime_stats.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 周期タスクの組み合わせで負荷をかけ，余裕を測る
+ *
+ * add() で指定した周期・実行時間・ロック・メッセージ数の TaskBase を
+ * 並べ，run() の間だけ動かす．各タスクの起床遅れと応答時間，
+ * メッセージの遅延をヒストグラムに記録し，アイドルタスクの実行時間
+ * から各コアの余裕を求める．実行時間は esp_timer による空回しなので，
+ * 横取りされた時間も含む．
+ */
+class LoadGenerator {
+public:
+  /**
+   * @brief 負荷をかけるタスク1つの設定
+   */
+  struct Spec {
+    const char *pcName;     //< タスク名
+    TickType_t xPeriod;     //< 周期 (1 以上)
+    uint32_t ulExecUs;      //< 1周期の実行時間 [us]
+    uint32_t ulLockUs;      //< そのうち共有の Mutex を持つ時間 [us]
+    uint16_t usMessages;    //< 1周期に送るメッセージの数
+    UBaseType_t uxPriority; //< 優先度
+    BaseType_t xCoreID;     //< 実行コア
+  };
+  /**
+   * @brief タスク1つの結果
+   */
+  struct Result {
+    const char *pcName;
+    uint32_t ulCompleted; //< 実行し終えた周期の数
+    uint32_t ulOverruns;  //< 次の周期までに終わらなかった数
+    uint32_t ulDropped;   //< キューが満杯で送れなかったメッセージの数
+    Histogram start;      //< 周期の始まりから実行開始まで [us]
+    Histogram response;   //< 周期の始まりから実行終了まで [us]
+  };
+
+  /**
+   * @param uxQueueLength メッセージを受けるキューの長さ
+   * @param uxSinkPriority メッセージを受けるタスクの優先度
+   */
+  explicit LoadGenerator(UBaseType_t uxQueueLength = 32,
+                         UBaseType_t uxSinkPriority = 1,
+                         BaseType_t xSinkCoreID = tskNO_AFFINITY)
+      : queue(uxQueueLength), sink(*this), uxSinkPriority(uxSinkPriority),
+        xSinkCoreID(xSinkCoreID) {
+    queue.setName("LoadSink");
+  }
+  ~LoadGenerator() { stop(); }
+  LoadGenerator(const LoadGenerator &) = delete;
+  LoadGenerator &operator=(const LoadGenerator &) = delete;
+
+  /**
+   * @brief 負荷をかけるタスクを加える関数．run() の前に呼ぶこと．
+   *
+   * @return false 周期が 0
+   */
+  bool add(const Spec &spec) {
+    if (spec.xPeriod == 0) {
+      ESP_LOGW(tag, "period of \"%s\" must not be 0", spec.pcName);
+      return false;
+    }
+    workers.push_back(std::unique_ptr<Worker>(new Worker(*this, spec)));
+    return true;
+  }
+  /**
+   * @brief xDuration の間負荷をかけ，終わるまで戻らない関数
+   */
+  bool run(TickType_t xDuration) {
+    if (running.load()) {
+      ESP_LOGW(tag, "already running");
+      return false;
+    }
+    for (auto &w : workers)
+      w->reset();
+    sink.latency.reset();
+    sink.ulReceived = 0;
+    stopped = 0;
+    running = true;
+    /* ティックが進んだ直後の時刻を，周期の始まりを求める原点にする */
+    const TickType_t xTick = xTaskGetTickCount();
+    while (xTaskGetTickCount() == xTick) {
+    }
+    originUs = esp_timer_get_time();
+    xOriginTick = xTaskGetTickCount();
+    RuntimeSnapshot before;
+    before.update();
+    const int64_t start = esp_timer_get_time();
+    bool res = sink.createTask("LoadSink", uxSinkPriority, 4096, xSinkCoreID);
+    for (auto &w : workers)
+      res &= w->createTask(w->spec.pcName, w->spec.uxPriority, 4096,
+                           w->spec.xCoreID);
+    vTaskDelay(xDuration);
+    RuntimeSnapshot after;
+    after.update();
+    elapsedUs = esp_timer_get_time() - start;
+    for (int i = 0; i < portNUM_PROCESSORS; ++i)
+      coreLoad[i] = RuntimeSnapshot::coreLoad(before, after, i);
+    stop();
+    return res;
+  }
+  size_t size() const { return workers.size(); }
+  const Result &getResult(size_t i) const { return workers[i]->result; }
+  /**
+   * @brief メッセージの送信から受信までの時間 [us]
+   */
+  const Histogram &getMessageLatency() const { return sink.latency; }
+  /**
+   * @brief 直前の run() での各コアの余裕 [%]
+   */
+  uint8_t getHeadroom(UBaseType_t core) const { return 100 - coreLoad[core]; }
+  void print() const {
+    const uint32_t ms = elapsedUs / 1000;
+    for (auto &w : workers) {
+      const Result &r = w->result;
+      ESP_LOGI(tag, "%s: %u periods (%u/s), %u overruns, %u dropped",
+               r.pcName, (unsigned)r.ulCompleted,
+               (unsigned)(ms ? uint64_t(r.ulCompleted) * 1000 / ms : 0),
+               (unsigned)r.ulOverruns, (unsigned)r.ulDropped);
+      r.start.print(tag, "  start", "us");
+      r.response.print(tag, "  response", "us");
+    }
+    ESP_LOGI(tag, "messages: %u (%u/s)", (unsigned)sink.ulReceived,
+             (unsigned)(ms ? uint64_t(sink.ulReceived) * 1000 / ms : 0));
+    sink.latency.print(tag, "  latency", "us");
+    for (int i = 0; i < portNUM_PROCESSORS; ++i)
+      ESP_LOGI(tag, "core %d: load %u%%, headroom %u%%", i,
+               (unsigned)coreLoad[i], (unsigned)getHeadroom(i));
+  }
+
+private:
+  const char *tag = "LoadGenerator";
+
+  struct Message {
+    uint32_t ulSentUs;
+  };
+
+  class Worker : public TaskBase {
+  public:
+    Worker(LoadGenerator &gen, const Spec &spec) : gen(gen), spec(spec) {}
+    void reset() {
+      result = Result();
+      result.pcName = spec.pcName;
+    }
+    LoadGenerator &gen;
+    Spec spec;
+    Result result;
+
+  protected:
+    virtual void task() override {
+      /* 周期の始まりはティックの境界の時刻．起床の遅れを含めないよう，
+         起きた時刻ではなくティック数から求める */
+      TickType_t xLastWakeTime = xTaskGetTickCount();
+      while (gen.running.load(std::memory_order_relaxed)) {
+        const int64_t release = gen.tickToUs(xLastWakeTime);
+        const int64_t begin = esp_timer_get_time();
+        /* 原点の読み取りの遅れで数 us 負になりうるので 0 にする */
+        result.start.record(begin > release ? begin - release : 0);
+        const uint32_t ulLockUs = spec.ulLockUs < spec.ulExecUs ? spec.ulLockUs
+                                                          : spec.ulExecUs;
+        if (ulLockUs > 0) {
+          gen.mutex.take();
+          spin(ulLockUs);
+          gen.mutex.give();
+        }
+        spin(spec.ulExecUs - ulLockUs);
+        for (uint16_t i = 0; i < spec.usMessages; ++i) {
+          const Message msg = {uint32_t(esp_timer_get_time())};
+          if (!gen.queue.send(msg, 0))
+            ++result.ulDropped;
+        }
+        const int64_t end = esp_timer_get_time();
+        result.response.record(end > release ? end - release : 0);
+        ++result.ulCompleted;
+        if (end > gen.tickToUs(xLastWakeTime + spec.xPeriod))
+          ++result.ulOverruns;
+        vTaskDelayUntil(&xLastWakeTime, spec.xPeriod);
+      }
+      gen.finish();
+    }
+  };
+
+  class Sink : public TaskBase {
+  public:
+    explicit Sink(LoadGenerator &gen) : gen(gen) {}
+    LoadGenerator &gen;
+    Histogram latency;
+    uint32_t ulReceived = 0;
+
+  protected:
+    virtual void task() override {
+      while (1) {
+        Message msg;
+        if (!gen.queue.receive(msg, 1)) {
+          if (!gen.running.load(std::memory_order_relaxed))
+            break;
+          continue;
+        }
+        latency.record(uint32_t(esp_timer_get_time()) - msg.ulSentUs);
+        ++ulReceived;
+      }
+      gen.finish();
+    }
+  };
+
+  std::atomic<bool> running{false};
+  Mutex mutex;                 //< ulLockUs の間持つ共有のロック
+  Queue<Message> queue;        //< メッセージの行き先
+  std::atomic<int> stopped{0}; //< 周期の区切りで止まったタスクの数
+  std::vector<std::unique_ptr<Worker>> workers;
+  Sink sink;
+  UBaseType_t uxSinkPriority;
+  BaseType_t xSinkCoreID;
+  int64_t elapsedUs = 0;
+  uint8_t coreLoad[portNUM_PROCESSORS] = {};
+  int64_t originUs = 0;        //< xOriginTick が始まった時刻 [us]
+  TickType_t xOriginTick = 0;
+
+  /**
+   * @brief ティック xTick が始まった時刻 [us]
+   */
+  int64_t tickToUs(TickType_t xTick) const {
+    return originUs + int64_t(int32_t(xTick - xOriginTick)) * 1000000 /
+                          configTICK_RATE_HZ;
+  }
+
+  static void spin(uint32_t us) {
+    const int64_t end = esp_timer_get_time() + us;
+    while (esp_timer_get_time() < end) {
+    }
+  }
+  /**
+   * @brief 止まったことを知らせ，削除されるのを待つ
+   */
+  void finish() {
+    stopped.fetch_add(1);
+    atomicNotifyAll(stopped);
+    vTaskDelay(portMAX_DELAY);
+  }
+  /**
+   * @brief 周期の途中でないところで止まるのを待ってからタスクを削除する
+   */
+  void stop() {
+    if (!running.exchange(false))
+      return;
+    int created = sink.getTaskHandle() != NULL;
+    for (auto &w : workers)
+      created += w->getTaskHandle() != NULL;
+    AtomicWait::wait(&stopped, [&]() { return stopped.load() < created; });
+    if (sink.getTaskHandle() != NULL)
+      sink.deleteTask();
+    for (auto &w : workers)
+      if (w->getTaskHandle() != NULL)
+        w->deleteTask();
+  }
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,134 @@
+/**
+ * @brief Contention statistics for Mutex
+ *
+ * @file lock_stats.h
+ *
+ * FREERTOSPP_LOCK_STATS を 1 にして全体をビルドすると，すべての Mutex
+ * が競合の統計をとるようになる．
+ */
+#pragma once
+
+#ifndef FREERTOSPP_LOCK_STATS
+#define FREERTOSPP_LOCK_STATS 0
+#endif
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 1つのロックの競合の統計
+ * 生存しているものはすべて登録され，getAll() で列挙できる．
+ */
+class LockStats {
+public:
+  /**
+   * @brief 統計の値
+   */
+  struct Counters {
+    const char *name;   //< ロックの名前
+    uint32_t takes;     //< take() した回数
+    uint32_t contended; //< すぐには取れなかった回数
+    uint32_t waitUs;    //< 待った時間の合計 [us]
+    uint32_t maxWaitUs; //< 待った時間の最大 [us]
+  };
+
+  LockStats() {
+    portENTER_CRITICAL(&registry().mux);
+    next = registry().head;
+    registry().head = this;
+    portEXIT_CRITICAL(&registry().mux);
+  }
+  ~LockStats() {
+    portENTER_CRITICAL(&registry().mux);
+    for (LockStats **p = &registry().head; *p != NULL; p = &(*p)->next) {
+      if (*p == this) {
+        *p = next;
+        break;
+      }
+    }
+    portEXIT_CRITICAL(&registry().mux);
+  }
+  LockStats(const LockStats &) = delete;
+  LockStats &operator=(const LockStats &) = delete;
+
+  void setName(const char *name) { this->name = name; }
+  /**
+   * @brief 統計をとりながらセマフォを取る関数
+   */
+  bool take(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime) {
+    takes.fetch_add(1, std::memory_order_relaxed);
+    if (pdTRUE == xSemaphoreTake(xSemaphore, 0))
+      return true;
+    contended.fetch_add(1, std::memory_order_relaxed);
+    if (xBlockTime == 0)
+      return false;
+    const int64_t start = esp_timer_get_time();
+    const bool res = pdTRUE == xSemaphoreTake(xSemaphore, xBlockTime);
+    const uint32_t us = esp_timer_get_time() - start;
+    waitUs.fetch_add(us, std::memory_order_relaxed);
+    uint32_t max = maxWaitUs.load(std::memory_order_relaxed);
+    while (us > max && !maxWaitUs.compare_exchange_weak(
+                           max, us, std::memory_order_relaxed))
+      ;
+    return res;
+  }
+  Counters get() const {
+    Counters c;
+    c.name = name;
+    c.takes = takes.load(std::memory_order_relaxed);
+    c.contended = contended.load(std::memory_order_relaxed);
+    c.waitUs = waitUs.load(std::memory_order_relaxed);
+    c.maxWaitUs = maxWaitUs.load(std::memory_order_relaxed);
+    return c;
+  }
+  /**
+   * @brief 生存しているロックの数
+   */
+  static int count() {
+    portENTER_CRITICAL(&registry().mux);
+    int n = 0;
+    for (LockStats *s = registry().head; s != NULL; s = s->next)
+      ++n;
+    portEXIT_CRITICAL(&registry().mux);
+    return n;
+  }
+  /**
+   * @brief 生存しているすべてのロックの統計を取得する関数
+   *
+   * @return 取得した数
+   */
+  static int getAll(Counters *pxBuffer, int n) {
+    portENTER_CRITICAL(&registry().mux);
+    int i = 0;
+    for (LockStats *s = registry().head; s != NULL && i < n; s = s->next)
+      pxBuffer[i++] = s->get();
+    portEXIT_CRITICAL(&registry().mux);
+    return i;
+  }
+
+private:
+  const char *name = "";
+  std::atomic<uint32_t> takes{0};
+  std::atomic<uint32_t> contended{0};
+  std::atomic<uint32_t> waitUs{0};
+  std::atomic<uint32_t> maxWaitUs{0};
+  LockStats *next = NULL;
+
+  struct Registry {
+    portMUX_TYPE mux;
+    LockStats *head;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static Registry &registry() {
+    static Registry r = {portMUX_INITIALIZER_UNLOCKED, NULL};
+    return r;
+  }
+};
+
+} // namespace FreeRTOSpp
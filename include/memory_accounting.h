@@ -0,0 +1,251 @@
+/**
+ * @brief RAM accounting for objects created through FreeRTOSpp
+ *
+ * @file memory_accounting.h
+ *
+ * FREERTOSPP_MEMORY_ACCOUNTING を 1 にして全体をビルドすると有効になる．
+ * 無効のときはすべての記録が空の関数になる．
+ */
+#pragma once
+
+#ifndef FREERTOSPP_MEMORY_ACCOUNTING
+#define FREERTOSPP_MEMORY_ACCOUNTING 0
+#endif
+#ifndef FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES
+#define FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES 48
+#endif
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#include <cstddef>
+#include <cstring>
+
+/**
+ * @brief xTaskCreate() などに渡すスタックサイズをバイト数にする
+ * ESP-IDF ではスタックサイズはバイト単位，本家 FreeRTOS ではワード単位
+ */
+#ifdef ESP_PLATFORM
+#define FREERTOSPP_STACK_BYTES(depth) (size_t(depth))
+#else
+#define FREERTOSPP_STACK_BYTES(depth) (size_t(depth) * sizeof(StackType_t))
+#endif
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 同期プリミティブやタスクが使う RAM の集計
+ *
+ * 種類とインスタンス名ごとに，ヒープに確保されたバイト数
+ * (カーネルオブジェクト，スタック，キューの領域) と，ラッパオブジェクト
+ * 自身のバイト数を集計する．名前のないものは種類ごとにまとめる．
+ * Task と TaskBase は継承して使うため，基底クラスからは派生クラスの
+ * 大きさが分からない．これらはラッパを 0 とし，TCB とスタックだけを数える．
+ */
+class MemoryAccounting {
+public:
+  /**
+   * @brief 集計の1行
+   */
+  struct Entry {
+    const char *type;   //< 種類
+    const char *name;   //< インスタンス名
+    uint16_t count;     //< 生存している数
+    size_t heapBytes;   //< ヒープに確保されたバイト数
+    size_t staticBytes; //< ラッパオブジェクトのバイト数
+  };
+
+#if FREERTOSPP_MEMORY_ACCOUNTING
+  /**
+   * @brief 生成を記録する関数
+   */
+  static void add(const char *type, const char *name, size_t heapBytes,
+                  size_t staticBytes) {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    Entry *e = find(type, name, true);
+    if (e != NULL) {
+      ++e->count;
+      e->heapBytes += heapBytes;
+      e->staticBytes += staticBytes;
+    }
+    portEXIT_CRITICAL(&s.mux);
+    if (e == NULL)
+      ESP_LOGW("MemoryAccounting", "table is full, \"%s\" is not recorded",
+               type);
+  }
+  /**
+   * @brief 削除を記録する関数．add() と同じ引数で呼ぶこと．
+   */
+  static void remove(const char *type, const char *name, size_t heapBytes,
+                     size_t staticBytes) {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    Entry *e = find(type, name, false);
+    if (e != NULL && e->count > 0) {
+      --e->count;
+      e->heapBytes -= heapBytes;
+      e->staticBytes -= staticBytes;
+    }
+    portEXIT_CRITICAL(&s.mux);
+  }
+  /**
+   * @brief 種類ごとの予算を設定する関数
+   *
+   * @param bytes ヒープとラッパの合計の上限，0 なら無制限
+   */
+  static bool setBudget(const char *type, size_t bytes) {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    int i = 0;
+    for (; i < s.budgetCount; ++i)
+      if (strcmp(s.budgets[i].type, type) == 0)
+        break;
+    const bool ok = i < MaxBudgets;
+    if (ok) {
+      s.budgets[i].type = type;
+      s.budgets[i].bytes = bytes;
+      if (i == s.budgetCount)
+        ++s.budgetCount;
+    }
+    portEXIT_CRITICAL(&s.mux);
+    return ok;
+  }
+  /**
+   * @brief 種類ごとの合計 [byte]
+   */
+  static size_t total(const char *type = NULL) {
+    State &s = state();
+    size_t sum = 0;
+    portENTER_CRITICAL(&s.mux);
+    for (int i = 0; i < s.count; ++i)
+      if (type == NULL || strcmp(s.entries[i].type, type) == 0)
+        sum += s.entries[i].heapBytes + s.entries[i].staticBytes;
+    portEXIT_CRITICAL(&s.mux);
+    return sum;
+  }
+  /**
+   * @brief 予算を超えた種類があれば警告する関数
+   *
+   * @return true すべて予算内
+   */
+  static bool checkBudgets() {
+    State &s = state();
+    bool ok = true;
+    for (int i = 0; i < s.budgetCount; ++i) {
+      const size_t used = total(s.budgets[i].type);
+      if (s.budgets[i].bytes != 0 && used > s.budgets[i].bytes) {
+        ESP_LOGW("MemoryAccounting", "%s uses %u bytes, budget %u bytes",
+                 s.budgets[i].type, (unsigned)used,
+                 (unsigned)s.budgets[i].bytes);
+        ok = false;
+      }
+    }
+    return ok;
+  }
+  /**
+   * @brief 集計を取得する関数
+   *
+   * @return 取得した行数
+   */
+  static int get(Entry *pxBuffer, int n) {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    int i = 0;
+    for (; i < n && i < s.count; ++i)
+      pxBuffer[i] = s.entries[i];
+    portEXIT_CRITICAL(&s.mux);
+    return i;
+  }
+  /**
+   * @brief 集計を表にして表示する関数
+   */
+  static void print() {
+    const char *tag = "MemoryAccounting";
+    Entry entries[FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES];
+    const int n = get(entries, FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES);
+    size_t heap = 0, wrapper = 0;
+    ESP_LOGI(tag, "%-16s %-16s %5s %8s %8s", "type", "name", "count", "heap",
+             "static");
+    for (int i = 0; i < n; ++i) {
+      const Entry &e = entries[i];
+      if (e.count == 0 && e.heapBytes == 0 && e.staticBytes == 0)
+        continue;
+      ESP_LOGI(tag, "%-16s %-16s %5u %8u %8u", e.type, e.name,
+               (unsigned)e.count, (unsigned)e.heapBytes,
+               (unsigned)e.staticBytes);
+      heap += e.heapBytes;
+      wrapper += e.staticBytes;
+    }
+    ESP_LOGI(tag, "%-16s %-16s %5s %8u %8u", "total", "", "", (unsigned)heap,
+             (unsigned)wrapper);
+  }
+
+private:
+  static constexpr int MaxBudgets = 8;
+  struct Budget {
+    const char *type;
+    size_t bytes;
+  };
+  struct State {
+    portMUX_TYPE mux;
+    Entry entries[FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES];
+    int count;
+    Budget budgets[MaxBudgets];
+    int budgetCount;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static State &state() {
+    static State s = {portMUX_INITIALIZER_UNLOCKED, {}, 0, {}, 0};
+    return s;
+  }
+  static Entry *find(const char *type, const char *name, bool create) {
+    State &s = state();
+    if (name == NULL)
+      name = "";
+    for (int i = 0; i < s.count; ++i) {
+      Entry &e = s.entries[i];
+      if ((e.type == type || strcmp(e.type, type) == 0) &&
+          (e.name == name || strcmp(e.name, name) == 0))
+        return &e;
+    }
+    if (!create || s.count >= FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES)
+      return NULL;
+    Entry &e = s.entries[s.count++];
+    e.type = type;
+    e.name = name;
+    e.count = 0;
+    e.heapBytes = 0;
+    e.staticBytes = 0;
+    return &e;
+  }
+#else
+  static void add(const char *, const char *, size_t, size_t) {}
+  static void remove(const char *, const char *, size_t, size_t) {}
+  static bool setBudget(const char *, size_t) { return false; }
+  static size_t total(const char * = NULL) { return 0; }
+  static bool checkBudgets() { return true; }
+  static int get(Entry *, int) { return 0; }
+  static void print() {}
+#endif
+
+public:
+  /**
+   * @brief タスク1つ分のヒープのバイト数 (TCB とスタック)
+   */
+  static size_t taskBytes(size_t usStackDepth) {
+    return sizeof(StaticTask_t) + FREERTOSPP_STACK_BYTES(usStackDepth);
+  }
+  /**
+   * @brief キュー1つ分のヒープのバイト数 (制御領域と要素の領域)
+   */
+  static size_t queueBytes(size_t uxLength, size_t uxItemSize) {
+    return sizeof(StaticQueue_t) + uxLength * uxItemSize;
+  }
+  /**
+   * @brief セマフォ1つ分のヒープのバイト数
+   */
+  static size_t semaphoreBytes() { return sizeof(StaticSemaphore_t); }
+};
+
+} // namespace FreeRTOSpp
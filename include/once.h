@@ -0,0 +1,141 @@
+/**
+ * @brief One-time initialisation without a mutex on the fast path
+ *
+ * @file once.h
+ */
+#pragma once
+
+#include "atomic_wait.h"
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief callOnce() で使う，一度だけの実行を管理するフラグ
+ *
+ * 初期化後の確認は acquire の読み込み1回だけ．初期化中に呼んだタスクは
+ * AtomicWait で眠って待つ．カーネルオブジェクトは生成しない．
+ * コンストラクタは constexpr なので，グローバル変数は定数初期化される．
+ */
+class OnceFlag {
+public:
+  constexpr OnceFlag() : state(Idle) {}
+  OnceFlag(const OnceFlag &) = delete;
+  OnceFlag &operator=(const OnceFlag &) = delete;
+
+  bool isDone() const { return state.load(std::memory_order_acquire) == Done; }
+
+private:
+  template <typename F> friend void callOnce(OnceFlag &flag, F &&func);
+  enum State : uint8_t { Idle, Running, Done };
+
+  std::atomic<uint8_t> state;
+
+  /**
+   * @brief 実行権を取る．取れなければ完了か中断まで眠る．
+   *
+   * @return true 実行権を取った
+   * @return false 他のタスクが完了させた
+   */
+  bool acquire() {
+    while (1) {
+      uint8_t expected = Idle;
+      if (state.compare_exchange_strong(expected, Running,
+                                        std::memory_order_acquire))
+        return true;
+      if (expected == Done)
+        return false;
+      atomicWait(state, uint8_t(Running));
+    }
+  }
+  /**
+   * @brief 状態を変えて待っているタスクをすべて起こす
+   *
+   * @param to Done なら完了，Idle なら中断 (待っていたタスクが再度試みる)
+   */
+  void release(State to) {
+    state.store(to, std::memory_order_release);
+    atomicNotifyAll(state);
+  }
+};
+
+/**
+ * @brief func を一度だけ実行する関数
+ *
+ * 完了後の呼び出しは何もせずに戻る．実行中に他のタスクから呼ばれたら，
+ * 完了するまで待つ．func が例外を投げたときは未実行に戻る．
+ */
+template <typename F> void callOnce(OnceFlag &flag, F &&func) {
+  if (flag.isDone())
+    return;
+  if (!flag.acquire())
+    return;
+#ifdef __cpp_exceptions
+  try {
+    func();
+  } catch (...) {
+    flag.release(OnceFlag::Idle);
+    throw;
+  }
+#else
+  func();
+#endif
+  flag.release(OnceFlag::Done);
+}
+
+/**
+ * @brief 初めて使われたときに構築されるオブジェクト
+ *
+ * コンストラクタは constexpr なので，グローバル変数にしても起動時には
+ * 何も構築されない．構築後の get() は acquire の読み込み1回だけ．
+ *
+ * @tparam T 構築する型
+ */
+template <typename T> class Lazy {
+public:
+  /**
+   * @brief T のデフォルトコンストラクタで構築する
+   */
+  constexpr Lazy() : factory(nullptr) {}
+  /**
+   * @brief factory の戻り値で構築する
+   */
+  constexpr Lazy(T (*factory)()) : factory(factory) {}
+  ~Lazy() {
+    if (flag.isDone())
+      storage.value.~T();
+  }
+  Lazy(const Lazy &) = delete;
+  Lazy &operator=(const Lazy &) = delete;
+
+  T &get() {
+    callOnce(flag, [this]() {
+      if (factory != nullptr)
+        new (&storage.value) T(factory());
+      else
+        new (&storage.value) T();
+    });
+    return storage.value;
+  }
+  T &operator*() { return get(); }
+  T *operator->() { return &get(); }
+  bool isInitialized() const { return flag.isDone(); }
+
+private:
+  union Storage {
+    char dummy;
+    T value;
+    constexpr Storage() : dummy() {}
+    ~Storage() {}
+  };
+
+  OnceFlag flag;
+  T (*factory)();
+  Storage storage;
+};
+
+} // namespace FreeRTOSpp
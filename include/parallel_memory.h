@@ -0,0 +1,428 @@
+/**
+ * @brief Bulk memory kernels split between the calling core and a worker
+ *
+ * @file parallel_memory.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "esp_timer.h"
+
+#ifdef ESP_PLATFORM
+#include "rom/crc.h"
+#endif
+
+#include <cstdint>
+#include <cstring>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 1つのコアで動く大きなメモリ領域の処理
+ * 4 バイト境界にそろう部分はワード単位で，8 ワードずつ展開して処理する．
+ */
+class MemoryKernels {
+public:
+  static void copy(void *dst, const void *src, size_t n) {
+    uint8_t *d = static_cast<uint8_t *>(dst);
+    const uint8_t *s = static_cast<const uint8_t *>(src);
+    if (((uintptr_t(d) ^ uintptr_t(s)) & 3) != 0) {
+      memcpy(d, s, n);
+      return;
+    }
+    for (; n > 0 && (uintptr_t(d) & 3) != 0; --n)
+      *d++ = *s++;
+    uint32_t *dw = reinterpret_cast<uint32_t *>(d);
+    const uint32_t *sw = reinterpret_cast<const uint32_t *>(s);
+    for (; n >= 32; n -= 32, dw += 8, sw += 8) {
+      const uint32_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+      const uint32_t f = sw[4], g = sw[5], h = sw[6], i = sw[7];
+      dw[0] = a, dw[1] = b, dw[2] = c, dw[3] = e;
+      dw[4] = f, dw[5] = g, dw[6] = h, dw[7] = i;
+    }
+    for (; n >= 4; n -= 4)
+      *dw++ = *sw++;
+    d = reinterpret_cast<uint8_t *>(dw);
+    s = reinterpret_cast<const uint8_t *>(sw);
+    while (n--)
+      *d++ = *s++;
+  }
+  static void fill(void *dst, uint8_t value, size_t n) {
+    uint8_t *d = static_cast<uint8_t *>(dst);
+    for (; n > 0 && (uintptr_t(d) & 3) != 0; --n)
+      *d++ = value;
+    const uint32_t v = value * 0x01010101u;
+    uint32_t *dw = reinterpret_cast<uint32_t *>(d);
+    for (; n >= 32; n -= 32, dw += 8) {
+      dw[0] = v, dw[1] = v, dw[2] = v, dw[3] = v;
+      dw[4] = v, dw[5] = v, dw[6] = v, dw[7] = v;
+    }
+    for (; n >= 4; n -= 4)
+      *dw++ = v;
+    d = reinterpret_cast<uint8_t *>(dw);
+    while (n--)
+      *d++ = value;
+  }
+  /**
+   * @brief memcmp() と同じ符号を返す比較
+   */
+  static int compare(const void *lhs, const void *rhs, size_t n) {
+    const uint8_t *a = static_cast<const uint8_t *>(lhs);
+    const uint8_t *b = static_cast<const uint8_t *>(rhs);
+    if (((uintptr_t(a) ^ uintptr_t(b)) & 3) == 0) {
+      for (; n > 0 && (uintptr_t(a) & 3) != 0; --n, ++a, ++b)
+        if (*a != *b)
+          return *a < *b ? -1 : 1;
+      const uint32_t *aw = reinterpret_cast<const uint32_t *>(a);
+      const uint32_t *bw = reinterpret_cast<const uint32_t *>(b);
+      for (; n >= 32; n -= 32, aw += 8, bw += 8)
+        if (((aw[0] ^ bw[0]) | (aw[1] ^ bw[1]) | (aw[2] ^ bw[2]) |
+             (aw[3] ^ bw[3]) | (aw[4] ^ bw[4]) | (aw[5] ^ bw[5]) |
+             (aw[6] ^ bw[6]) | (aw[7] ^ bw[7])) != 0)
+          break;
+      a = reinterpret_cast<const uint8_t *>(aw);
+      b = reinterpret_cast<const uint8_t *>(bw);
+    }
+    const int res = memcmp(a, b, n);
+    return res < 0 ? -1 : res > 0 ? 1 : 0;
+  }
+  /**
+   * @brief CRC-32 (zlib の crc32() と同じ値)
+   *
+   * @param crc 前の部分の CRC．初めは 0
+   */
+  static uint32_t crc32(uint32_t crc, const void *data, size_t n) {
+#ifdef ESP_PLATFORM
+    /* ROM のテーブル実装を使う．入出力の反転は関数の中で行われる */
+    return crc32_le(crc, static_cast<const uint8_t *>(data), n);
+#else
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+        0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    while (n--) {
+      crc ^= *p++;
+      crc = (crc >> 4) ^ table[crc & 15];
+      crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+#endif
+  }
+  /**
+   * @brief Adler-32 (zlib の adler32() と同じ値)
+   *
+   * @param adler 前の部分の値．初めは 1
+   */
+  static uint32_t adler32(uint32_t adler, const void *data, size_t n) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (n > 0) {
+      /* b が 32 ビットを超えない最大の区切り */
+      size_t k = n < 5552 ? n : 5552;
+      n -= k;
+      for (; k >= 8; k -= 8, p += 8) {
+        a += p[0], b += a, a += p[1], b += a, a += p[2], b += a;
+        a += p[3], b += a, a += p[4], b += a, a += p[5], b += a;
+        a += p[6], b += a, a += p[7], b += a;
+      }
+      while (k--)
+        a += *p++, b += a;
+      a %= AdlerBase;
+      b %= AdlerBase;
+    }
+    return a | (b << 16);
+  }
+  /**
+   * @brief 続けて並んだ2つの領域の CRC-32 から全体の CRC-32 を求める
+   *
+   * @param len2 後ろの領域の長さ
+   */
+  static uint32_t crc32Combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    if (len2 == 0)
+      return crc1;
+    uint32_t even[32], odd[32];
+    /* 1 ビットのゼロを送る演算子 */
+    odd[0] = 0xedb88320;
+    for (int i = 1; i < 32; ++i)
+      odd[i] = 1u << (i - 1);
+    square(even, odd); // 2 ビット
+    square(odd, even); // 4 ビット
+    do {
+      square(even, odd);
+      if (len2 & 1)
+        crc1 = times(even, crc1);
+      len2 >>= 1;
+      if (len2 == 0)
+        break;
+      square(odd, even);
+      if (len2 & 1)
+        crc1 = times(odd, crc1);
+      len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+  }
+  /**
+   * @brief 続けて並んだ2つの領域の Adler-32 から全体の Adler-32 を求める
+   */
+  static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2,
+                                 size_t len2) {
+    const uint32_t rem = len2 % AdlerBase;
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (rem * sum1) % AdlerBase;
+    sum1 += (adler2 & 0xffff) + AdlerBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + AdlerBase - rem;
+    if (sum1 >= AdlerBase)
+      sum1 -= AdlerBase;
+    if (sum1 >= AdlerBase)
+      sum1 -= AdlerBase;
+    if (sum2 >= 2 * AdlerBase)
+      sum2 -= 2 * AdlerBase;
+    if (sum2 >= AdlerBase)
+      sum2 -= AdlerBase;
+    return sum1 | (sum2 << 16);
+  }
+
+private:
+  static constexpr uint32_t AdlerBase = 65521;
+
+  static uint32_t times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, ++mat)
+      if (vec & 1)
+        sum ^= *mat;
+    return sum;
+  }
+  static void square(uint32_t *sq, const uint32_t *mat) {
+    for (int i = 0; i < 32; ++i)
+      sq[i] = times(mat, mat[i]);
+  }
+};
+
+/**
+ * @brief 大きなメモリ領域の処理を呼び出したタスクと他のコアの
+ * ワーカタスクで半分ずつ行うクラス
+ *
+ * 閾値より小さい領域や，ワーカが他の呼び出しで使用中のときは，
+ * 呼び出したタスクだけで処理する．
+ */
+class ParallelMemory {
+public:
+  /**
+   * @param threshold これ以上の大きさのときに2つのコアで処理する [byte]
+   */
+  ParallelMemory(size_t threshold = 16 * 1024) : threshold(threshold) {}
+  /**
+   * @brief 各コアにワーカタスクを生成する関数
+   */
+  bool start(UBaseType_t uxPriority = configMAX_PRIORITIES - 2,
+             const uint16_t usStackDepth = 2048) {
+    for (int i = 0; i < portNUM_PROCESSORS; ++i)
+      if (!workers[i].createTask("ParallelMemory", uxPriority, usStackDepth, i))
+        return false;
+    return true;
+  }
+  void setThreshold(size_t threshold) { this->threshold = threshold; }
+
+  void copy(void *dst, const void *src, size_t n) {
+    Job job = {OpCopy, static_cast<uint8_t *>(dst),
+               static_cast<const uint8_t *>(src), 0, 0, 0};
+    run(job, n);
+  }
+  void fill(void *dst, uint8_t value, size_t n) {
+    Job job = {OpFill, static_cast<uint8_t *>(dst), NULL, 0, value, 0};
+    run(job, n);
+  }
+  int compare(const void *lhs, const void *rhs, size_t n) {
+    Job job = {OpCompare, (uint8_t *)lhs, static_cast<const uint8_t *>(rhs),
+               0, 0, 0};
+    Job tail;
+    if (!run(job, n, &tail))
+      return int32_t(job.result);
+    return job.result != 0 ? int32_t(job.result) : int32_t(tail.result);
+  }
+  /**
+   * @brief CRC-32 (zlib の crc32() と同じ値)
+   */
+  uint32_t crc32(const void *data, size_t n, uint32_t crc = 0) {
+    Job job = {OpCrc32, NULL, static_cast<const uint8_t *>(data), 0, 0, crc};
+    Job tail;
+    if (!run(job, n, &tail))
+      return job.result;
+    return MemoryKernels::crc32Combine(job.result, tail.result, tail.n);
+  }
+  /**
+   * @brief Adler-32 (zlib の adler32() と同じ値)
+   */
+  uint32_t adler32(const void *data, size_t n, uint32_t adler = 1) {
+    Job job = {OpAdler32, NULL, static_cast<const uint8_t *>(data), 0, 0,
+               adler};
+    Job tail;
+    if (!run(job, n, &tail))
+      return job.result;
+    return MemoryKernels::adler32Combine(job.result, tail.result, tail.n);
+  }
+  /**
+   * @brief 2つのコアで処理した回数
+   */
+  uint32_t getParallelCount() const { return parallel; }
+
+private:
+  enum Op { OpCopy, OpFill, OpCompare, OpCrc32, OpAdler32 };
+  struct Job {
+    Op op;
+    uint8_t *dst;
+    const uint8_t *src;
+    size_t n;
+    uint8_t value;
+    uint32_t result; //< 比較の結果，または CRC などの初期値と結果
+  };
+
+  class Worker : public TaskBase {
+  public:
+    Mutex lock;     //< ワーカを使用中
+    Semaphore done; //< 処理の完了
+    Job *job = NULL;
+
+    void submit(Job &j) {
+      job = &j;
+      xTaskNotifyGive(pxCreatedTask);
+    }
+
+  protected:
+    virtual void task() override {
+      while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        execute(*job);
+        done.give();
+      }
+    }
+  };
+
+  size_t threshold;
+  uint32_t parallel = 0;
+  Worker workers[portNUM_PROCESSORS];
+
+  static void execute(Job &j) {
+    switch (j.op) {
+    case OpCopy:
+      MemoryKernels::copy(j.dst, j.src, j.n);
+      break;
+    case OpFill:
+      MemoryKernels::fill(j.dst, j.value, j.n);
+      break;
+    case OpCompare:
+      j.result = MemoryKernels::compare(j.dst, j.src, j.n);
+      break;
+    case OpCrc32:
+      j.result = MemoryKernels::crc32(j.result, j.src, j.n);
+      break;
+    case OpAdler32:
+      j.result = MemoryKernels::adler32(j.result, j.src, j.n);
+      break;
+    }
+  }
+  /**
+   * @brief 後ろ半分をワーカに渡し，前半分を自分で処理する
+   *
+   * @param tail 後ろ半分の処理の格納先．NULL ならここで捨てる
+   * @return true 2つのコアで処理した
+   */
+  bool run(Job &job, size_t n, Job *tail = NULL) {
+    Job local;
+    Job &t = tail != NULL ? *tail : local;
+    Worker *w = acquire(n);
+    if (w == NULL) {
+      job.n = n;
+      execute(job);
+      return false;
+    }
+    /* 後ろ半分もキャッシュラインにそろうよう 32 バイト単位で分ける */
+    const size_t half = (n / 2) & ~size_t(31);
+    t = job;
+    t.n = n - half;
+    t.dst = job.dst != NULL ? job.dst + half : NULL;
+    t.src = job.src != NULL ? job.src + half : NULL;
+    if (job.op == OpCrc32)
+      t.result = 0;
+    else if (job.op == OpAdler32)
+      t.result = 1;
+    job.n = half;
+    w->submit(t);
+    execute(job);
+    w->done.take();
+    w->lock.give();
+    ++parallel;
+    return true;
+  }
+  Worker *acquire(size_t n) {
+    if (n < threshold || n < 64)
+      return NULL;
+    Worker &w = workers[(xPortGetCoreID() + 1) % portNUM_PROCESSORS];
+    if (w.getTaskHandle() == NULL || !w.lock.take(0))
+      return NULL;
+    return &w;
+  }
+};
+
+/**
+ * @brief ParallelMemory の処理速度 [kB/ms = MB/s]
+ */
+struct ParallelMemoryThroughput {
+  uint32_t copy;
+  uint32_t fill;
+  uint32_t compare;
+  uint32_t crc32;
+  uint32_t adler32;
+};
+
+/**
+ * @brief ParallelMemory の処理速度を測る関数
+ * 閾値を 0 にすれば2つのコアで，大きくすれば1つのコアでの速度になる．
+ *
+ * @param a, b 大きさ n の作業領域
+ */
+inline ParallelMemoryThroughput benchmarkParallelMemory(ParallelMemory &pm,
+                                                        uint8_t *a, uint8_t *b,
+                                                        size_t n) {
+  struct Timer {
+    int64_t start = esp_timer_get_time();
+    uint32_t rate(size_t n) const {
+      const int64_t us = esp_timer_get_time() - start;
+      return us > 0 ? n / us : 0;
+    }
+  };
+  ParallelMemoryThroughput r;
+  {
+    Timer t;
+    pm.fill(a, 0x5A, n);
+    r.fill = t.rate(n);
+  }
+  {
+    Timer t;
+    pm.copy(b, a, n);
+    r.copy = t.rate(n);
+  }
+  {
+    Timer t;
+    volatile int res = pm.compare(a, b, n);
+    (void)res;
+    r.compare = t.rate(n);
+  }
+  {
+    Timer t;
+    volatile uint32_t res = pm.crc32(a, n);
+    (void)res;
+    r.crc32 = t.rate(n);
+  }
+  {
+    Timer t;
+    volatile uint32_t res = pm.adler32(a, n);
+    (void)res;
+    r.adler32 = t.rate(n);
+  }
+  return r;
+}
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,173 @@
+/**
+ * @brief Shared-nothing per-core runtime with cross-core message passing
+ *
+ * @file per_core_runtime.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "spsc_channel.h"
+
+#include <atomic>
+#include <functional>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief コアごとにデータの担当分 (Shard) を持つタスクを動かすランタイム
+ *
+ * 各コアのワーカタスクは自分の Shard だけを操作し，他のコアとは
+ * コアの組ごとの SpscChannel を介したメッセージでのみやりとりする．
+ * 相手を起こす通知 (doorbell) は受信側が眠っているときだけ，
+ * 1回の処理ループにつき宛先ごとに1回だけ送る．
+ *
+ * @tparam Shard 各コアが所有するデータの型
+ * @tparam Message メッセージの型
+ * @tparam Capacity 各チャネルの容量，2 のべき乗
+ */
+template <typename Shard, typename Message, size_t Capacity = 32>
+class PerCoreRuntime {
+public:
+  /**
+   * @brief メッセージを処理する関数の型
+   * 引数は受信したコアの Shard，メッセージ，送信元コア番号
+   * (post() で送られたものは portNUM_PROCESSORS)
+   */
+  typedef std::function<void(Shard &, const Message &, UBaseType_t)> Handler;
+
+  PerCoreRuntime(Handler handler) : handler(handler) {
+    for (int i = 0; i < portNUM_PROCESSORS; ++i) {
+      workers[i].runtime = this;
+      workers[i].core = i;
+    }
+    MemoryAccounting::add("PerCoreRuntime", NULL, 0, sizeof(*this));
+  }
+  ~PerCoreRuntime() {
+    MemoryAccounting::remove("PerCoreRuntime", NULL, 0, sizeof(*this));
+  }
+  /**
+   * @brief 各コアにワーカタスクを生成する関数
+   */
+  bool start(UBaseType_t uxPriority = 1, const uint16_t usStackDepth = 4096) {
+    static const char *const names[] = {"PerCore0", "PerCore1", "PerCore2",
+                                        "PerCore3"};
+    static_assert(portNUM_PROCESSORS <= 4, "too many cores");
+    for (int i = 0; i < portNUM_PROCESSORS; ++i)
+      if (!workers[i].createTask(names[i], uxPriority, usStackDepth, i))
+        return false;
+    return true;
+  }
+  /**
+   * @brief ワーカタスクから他のコアへメッセージを送る関数
+   * ワーカタスク (Handler の中) からのみ呼ぶこと．
+   * 通知は現在の処理ループの終わりにまとめて送られる．
+   *
+   * @param dst 宛先のコア番号
+   * @return true 成功
+   * @return false チャネルが満杯
+   */
+  bool send(UBaseType_t dst, const Message &msg) {
+    const UBaseType_t src = xPortGetCoreID();
+    if (!channels[src][dst].push(msg))
+      return false;
+    workers[src].pending |= 1u << dst;
+    return true;
+  }
+  /**
+   * @brief ワーカ以外のタスクからメッセージを送る関数
+   * 複数の送信元を受け付けるために送信側はスピンロックをとるので，
+   * 頻繁に呼ぶ経路では使わないこと．
+   *
+   * @param dst 宛先のコア番号
+   * @return true 成功
+   * @return false 受信箱が満杯
+   */
+  bool post(UBaseType_t dst, const Message &msg) {
+    Worker &w = workers[dst];
+    portENTER_CRITICAL(&w.inbox_mux);
+    const bool res = w.inbox.push(msg);
+    portEXIT_CRITICAL(&w.inbox_mux);
+    if (res)
+      w.ring();
+    return res;
+  }
+  /**
+   * @brief コアの Shard を取得する関数
+   * 他のコアの Shard に触れるのはワーカを開始する前だけにすること．
+   */
+  Shard &shard(UBaseType_t core) { return workers[core].shard; }
+
+private:
+  class Worker : public TaskBase {
+  public:
+    PerCoreRuntime *runtime = NULL;
+    UBaseType_t core = 0;
+    Shard shard;
+    uint32_t pending = 0; //< 通知を送るべき宛先のビット列 (自タスクのみ操作)
+    std::atomic<bool> sleeping{false};
+    SpscChannel<Message, Capacity> inbox;
+    portMUX_TYPE inbox_mux = portMUX_INITIALIZER_UNLOCKED;
+
+    /**
+     * @brief 眠っていれば起こす
+     */
+    void ring() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.load(std::memory_order_relaxed))
+        xTaskNotifyGive(pxCreatedTask);
+    }
+
+  protected:
+    virtual void task() override {
+      while (1) {
+        const bool received = runtime->drain(core);
+        runtime->flush(core);
+        if (received)
+          continue;
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (runtime->empty(core))
+          ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        sleeping.store(false, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  Handler handler;
+  Worker workers[portNUM_PROCESSORS];
+  /* channels[src][dst] は src のワーカが書き，dst のワーカが読む */
+  SpscChannel<Message, Capacity> channels[portNUM_PROCESSORS]
+                                         [portNUM_PROCESSORS];
+
+  bool drain(UBaseType_t dst) {
+    Worker &w = workers[dst];
+    bool received = false;
+    Message msg;
+    for (UBaseType_t src = 0; src < portNUM_PROCESSORS; ++src) {
+      while (channels[src][dst].pop(msg)) {
+        handler(w.shard, msg, src);
+        received = true;
+      }
+    }
+    while (w.inbox.pop(msg)) {
+      handler(w.shard, msg, portNUM_PROCESSORS);
+      received = true;
+    }
+    return received;
+  }
+  void flush(UBaseType_t src) {
+    Worker &w = workers[src];
+    for (UBaseType_t dst = 0; dst < portNUM_PROCESSORS; ++dst)
+      if (dst != src && (w.pending & (1u << dst)))
+        workers[dst].ring();
+    w.pending = 0;
+  }
+  bool empty(UBaseType_t dst) {
+    for (UBaseType_t src = 0; src < portNUM_PROCESSORS; ++src)
+      if (!channels[src][dst].empty())
+        return false;
+    return workers[dst].inbox.empty();
+  }
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,159 @@
+/**
+ * @brief Sub-tick sleep combining vTaskDelay and a calibrated busy-wait
+ *
+ * @file precise_sleep.h
+ */
+#pragma once
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <cstdint>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief ティックより細かい精度で待つ関数群
+ *
+ * 待ち時間の大部分は vTaskDelay() で眠り，少し早めに起きて残りを
+ * 空回りで待つ．早起きする幅は，実際に起きた時刻の遅れの平均と
+ * ばらつきから自動で調整される (平均 + 4 * 平均偏差)．
+ */
+class PreciseSleep {
+public:
+  /**
+   * @brief 統計
+   */
+  struct Stats {
+    uint32_t count;     //< 呼ばれた回数
+    uint32_t marginUs;  //< 現在の早起きの幅 [us]
+    uint64_t sleptUs;   //< 眠っていた時間の合計 [us]
+    uint64_t spunUs;    //< 空回りしていた時間の合計 [us]
+    uint32_t lateUs;    //< 目標時刻からの遅れの合計 [us]
+    uint32_t maxLateUs; //< 目標時刻からの遅れの最大 [us]
+  };
+
+  /**
+   * @brief 指定した時間だけ待つ関数
+   *
+   * @param us 待ち時間 [us]
+   */
+  static void sleep(uint32_t us) { sleepUntil(esp_timer_get_time() + us); }
+  /**
+   * @brief esp_timer_get_time() の時刻まで待つ関数
+   */
+  static void sleepUntil(int64_t target) {
+    State &s = state();
+    const uint32_t tickUs = 1000000 / configTICK_RATE_HZ;
+    int64_t now = esp_timer_get_time();
+    const int64_t begin = now;
+    const int64_t remaining = target - now;
+    const uint32_t margin = s.mean + 4 * s.dev;
+    /* vTaskDelay(n) は n ティック目の境界で起きるので，最大 n ティック眠る */
+    if (remaining > int64_t(margin) + tickUs) {
+      const TickType_t n = (remaining - margin) / tickUs;
+      vTaskDelay(n);
+      now = esp_timer_get_time();
+      /* 予定した最大の睡眠時間からの遅れで早起きの幅を学習する */
+      const int64_t over = (now - begin) - int64_t(n) * tickUs;
+      calibrate(over > 0 ? over : 0);
+    }
+    const int64_t slept = now - begin;
+    spin(target);
+    now = esp_timer_get_time();
+    const uint32_t late = now > target ? now - target : 0;
+    portENTER_CRITICAL(&s.mux);
+    ++s.count;
+    s.sleptUs += slept;
+    s.spunUs += now - begin - slept;
+    s.lateUs += late;
+    if (late > s.maxLateUs)
+      s.maxLateUs = late;
+    portEXIT_CRITICAL(&s.mux);
+  }
+  static Stats getStats() {
+    State &s = state();
+    Stats st;
+    portENTER_CRITICAL(&s.mux);
+    st.count = s.count;
+    st.marginUs = s.mean + 4 * s.dev;
+    st.sleptUs = s.sleptUs;
+    st.spunUs = s.spunUs;
+    st.lateUs = s.lateUs;
+    st.maxLateUs = s.maxLateUs;
+    portEXIT_CRITICAL(&s.mux);
+    return st;
+  }
+  /**
+   * @brief 統計を消す関数．学習した早起きの幅は残す．
+   */
+  static void resetStats() {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    s.count = 0;
+    s.sleptUs = s.spunUs = 0;
+    s.lateUs = s.maxLateUs = 0;
+    portEXIT_CRITICAL(&s.mux);
+  }
+
+private:
+  struct State {
+    portMUX_TYPE mux;
+    uint32_t mean; //< 起床の遅れの平均 [us]
+    uint32_t dev;  //< 起床の遅れの平均偏差 [us]
+    uint32_t count;
+    uint64_t sleptUs;
+    uint64_t spunUs;
+    uint32_t lateUs;
+    uint32_t maxLateUs;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static State &state() {
+    static State s = {portMUX_INITIALIZER_UNLOCKED, 50, 25, 0, 0, 0, 0, 0};
+    return s;
+  }
+  /**
+   * @brief 遅れの平均を 1/8，平均偏差を 1/4 の重みで更新する
+   */
+  static void calibrate(uint32_t over) {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    const int32_t err = int32_t(over) - int32_t(s.mean);
+    s.mean = int32_t(s.mean) + err / 8;
+    s.dev = int32_t(s.dev) + ((err < 0 ? -err : err) - int32_t(s.dev)) / 4;
+    portEXIT_CRITICAL(&s.mux);
+  }
+  /**
+   * @brief target まで空回りする．サイクルカウンタはコアごとにあり，
+   * 空回りの途中で別のコアに移ると狂うので，全コア共通の esp_timer で測る．
+   */
+  static void spin(int64_t target) {
+    while (esp_timer_get_time() < target)
+      ;
+  }
+};
+
+/**
+ * @brief 指定した時間だけ精度よく待つ関数
+ *
+ * @param us 待ち時間 [us]
+ */
+inline void preciseSleep(uint32_t us) { PreciseSleep::sleep(us); }
+
+/**
+ * @brief preciseSleep() の精度と CPU 使用を測る関数
+ *
+ * @param us 1回の待ち時間 [us]
+ * @param n 回数
+ * @return 測定中の統計．spunUs / (sleptUs + spunUs) が空回りの割合
+ */
+inline PreciseSleep::Stats benchmarkPreciseSleep(uint32_t us = 2500,
+                                                 uint32_t n = 100) {
+  PreciseSleep::resetStats();
+  for (uint32_t i = 0; i < n; ++i)
+    PreciseSleep::sleep(us);
+  return PreciseSleep::getStats();
+}
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,212 @@
+/**
+ * @brief Queue with a bounded lane per priority level
+ *
+ * @file priority_queue.h
+ */
+#pragma once
+
+#include "deadline.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "memory_accounting.h"
+#include "queue_stats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 優先度ごとに別の列 (レーン) をもつキュー
+ *
+ * 受信は空でない最も優先度の高いレーンから取り出すので，急ぎの要素が
+ * 溜まった大量の要素の後ろで待たされない．同じレーンの中は FIFO．
+ * 送信はブロックせず，レーンが満杯なら失敗する．割り込みからも送れる．
+ *
+ * @tparam T 要素の型．スピンロックの中で写すので trivially copyable に限る
+ * @tparam Levels 優先度の数．Levels - 1 が最も高い
+ * @tparam N 各レーンの容量
+ */
+template <typename T, size_t Levels, size_t N> class PriorityQueue {
+  static_assert(Levels > 0 && N > 0, "Levels and N must be positive");
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T must be trivially copyable");
+
+public:
+  /**
+   * @brief レーンごとの統計
+   */
+  struct LaneStats {
+    UBaseType_t depth;    //< 現在の要素数
+    UBaseType_t maxDepth; //< 要素数の最大
+    uint32_t sent;        //< 送信した数
+    uint32_t received;    //< 受信した数
+    uint32_t dropped;     //< 満杯で送れなかった数
+  };
+
+  PriorityQueue() {
+    xCount = xSemaphoreCreateCounting(Levels * N, 0);
+    if (xCount == NULL) {
+      ESP_LOGE(tag, "xSemaphoreCreateCounting() failed");
+    }
+    MemoryAccounting::add("PriorityQueue", NULL,
+                          MemoryAccounting::semaphoreBytes(), sizeof(*this));
+  }
+  ~PriorityQueue() {
+    MemoryAccounting::remove("PriorityQueue", NULL,
+                             MemoryAccounting::semaphoreBytes(), sizeof(*this));
+    vSemaphoreDelete(xCount);
+  }
+  PriorityQueue(const PriorityQueue &) = delete;
+  PriorityQueue &operator=(const PriorityQueue &) = delete;
+
+  /**
+   * @brief 要素を送る関数
+   *
+   * @param uxLevel 優先度．Levels 以上なら最も高いものとして扱う
+   * @return false レーンが満杯
+   */
+  bool send(const T &item, UBaseType_t uxLevel) {
+    Lane &lane = lanes[clamp(uxLevel)];
+    portENTER_CRITICAL(&mux);
+    const bool res = lane.push(item);
+    portEXIT_CRITICAL(&mux);
+#if FREERTOSPP_QUEUE_STATS
+    if (res)
+      lane.queueStats.sent();
+    else
+      lane.queueStats.full();
+#endif
+    if (res)
+      xSemaphoreGive(xCount);
+    return res;
+  }
+  /**
+   * @brief 割り込みから要素を送る関数
+   *
+   * @param pxHigherPriorityTaskWoken 受信側が起きて切り替えが必要なら pdTRUE
+   * になる．NULL でもよい
+   */
+  bool sendFromISR(const T &item, UBaseType_t uxLevel,
+                   BaseType_t *pxHigherPriorityTaskWoken = NULL) {
+    Lane &lane = lanes[clamp(uxLevel)];
+    portENTER_CRITICAL_ISR(&mux);
+    const bool res = lane.push(item);
+    portEXIT_CRITICAL_ISR(&mux);
+#if FREERTOSPP_QUEUE_STATS
+    if (res)
+      lane.queueStats.sentFromISR();
+    else
+      lane.queueStats.full();
+#endif
+    if (res)
+      xSemaphoreGiveFromISR(xCount, pxHigherPriorityTaskWoken);
+    return res;
+  }
+  /**
+   * @brief 最も優先度の高い要素を受け取る関数
+   *
+   * @param puxLevel 受け取った要素の優先度の格納先．NULL でもよい
+   * @return false 時間切れ
+   */
+  bool receive(T &item, TickType_t xBlockTime = portMAX_DELAY,
+               UBaseType_t *puxLevel = NULL) {
+    if (pdTRUE != xSemaphoreTake(xCount, xBlockTime))
+      return false;
+    portENTER_CRITICAL(&mux);
+    size_t i = Levels;
+    while (i-- > 0)
+      if (lanes[i].pop(item))
+        break;
+    portEXIT_CRITICAL(&mux);
+#if FREERTOSPP_QUEUE_STATS
+    lanes[i].queueStats.received();
+#endif
+    if (puxLevel != NULL)
+      *puxLevel = i;
+    return true;
+  }
+  bool receive(T &item, const Deadline &deadline,
+               UBaseType_t *puxLevel = NULL) {
+    return receive(item, deadline.remaining(), puxLevel);
+  }
+  /**
+   * @brief 全レーンの要素数の合計
+   */
+  UBaseType_t size() const { return uxSemaphoreGetCount(xCount); }
+  static constexpr size_t levels() { return Levels; }
+  static constexpr size_t capacity() { return N; }
+  LaneStats getLaneStats(UBaseType_t uxLevel) {
+    portENTER_CRITICAL(&mux);
+    const LaneStats s = lanes[clamp(uxLevel)].stats;
+    portEXIT_CRITICAL(&mux);
+    return s;
+  }
+  /**
+   * @brief レーンの統計 (FREERTOSPP_QUEUE_STATS) に表示する名前を設定する関数
+   */
+  void setName(UBaseType_t uxLevel, const char *name) {
+#if FREERTOSPP_QUEUE_STATS
+    lanes[clamp(uxLevel)].queueStats.setName(name);
+#else
+    (void)uxLevel;
+    (void)name;
+#endif
+  }
+  void print() {
+    for (size_t i = Levels; i-- > 0;) {
+      const LaneStats s = getLaneStats(i);
+      ESP_LOGI(tag,
+               "lane %u: depth %u/%u max %u, sent %u received %u dropped %u",
+               (unsigned)i, (unsigned)s.depth, (unsigned)N,
+               (unsigned)s.maxDepth, (unsigned)s.sent, (unsigned)s.received,
+               (unsigned)s.dropped);
+    }
+  }
+
+private:
+  const char *tag = "PriorityQueue";
+
+  struct Lane {
+    T buffer[N];
+    size_t head = 0;
+    LaneStats stats = {};
+#if FREERTOSPP_QUEUE_STATS
+    /* 受信はレーンをまたぐので，レーンごとに数える．空は数えない */
+    QueueStats queueStats{N};
+#endif
+
+    bool push(const T &item) {
+      if (stats.depth == N) {
+        ++stats.dropped;
+        return false;
+      }
+      buffer[(head + stats.depth) % N] = item;
+      if (++stats.depth > stats.maxDepth)
+        stats.maxDepth = stats.depth;
+      ++stats.sent;
+      return true;
+    }
+    bool pop(T &item) {
+      if (stats.depth == 0)
+        return false;
+      item = buffer[head];
+      head = (head + 1) % N;
+      --stats.depth;
+      ++stats.received;
+      return true;
+    }
+  };
+
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  SemaphoreHandle_t xCount = NULL; //< 全レーンの要素数
+  Lane lanes[Levels];
+
+  static size_t clamp(UBaseType_t uxLevel) {
+    return uxLevel < Levels ? uxLevel : Levels - 1;
+  }
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,383 @@
+/**
+ * @brief Depth, occupancy and latency statistics for queues and channels
+ *
+ * @file queue_stats.h
+ *
+ * FREERTOSPP_QUEUE_STATS を 1 にして全体をビルドすると，Queue,
+ * PriorityQueue, CreditChannel, SpscChannel, TopicSubscriber が
+ * 要素数と滞留時間の統計をとるようになる．無効のときは統計のための
+ * メンバも処理も含まれない．
+ */
+#pragma once
+
+#ifndef FREERTOSPP_QUEUE_STATS
+#define FREERTOSPP_QUEUE_STATS 0
+#endif
+#ifndef FREERTOSPP_QUEUE_STATS_SAMPLES
+#define FREERTOSPP_QUEUE_STATS_SAMPLES 8
+#endif
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "histogram.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 1つのキューの統計
+ *
+ * 要素数の最大，時間で重みづけした要素数のヒストグラム，満杯と空に
+ * 当たった回数，要素が入ってから出るまでの時間を記録し，容量の目安を
+ * 出す．生存しているものはすべて登録され，getAll() で列挙できる．
+ *
+ * 滞留時間は，列に入っている要素のうち FREERTOSPP_QUEUE_STATS_SAMPLES
+ * 個までに入れた時刻を覚えて測る標本なので，深い列ではすべての要素は
+ * 測らない．統計の更新は実際の送受信の後に行うので，複数のタスクが
+ * 同時に送受信すると順序が入れ替わることがあり，値は近似になる．
+ */
+class QueueStats {
+public:
+  /**
+   * @brief 統計の値
+   */
+  struct Counters {
+    const char *name;      //< キューの名前
+    uint32_t capacity;     //< 容量
+    uint32_t depth;        //< 現在の要素数
+    uint32_t maxDepth;     //< 要素数の最大
+    uint32_t sent;         //< 入れた数
+    uint32_t received;     //< 出した数
+    uint32_t full;         //< 満杯で待ったか失敗した回数
+    uint32_t empty;        //< 空で待ったか失敗した回数
+    uint32_t depthP50;     //< 時間で重みづけした要素数の中央値
+    uint32_t depthP99;     //< 同じく 99 パーセンタイル
+    uint32_t latencyP50;   //< 滞留時間の中央値 [us]
+    uint32_t latencyP99;   //< 滞留時間の 99 パーセンタイル [us]
+    uint32_t latencyMax;   //< 滞留時間の最大 [us]
+    uint32_t recommended;  //< 容量の目安
+  };
+  /**
+   * @brief 時間で重みづけするときの単位 [us]．
+   * 1つのバケットが 2^32 単位 (約76時間) であふれる．
+   */
+  static constexpr uint32_t TimeUnitUs = 64;
+
+  explicit QueueStats(uint32_t capacity = 0)
+      : capacity(capacity), lastChange(esp_timer_get_time()) {
+    portENTER_CRITICAL(&registry().mux);
+    next = registry().head;
+    registry().head = this;
+    portEXIT_CRITICAL(&registry().mux);
+  }
+  ~QueueStats() {
+    portENTER_CRITICAL(&registry().mux);
+    for (QueueStats **p = &registry().head; *p != NULL; p = &(*p)->next) {
+      if (*p == this) {
+        *p = next;
+        break;
+      }
+    }
+    portEXIT_CRITICAL(&registry().mux);
+  }
+  QueueStats(const QueueStats &) = delete;
+  QueueStats &operator=(const QueueStats &) = delete;
+
+  void setName(const char *name) { this->name = name; }
+  /**
+   * @brief 生成後に容量が決まるときに設定する関数
+   */
+  void setCapacity(uint32_t capacity) { this->capacity = capacity; }
+
+  /**
+   * @brief 要素を末尾に入れた後に呼ぶ関数
+   */
+  void sent() {
+    portENTER_CRITICAL(&mux);
+    push(false);
+    portEXIT_CRITICAL(&mux);
+  }
+  void sentFromISR() {
+    portENTER_CRITICAL_ISR(&mux);
+    push(false);
+    portEXIT_CRITICAL_ISR(&mux);
+  }
+  /**
+   * @brief 要素を先頭に入れた後に呼ぶ関数
+   */
+  void sentToFront() {
+    portENTER_CRITICAL(&mux);
+    push(true);
+    portEXIT_CRITICAL(&mux);
+  }
+  /**
+   * @brief 要素を先頭から出した後に呼ぶ関数
+   *
+   * @param consumed false なら捨てたものとして滞留時間を記録しない
+   */
+  void received(bool consumed = true) {
+    portENTER_CRITICAL(&mux);
+    pop(consumed);
+    portEXIT_CRITICAL(&mux);
+  }
+  void receivedFromISR(bool consumed = true) {
+    portENTER_CRITICAL_ISR(&mux);
+    pop(consumed);
+    portEXIT_CRITICAL_ISR(&mux);
+  }
+  /**
+   * @brief 満杯で待つか失敗したときに呼ぶ関数
+   */
+  void full() { fullCount.fetch_add(1, std::memory_order_relaxed); }
+  /**
+   * @brief 空で待つか失敗したときに呼ぶ関数
+   */
+  void empty() { emptyCount.fetch_add(1, std::memory_order_relaxed); }
+
+  Counters get() {
+    Snapshot snap;
+    snapshot(snap);
+    return summarize(snap);
+  }
+  /**
+   * @brief 時間で重みづけした要素数のヒストグラムの写しを取得する関数
+   * 値の単位は TimeUnitUs
+   */
+  Histogram getOccupancy() {
+    portENTER_CRITICAL(&mux);
+    advance(esp_timer_get_time());
+    const Histogram h = occupancy;
+    portEXIT_CRITICAL(&mux);
+    return h;
+  }
+  /**
+   * @brief 滞留時間 [us] のヒストグラムの写しを取得する関数
+   */
+  Histogram getLatency() {
+    portENTER_CRITICAL(&mux);
+    const Histogram h = latency;
+    portEXIT_CRITICAL(&mux);
+    return h;
+  }
+  /**
+   * @brief 記録を消す関数．要素数は保つ
+   */
+  void reset() {
+    portENTER_CRITICAL(&mux);
+    occupancy.reset();
+    latency.reset();
+    lastChange = esp_timer_get_time();
+    maxDepth = depth > 0 ? depth : 0;
+    portEXIT_CRITICAL(&mux);
+    fullCount.store(0, std::memory_order_relaxed);
+    emptyCount.store(0, std::memory_order_relaxed);
+  }
+  /**
+   * @brief 容量の目安
+   *
+   * 満杯に当たっていれば容量の 1.5 倍を，そうでなければ要素数の最大に
+   * 25% の余裕を足したものを返す．
+   */
+  static uint32_t recommend(const Counters &c) {
+    if (c.full > 0)
+      return c.capacity + (c.capacity / 2 > 0 ? c.capacity / 2 : 1);
+    const uint32_t margin = c.maxDepth / 4 > 0 ? c.maxDepth / 4 : 1;
+    return c.maxDepth + margin < c.capacity ? c.maxDepth + margin : c.capacity;
+  }
+  /**
+   * @brief 生存しているキューの数
+   */
+  static int count() {
+    portENTER_CRITICAL(&registry().mux);
+    int n = 0;
+    for (QueueStats *s = registry().head; s != NULL; s = s->next)
+      ++n;
+    portEXIT_CRITICAL(&registry().mux);
+    return n;
+  }
+  /**
+   * @brief 生存しているすべてのキューの統計を取得する関数
+   *
+   * 登録簿のロックの中では1つずつ写すだけにし，百分位は外で求める．
+   * 途中でキューが生成や破棄されると，1つ抜けたり重なったりする．
+   *
+   * @return 取得した数
+   */
+  static int getAll(Counters *pxBuffer, int n) {
+    Snapshot snap;
+    int i = 0;
+    for (; i < n; ++i) {
+      portENTER_CRITICAL(&registry().mux);
+      QueueStats *s = registry().head;
+      for (int j = 0; j < i && s != NULL; ++j)
+        s = s->next;
+      if (s != NULL)
+        s->snapshot(snap);
+      portEXIT_CRITICAL(&registry().mux);
+      if (s == NULL)
+        break;
+      pxBuffer[i] = summarize(snap);
+    }
+    return i;
+  }
+  /**
+   * @brief 生存しているすべてのキューの統計を表示する関数
+   */
+  static void print() {
+    const char *tag = "QueueStats";
+    std::vector<Counters> c(count());
+    const int n = getAll(c.data(), c.size());
+    for (int i = 0; i < n; ++i)
+      ESP_LOGI(tag,
+               "%s: depth %u/%u max %u p50 %u p99 %u, sent %u full %u "
+               "empty %u, latency p50 %u p99 %u max %u [us], "
+               "recommended %u",
+               c[i].name, (unsigned)c[i].depth, (unsigned)c[i].capacity,
+               (unsigned)c[i].maxDepth, (unsigned)c[i].depthP50,
+               (unsigned)c[i].depthP99, (unsigned)c[i].sent,
+               (unsigned)c[i].full, (unsigned)c[i].empty,
+               (unsigned)c[i].latencyP50, (unsigned)c[i].latencyP99,
+               (unsigned)c[i].latencyMax, (unsigned)c[i].recommended);
+  }
+
+private:
+  struct Sample {
+    uint32_t position; //< 何番目に出る要素か
+    int64_t time;      //< 入れた時刻 [us]
+  };
+  /**
+   * @brief ロックの中で写す値．百分位はこれから外で求める
+   */
+  struct Snapshot {
+    const char *name;
+    uint32_t capacity;
+    uint32_t depth;
+    uint32_t maxDepth;
+    uint32_t sent;
+    uint32_t received;
+    uint32_t full;
+    uint32_t empty;
+    Histogram occupancy;
+    Histogram latency;
+  };
+
+  const char *name = "";
+  uint32_t capacity;
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  /* 先頭と末尾の位置．先頭に入れると head が戻る */
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  int32_t depth = 0; //< 送受信の記録が前後すると一時的に負になる
+  uint32_t maxDepth = 0;
+  uint32_t ulSent = 0;
+  uint32_t ulReceived = 0;
+  int64_t lastChange;
+  Histogram occupancy; //< 要素数，重みは TimeUnitUs 単位の時間
+  Histogram latency;   //< 滞留時間 [us]
+  /* 滞留時間を測っている要素．samples[sampleHead] から位置の順 */
+  Sample samples[FREERTOSPP_QUEUE_STATS_SAMPLES];
+  uint32_t sampleHead = 0;
+  uint32_t sampleCount = 0;
+  std::atomic<uint32_t> fullCount{0};
+  std::atomic<uint32_t> emptyCount{0};
+  QueueStats *next = NULL;
+
+  void snapshot(Snapshot &snap) {
+    portENTER_CRITICAL(&mux);
+    advance(esp_timer_get_time());
+    snap.name = name;
+    snap.capacity = capacity;
+    snap.depth = depth > 0 ? depth : 0;
+    snap.maxDepth = maxDepth;
+    snap.sent = ulSent;
+    snap.received = ulReceived;
+    snap.occupancy = occupancy;
+    snap.latency = latency;
+    portEXIT_CRITICAL(&mux);
+    snap.full = fullCount.load(std::memory_order_relaxed);
+    snap.empty = emptyCount.load(std::memory_order_relaxed);
+  }
+  static Counters summarize(const Snapshot &snap) {
+    Counters c;
+    c.name = snap.name;
+    c.capacity = snap.capacity;
+    c.depth = snap.depth;
+    c.maxDepth = snap.maxDepth;
+    c.sent = snap.sent;
+    c.received = snap.received;
+    c.full = snap.full;
+    c.empty = snap.empty;
+    c.depthP50 = snap.occupancy.percentile(500);
+    c.depthP99 = snap.occupancy.percentile(990);
+    c.latencyP50 = snap.latency.percentile(500);
+    c.latencyP99 = snap.latency.percentile(990);
+    c.latencyMax = snap.latency.max();
+    c.recommended = recommend(c);
+    return c;
+  }
+  /**
+   * @brief 前回の変化からの時間を今の要素数に加える
+   */
+  void advance(int64_t now) {
+    const int64_t units = (now - lastChange) / TimeUnitUs;
+    if (units <= 0)
+      return;
+    occupancy.record(depth > 0 ? depth : 0,
+                     units < UINT32_MAX ? uint32_t(units) : UINT32_MAX);
+    lastChange += units * TimeUnitUs;
+  }
+  void push(bool front) {
+    const int64_t now = esp_timer_get_time();
+    advance(now);
+    if (++depth > int32_t(maxDepth))
+      maxDepth = depth;
+    ++ulSent;
+    const uint32_t position = front ? --head : tail++;
+    if (sampleCount == FREERTOSPP_QUEUE_STATS_SAMPLES)
+      return;
+    if (front)
+      sampleHead = (sampleHead + FREERTOSPP_QUEUE_STATS_SAMPLES - 1) %
+                   FREERTOSPP_QUEUE_STATS_SAMPLES;
+    const uint32_t i =
+        front ? sampleHead
+              : (sampleHead + sampleCount) % FREERTOSPP_QUEUE_STATS_SAMPLES;
+    samples[i].position = position;
+    samples[i].time = now;
+    ++sampleCount;
+  }
+  void pop(bool consumed) {
+    const int64_t now = esp_timer_get_time();
+    advance(now);
+    --depth;
+    ++ulReceived;
+    const uint32_t position = head++;
+    /* 記録の前後で取り残されたものを捨てる */
+    while (sampleCount > 0 &&
+           int32_t(samples[sampleHead].position - position) < 0) {
+      sampleHead = (sampleHead + 1) % FREERTOSPP_QUEUE_STATS_SAMPLES;
+      --sampleCount;
+    }
+    if (sampleCount == 0 || samples[sampleHead].position != position)
+      return;
+    if (consumed)
+      latency.record(uint32_t(now - samples[sampleHead].time));
+    sampleHead = (sampleHead + 1) % FREERTOSPP_QUEUE_STATS_SAMPLES;
+    --sampleCount;
+  }
+
+  struct Registry {
+    portMUX_TYPE mux;
+    QueueStats *head;
+  };
+  /* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+  static Registry &registry() {
+    static Registry r = {portMUX_INITIALIZER_UNLOCKED, NULL};
+    return r;
+  }
+};
+
+} // namespace FreeRTOSpp
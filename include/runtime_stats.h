@@ -0,0 +1,90 @@
+/**
+ * @brief Run-time statistics helper for FreeRTOS tasks
+ *
+ * @file runtime_stats.h
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <vector>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief uxTaskGetSystemState() によるタスク実行時間のスナップショット
+ * configUSE_TRACE_FACILITY と configGENERATE_RUN_TIME_STATS が必要．
+ */
+class RuntimeSnapshot {
+public:
+  /**
+   * @brief 全タスクの状態を取得し直す関数
+   *
+   * @return true 成功
+   * @return false 失敗
+   */
+  bool update() {
+    /* 取得中にタスクが増えてもよいように余裕をもたせる */
+    UBaseType_t n = uxTaskGetNumberOfTasks() + 4;
+    tasks.resize(n);
+    n = uxTaskGetSystemState(tasks.data(), n, &ulTotalRunTime);
+    tasks.resize(n);
+    return n > 0;
+  }
+  /**
+   * @brief タスクの状態を検索する関数
+   *
+   * @param xHandle タスクのハンドル
+   * @return 見つからなければ NULL
+   */
+  const TaskStatus_t *find(TaskHandle_t xHandle) const {
+    for (const auto &t : tasks)
+      if (t.xHandle == xHandle)
+        return &t;
+    return NULL;
+  }
+  /**
+   * @brief 2つのスナップショット間でのタスクの実行時間
+   */
+  static uint32_t runtime(const RuntimeSnapshot &prev,
+                          const RuntimeSnapshot &curr, TaskHandle_t xHandle) {
+    const TaskStatus_t *p = prev.find(xHandle);
+    const TaskStatus_t *c = curr.find(xHandle);
+    if (p == NULL || c == NULL)
+      return 0;
+    return c->ulRunTimeCounter - p->ulRunTimeCounter;
+  }
+  /**
+   * @brief 2つのスナップショット間の経過時間
+   */
+  static uint32_t elapsed(const RuntimeSnapshot &prev,
+                          const RuntimeSnapshot &curr) {
+    return curr.ulTotalRunTime - prev.ulTotalRunTime;
+  }
+  /**
+   * @brief 2つのスナップショット間での各コアの使用率 [%]
+   * 各コアのアイドルタスクの実行時間から求める．
+   *
+   * @param core CPUコア番号
+   */
+  static uint8_t coreLoad(const RuntimeSnapshot &prev,
+                          const RuntimeSnapshot &curr, UBaseType_t core) {
+    const uint32_t total = elapsed(prev, curr);
+    if (total == 0)
+      return 0;
+    const uint32_t idle =
+        runtime(prev, curr, xTaskGetIdleTaskHandleForCPU(core));
+    if (idle >= total)
+      return 0;
+    return 100 - uint64_t(idle) * 100 / total;
+  }
+  const std::vector<TaskStatus_t> &getTasks() const { return tasks; }
+  uint32_t getTotalRunTime() const { return ulTotalRunTime; }
+
+private:
+  std::vector<TaskStatus_t> tasks;
+  uint32_t ulTotalRunTime = 0;
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,199 @@
+/**
+ * @brief Ready-to-running latency histograms for tasks created by FreeRTOSpp
+ *
+ * @file sched_latency.h
+ *
+ * FREERTOSPP_SCHED_LATENCY を 1 にして全体をビルドし，FreeRTOS の
+ * tasks.c には sched_latency_trace.h を読み込ませる (-include など) と，
+ * FreeRTOSpp が生成したタスクごとに，実行可能になってから実際に実行
+ * されるまでの時間のヒストグラムをとる．無効のときはすべての記録が
+ * 空の関数になる．
+ */
+#pragma once
+
+#ifndef FREERTOSPP_SCHED_LATENCY
+#define FREERTOSPP_SCHED_LATENCY 0
+#endif
+#ifndef FREERTOSPP_SCHED_LATENCY_TASKS
+#define FREERTOSPP_SCHED_LATENCY_TASKS 16
+#endif
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "histogram.h"
+
+#include <cstdint>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief タスクごとのスケジューリング遅延の集計
+ *
+ * 登録されたタスクがブロックや一時停止から実行可能になった時刻と，
+ * 切り替えられて走り始めた時刻の差 [us] を記録する．横取りされて
+ * 実行可能のまま待った時間は含まない．表は固定の大きさで，
+ * トレースフックは割り当ても待ちも行わない．
+ */
+class SchedLatency {
+public:
+  /**
+   * @brief 1つのタスクの要約
+   */
+  struct Summary {
+    const char *pcName;
+    uint32_t ulCount; //< 記録した回数
+    uint32_t ulP50;   //< 中央値 [us]
+    uint32_t ulP99;   //< 99 パーセンタイル [us]
+    uint32_t ulMax;   //< 最大 [us]
+  };
+
+#if FREERTOSPP_SCHED_LATENCY
+  /**
+   * @brief タスクを登録する関数
+   */
+  static void add(TaskHandle_t xTask, const char *pcName) {
+    if (xTask == NULL)
+      return;
+    State &s = state();
+    Entry *e = NULL;
+    portENTER_CRITICAL(&s.mux);
+    for (int i = 0; i < FREERTOSPP_SCHED_LATENCY_TASKS && e == NULL; ++i)
+      if (s.entries[i].xTask == NULL)
+        e = &s.entries[i];
+    if (e != NULL) {
+      e->pcName = pcName;
+      e->readyAt = 0;
+      e->histogram.reset();
+      /* フックから見えるのは他を埋めた後 */
+      __atomic_store_n(&e->xTask, xTask, __ATOMIC_RELEASE);
+    }
+    portEXIT_CRITICAL(&s.mux);
+    if (e == NULL)
+      ESP_LOGW("SchedLatency", "table is full, \"%s\" is not recorded",
+               pcName);
+  }
+  /**
+   * @brief 登録を解除する関数．タスクを削除する前に呼ぶこと．
+   */
+  static void remove(TaskHandle_t xTask) {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    for (int i = 0; i < FREERTOSPP_SCHED_LATENCY_TASKS; ++i)
+      if (s.entries[i].xTask == xTask)
+        __atomic_store_n(&s.entries[i].xTask, (TaskHandle_t)NULL,
+                         __ATOMIC_RELEASE);
+    portEXIT_CRITICAL(&s.mux);
+  }
+  /**
+   * @brief 記録を消す関数
+   */
+  static void reset() {
+    State &s = state();
+    portENTER_CRITICAL(&s.mux);
+    for (int i = 0; i < FREERTOSPP_SCHED_LATENCY_TASKS; ++i)
+      s.entries[i].histogram.reset();
+    portEXIT_CRITICAL(&s.mux);
+  }
+  /**
+   * @brief 要約を 99 パーセンタイルの大きい順に取得する関数
+   *
+   * @return 取得した数
+   */
+  static int get(Summary *pxBuffer, int n) {
+    State &s = state();
+    int count = 0;
+    for (int i = 0; i < FREERTOSPP_SCHED_LATENCY_TASKS; ++i) {
+      /* ロックの中では1つずつ写すだけにし，百分位は外で求める */
+      portENTER_CRITICAL(&s.mux);
+      const bool used = s.entries[i].xTask != NULL;
+      const char *pcName = s.entries[i].pcName;
+      const Histogram h = s.entries[i].histogram;
+      portEXIT_CRITICAL(&s.mux);
+      if (!used || h.count() == 0)
+        continue;
+      const Summary sum = {pcName, uint32_t(h.count()), h.percentile(500),
+                           h.percentile(990), h.max()};
+      /* 挿入ソートで上位 n 個を残す */
+      int j = count < n ? count++ : n;
+      while (j > 0 && pxBuffer[j - 1].ulP99 < sum.ulP99) {
+        if (j < n)
+          pxBuffer[j] = pxBuffer[j - 1];
+        --j;
+      }
+      if (j < n)
+        pxBuffer[j] = sum;
+    }
+    return count;
+  }
+  /**
+   * @brief 遅延の大きいタスクを表示する関数
+   *
+   * @param top 表示する数
+   */
+  static void print(int top = 5) {
+    const char *tag = "SchedLatency";
+    Summary summaries[FREERTOSPP_SCHED_LATENCY_TASKS];
+    if (top > FREERTOSPP_SCHED_LATENCY_TASKS)
+      top = FREERTOSPP_SCHED_LATENCY_TASKS;
+    const int n = get(summaries, top);
+    ESP_LOGI(tag, "%-16s %8s %8s %8s %8s", "task", "count", "p50[us]",
+             "p99[us]", "max[us]");
+    for (int i = 0; i < n; ++i)
+      ESP_LOGI(tag, "%-16s %8u %8u %8u %8u", summaries[i].pcName,
+               (unsigned)summaries[i].ulCount, (unsigned)summaries[i].ulP50,
+               (unsigned)summaries[i].ulP99, (unsigned)summaries[i].ulMax);
+  }
+
+  /**
+   * @brief トレースフックから呼ばれる関数 (src/sched_latency.cpp)
+   * スケジューラの中で呼ばれるので，呼び出し元に展開する．
+   */
+  __attribute__((always_inline)) static void ready(void *pxTCB, int64_t now) {
+    Entry *e = find(pxTCB);
+    if (e != NULL && e->readyAt == 0)
+      e->readyAt = now;
+  }
+  __attribute__((always_inline)) static void switchedIn(void *pxTCB,
+                                                         int64_t now) {
+    Entry *e = find(pxTCB);
+    if (e == NULL || e->readyAt == 0)
+      return;
+    e->histogram.record(uint32_t(now - e->readyAt));
+    e->readyAt = 0;
+  }
+
+private:
+  struct Entry {
+    TaskHandle_t xTask; //< NULL なら空き
+    const char *pcName;
+    int64_t readyAt; //< 実行可能になった時刻 [us]，0 なら実行中か待ち
+    Histogram histogram;
+  };
+  struct State {
+    portMUX_TYPE mux;
+    Entry entries[FREERTOSPP_SCHED_LATENCY_TASKS];
+  };
+  /* フックから最初に呼ばれても初期化済みであるよう，定数初期化される
+   * 関数内 static に置く */
+  static State &state() {
+    static State s = {portMUX_INITIALIZER_UNLOCKED, {}};
+    return s;
+  }
+  __attribute__((always_inline)) static Entry *find(void *pxTCB) {
+    State &s = state();
+    for (int i = 0; i < FREERTOSPP_SCHED_LATENCY_TASKS; ++i)
+      if (__atomic_load_n(&s.entries[i].xTask, __ATOMIC_ACQUIRE) == pxTCB)
+        return &s.entries[i];
+    return NULL;
+  }
+#else
+  static void add(TaskHandle_t, const char *) {}
+  static void remove(TaskHandle_t) {}
+  static void reset() {}
+  static int get(Summary *, int) { return 0; }
+  static void print(int = 5) {}
+#endif
+};
+
+} // namespace FreeRTOSpp
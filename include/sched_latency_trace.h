@@ -0,0 +1,42 @@
+/**
+ * @brief Kernel trace hooks for sched_latency.h
+ *
+ * @file sched_latency_trace.h
+ *
+ * FreeRTOS のビルドで FreeRTOSConfig.h の後に読み込まれるよう，
+ * FREERTOSPP_SCHED_LATENCY=1 とともに -include で与える．C からも
+ * 読めるように書いてある．同じトレースマクロを使う SystemView などとは
+ * 併用できない．
+ */
+#ifndef FREERTOSPP_SCHED_LATENCY_TRACE_H
+#define FREERTOSPP_SCHED_LATENCY_TRACE_H
+
+#if defined(FREERTOSPP_SCHED_LATENCY) && FREERTOSPP_SCHED_LATENCY
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void freertospp_sched_ready(void *pxTCB);
+void freertospp_sched_switched_in(void *pxTCB);
+#ifdef __cplusplus
+}
+#endif
+
+/* tasks.c の中で実行中のタスクを指す式 */
+#ifndef FREERTOSPP_SCHED_CURRENT_TCB
+#ifdef ESP_PLATFORM
+#define FREERTOSPP_SCHED_CURRENT_TCB pxCurrentTCB[xPortGetCoreID()]
+#else
+#define FREERTOSPP_SCHED_CURRENT_TCB pxCurrentTCB
+#endif
+#endif
+
+#undef traceMOVED_TASK_TO_READY_STATE
+#define traceMOVED_TASK_TO_READY_STATE(pxTCB) freertospp_sched_ready(pxTCB)
+#undef traceTASK_SWITCHED_IN
+#define traceTASK_SWITCHED_IN()                                                \
+  freertospp_sched_switched_in(FREERTOSPP_SCHED_CURRENT_TCB)
+
+#endif // FREERTOSPP_SCHED_LATENCY
+
+#endif // FREERTOSPP_SCHED_LATENCY_TRACE_H
@@ -0,0 +1,98 @@
+/**
+ * @brief Lock-free single-producer single-consumer ring buffer
+ *
+ * @file spsc_channel.h
+ */
+#pragma once
+
+#include "queue_stats.h"
+
+#include <atomic>
+#include <cstddef>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief ロックを使わない 1 対 1 のリングバッファ
+ * push() は1つのタスクからのみ，pop() は別の1つのタスクからのみ呼ぶこと．
+ * FREERTOSPP_QUEUE_STATS を有効にすると，統計の更新で短いロックを取る．
+ *
+ * @tparam T 要素の型
+ * @tparam N 容量，2 のべき乗
+ */
+template <typename T, size_t N> class SpscChannel {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+  /**
+   * @brief 要素を追加する関数 (producer 側)
+   *
+   * @return true 成功
+   * @return false 満杯
+   */
+  bool push(const T &item) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) {
+#if FREERTOSPP_QUEUE_STATS
+      stats.full();
+#endif
+      return false;
+    }
+    buffer[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+#if FREERTOSPP_QUEUE_STATS
+    stats.sent();
+#endif
+    return true;
+  }
+  /**
+   * @brief 要素を取り出す関数 (consumer 側)
+   *
+   * @return true 成功
+   * @return false 空
+   */
+  bool pop(T &item) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == h) {
+#if FREERTOSPP_QUEUE_STATS
+      stats.empty();
+#endif
+      return false;
+    }
+    item = buffer[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+#if FREERTOSPP_QUEUE_STATS
+    stats.received();
+#endif
+    return true;
+  }
+  bool empty() const {
+    return tail.load(std::memory_order_acquire) ==
+           head.load(std::memory_order_acquire);
+  }
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+  static constexpr size_t capacity() { return N; }
+  /**
+   * @brief 統計 (FREERTOSPP_QUEUE_STATS) に表示する名前を設定する関数
+   */
+  void setName(const char *name) {
+#if FREERTOSPP_QUEUE_STATS
+    stats.setName(name);
+#else
+    (void)name;
+#endif
+  }
+
+private:
+  std::atomic<size_t> head{0}; //< 次に読む位置 (consumer が更新)
+  std::atomic<size_t> tail{0}; //< 次に書く位置 (producer が更新)
+  T buffer[N];
+#if FREERTOSPP_QUEUE_STATS
+  QueueStats stats{N};
+#endif
+};
+
+} // namespace FreeRTOSpp
@@ -0,0 +1,327 @@
+/**
+ * @brief Compact binary telemetry of library statistics
+ *
+ * @file telemetry.h
+ *
+ * フレームの形式 (数値はリトルエンディアン)
+ *
+ *   magic[2] = A5 5A, version[1], seq[2], tick[4], length[2],
+ *   payload[length], crc16[2] (version から payload までの CRC-16/CCITT)
+ *
+ * payload はレコードの並びで，各レコードは type[1], size[1], body[size]．
+ * body の整数は符号なし LEB128，文字列は長さ[1] と本体．
+ * body が 255 バイトを超えるレコードと，payload が 0xFFFF バイトを超える
+ * フレームは送らずに捨てる (seq は進むので受け手で欠けがわかる)．
+ * 復号には tools/telemetry_decode.py を使う．
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+#include "lock_stats.h"
+#include "memory_accounting.h"
+#include "queue_stats.h"
+#include "runtime_stats.h"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#ifdef ESP_PLATFORM
+#include "driver/uart.h"
+#endif
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief フレームの書き出し先
+ */
+class TelemetrySink {
+public:
+  virtual ~TelemetrySink() {}
+  virtual bool write(const uint8_t *data, size_t size) = 0;
+};
+
+/**
+ * @brief FILE に書き出す．ファイルのほか，POSIX では popen() や
+ * mkfifo() したパイプを開いて渡せばホストのプロセスに送れる．
+ */
+class FileTelemetrySink : public TelemetrySink {
+public:
+  FileTelemetrySink(FILE *fp) : fp(fp) {}
+  virtual bool write(const uint8_t *data, size_t size) override {
+    const bool res = fwrite(data, 1, size, fp) == size;
+    fflush(fp);
+    return res;
+  }
+
+private:
+  FILE *fp;
+};
+
+#ifdef ESP_PLATFORM
+/**
+ * @brief UART に書き出す．uart_driver_install() は済ませておくこと．
+ */
+class UartTelemetrySink : public TelemetrySink {
+public:
+  UartTelemetrySink(uart_port_t port) : port(port) {}
+  virtual bool write(const uint8_t *data, size_t size) override {
+    return uart_write_bytes(port, (const char *)data, size) == int(size);
+  }
+
+private:
+  uart_port_t port;
+};
+#endif
+
+/**
+ * @brief レコードを組み立てる関数群
+ */
+class TelemetryWriter {
+public:
+  enum Record {
+    RecordTask = 1,    //< name, core, priority, load [0.1%], stack [byte]
+    RecordCore = 2,    //< core, load [%]
+    RecordLock = 3,    //< name, takes, contended, wait [us], max wait [us]
+    RecordCounter = 4, //< name, value
+    RecordMemory = 5,  //< type, name, count, heap, static
+    RecordHeap = 6,    //< free, minimum free
+    RecordQueue = 7,   //< name, capacity, max depth, p99 depth, full, empty,
+                       //< p99 latency [us], recommended capacity
+  };
+
+  explicit TelemetryWriter(std::vector<uint8_t> &buf) : buf(buf) {}
+  /**
+   * @brief レコードを始める関数．end() で閉じる．
+   * 独自のレコードには 128 以上の type を使い，body は 255 バイト以下にすること．
+   */
+  void begin(uint8_t type) {
+    buf.push_back(type);
+    start = buf.size();
+    buf.push_back(0);
+  }
+  /**
+   * @brief レコードを閉じる関数
+   *
+   * @return false body が 255 バイトを超えたのでレコードを捨てた
+   */
+  bool end() {
+    const size_t size = buf.size() - start - 1;
+    if (size > 255) {
+      ESP_LOGW("TelemetryWriter", "record %u is too large (%u bytes)",
+               buf[start - 1], (unsigned)size);
+      buf.resize(start - 1);
+      return false;
+    }
+    buf[start] = size;
+    return true;
+  }
+  void u8(uint8_t value) { buf.push_back(value); }
+  void varint(uint32_t value) {
+    while (value >= 0x80) {
+      buf.push_back(uint8_t(value) | 0x80);
+      value >>= 7;
+    }
+    buf.push_back(uint8_t(value));
+  }
+  void str(const char *s) {
+    const size_t n = s != NULL ? strnlen(s, 32) : 0;
+    buf.push_back(n);
+    buf.insert(buf.end(), s, s + n);
+  }
+
+private:
+  std::vector<uint8_t> &buf;
+  size_t start = 0;
+};
+
+/**
+ * @brief ライブラリの統計を一定周期でフレームにして送るタスク
+ *
+ * 各タスクの CPU 使用率とスタックの残り，各コアの使用率，ヒープの残り，
+ * Mutex の競合 (FREERTOSPP_LOCK_STATS)，キューの統計
+ * (FREERTOSPP_QUEUE_STATS)，メモリの集計 (FREERTOSPP_MEMORY_ACCOUNTING) と，
+ * 登録されたカウンタを送る．
+ */
+class Telemetry : public TaskBase {
+public:
+  static constexpr uint8_t Version = 1;
+  typedef std::function<uint32_t()> Counter;
+  typedef std::function<void(TelemetryWriter &)> Source;
+
+  /**
+   * @brief Construct a new Telemetry object
+   *
+   * @param sink 書き出し先
+   * @param xPeriod 送信周期
+   */
+  Telemetry(TelemetrySink &sink, TickType_t xPeriod = pdMS_TO_TICKS(1000))
+      : sink(sink), xPeriod(xPeriod) {}
+  bool start(UBaseType_t uxPriority = 1, const uint16_t usStackDepth = 4096,
+             const BaseType_t xCoreID = tskNO_AFFINITY) {
+    return createTask("Telemetry", uxPriority, usStackDepth, xCoreID);
+  }
+  void setPeriod(TickType_t xPeriod) { this->xPeriod = xPeriod; }
+  /**
+   * @brief 送信するカウンタを登録する関数
+   */
+  void addCounter(const char *name, Counter counter) {
+    mutex.take();
+    counters.push_back(std::make_pair(name, counter));
+    mutex.give();
+  }
+  /**
+   * @brief 独自のレコードを書き出す関数を登録する関数
+   */
+  void addSource(Source source) {
+    mutex.take();
+    sources.push_back(source);
+    mutex.give();
+  }
+  uint32_t getFrameCount() const { return seq; }
+  /**
+   * @brief 書き出せなかったか，大きすぎて捨てたフレームの数
+   */
+  uint32_t getDropCount() const { return dropped; }
+
+protected:
+  const char *tag = "Telemetry";
+  TelemetrySink &sink;
+  TickType_t xPeriod;
+  Mutex mutex;
+  std::vector<std::pair<const char *, Counter>> counters;
+  std::vector<Source> sources;
+  std::vector<uint8_t> frame;
+  std::vector<LockStats::Counters> locks;
+  std::vector<QueueStats::Counters> queues;
+  std::vector<MemoryAccounting::Entry> mem;
+  uint32_t seq = 0;
+  uint32_t dropped = 0;
+  static constexpr size_t HeaderSize = 11;
+
+  virtual void task() override {
+    RuntimeSnapshot prev, curr;
+    prev.update();
+    TickType_t xLastWakeTime = xTaskGetTickCount();
+    while (1) {
+      vTaskDelayUntil(&xLastWakeTime, xPeriod);
+      curr.update();
+      if (!build(prev, curr) || !sink.write(frame.data(), frame.size()))
+        ++dropped;
+      std::swap(prev, curr);
+    }
+  }
+
+  /**
+   * @brief フレームを組み立てる関数
+   *
+   * @return false payload が 0xFFFF バイトを超えたので送らない
+   */
+  bool build(const RuntimeSnapshot &prev, const RuntimeSnapshot &curr) {
+    frame.assign(HeaderSize, 0);
+    TelemetryWriter w(frame);
+    const uint32_t total = RuntimeSnapshot::elapsed(prev, curr);
+    for (const auto &t : curr.getTasks()) {
+      w.begin(TelemetryWriter::RecordTask);
+      w.str(t.pcTaskName);
+#if defined(configTASKLIST_INCLUDE_COREID) && configTASKLIST_INCLUDE_COREID
+      w.u8(t.xCoreID == tskNO_AFFINITY ? 0xFF : t.xCoreID);
+#else
+      w.u8(0xFF);
+#endif
+      w.varint(t.uxCurrentPriority);
+      const uint32_t rt = RuntimeSnapshot::runtime(prev, curr, t.xHandle);
+      w.varint(total ? uint64_t(rt) * 1000 / total : 0);
+      w.varint(t.usStackHighWaterMark);
+      w.end();
+    }
+    for (int i = 0; i < portNUM_PROCESSORS; ++i) {
+      w.begin(TelemetryWriter::RecordCore);
+      w.u8(i);
+      w.u8(RuntimeSnapshot::coreLoad(prev, curr, i));
+      w.end();
+    }
+    w.begin(TelemetryWriter::RecordHeap);
+    w.varint(xPortGetFreeHeapSize());
+    w.varint(xPortGetMinimumEverFreeHeapSize());
+    w.end();
+    /* 数えた後に生成されたものは次の周期に送る */
+    locks.resize(LockStats::count());
+    const int nLocks = LockStats::getAll(locks.data(), locks.size());
+    for (int i = 0; i < nLocks; ++i) {
+      w.begin(TelemetryWriter::RecordLock);
+      w.str(locks[i].name);
+      w.varint(locks[i].takes);
+      w.varint(locks[i].contended);
+      w.varint(locks[i].waitUs);
+      w.varint(locks[i].maxWaitUs);
+      w.end();
+    }
+    queues.resize(QueueStats::count());
+    const int nQueues = QueueStats::getAll(queues.data(), queues.size());
+    for (int i = 0; i < nQueues; ++i) {
+      w.begin(TelemetryWriter::RecordQueue);
+      w.str(queues[i].name);
+      w.varint(queues[i].capacity);
+      w.varint(queues[i].maxDepth);
+      w.varint(queues[i].depthP99);
+      w.varint(queues[i].full);
+      w.varint(queues[i].empty);
+      w.varint(queues[i].latencyP99);
+      w.varint(queues[i].recommended);
+      w.end();
+    }
+    mem.resize(FREERTOSPP_MEMORY_ACCOUNTING_ENTRIES);
+    const int nMem = MemoryAccounting::get(mem.data(), mem.size());
+    for (int i = 0; i < nMem; ++i) {
+      w.begin(TelemetryWriter::RecordMemory);
+      w.str(mem[i].type);
+      w.str(mem[i].name);
+      w.varint(mem[i].count);
+      w.varint(mem[i].heapBytes);
+      w.varint(mem[i].staticBytes);
+      w.end();
+    }
+    mutex.take();
+    for (const auto &c : counters) {
+      w.begin(TelemetryWriter::RecordCounter);
+      w.str(c.first);
+      w.varint(c.second());
+      w.end();
+    }
+    for (const auto &s : sources)
+      s(w);
+    mutex.give();
+    const size_t length = frame.size() - HeaderSize;
+    if (length > 0xFFFF) {
+      ESP_LOGW(tag, "frame %u is too large (%u bytes), dropped",
+               (unsigned)seq, (unsigned)length);
+      ++seq;
+      return false;
+    }
+    const uint32_t tick = xTaskGetTickCount();
+    const uint8_t header[HeaderSize] = {
+        0xA5, 0x5A, Version, uint8_t(seq), uint8_t(seq >> 8),
+        uint8_t(tick), uint8_t(tick >> 8), uint8_t(tick >> 16),
+        uint8_t(tick >> 24), uint8_t(length), uint8_t(length >> 8)};
+    memcpy(frame.data(), header, HeaderSize);
+    const uint16_t crc = crc16(frame.data() + 2, frame.size() - 2);
+    frame.push_back(uint8_t(crc));
+    frame.push_back(uint8_t(crc >> 8));
+    ++seq;
+    return true;
+  }
+  static uint16_t crc16(const uint8_t *data, size_t size) {
+    uint16_t crc = 0xFFFF;
+    while (size--) {
+      crc ^= uint16_t(*data++) << 8;
+      for (int i = 0; i < 8; ++i)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+  }
+};
+
+} // namespace FreeRTOSpp
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "boot_profiler.h"
+#include "deadline.h"
+#include "memory_accounting.h"
+#include "sched_latency.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
@@ -13,31 +17,50 @@ public:
          unsigned short usStackDepth = 8192,
          unsigned portBASE_TYPE uxPriority = 0,
          const BaseType_t xCoreID = tskNO_AFFINITY)
-      : func(func) {
+      : pcName(pcName), usStackDepth(usStackDepth), func(func) {
+    BootProfiler::Scope scope(BootProfiler::TypeThread, pcName);
     xSemaphore = xSemaphoreCreateBinary();
     xTaskCreatePinnedToCore(entry_point, pcName, usStackDepth, this, uxPriority,
                             &pxCreatedTask, xCoreID);
+    scope.setTask(pxCreatedTask);
+    MemoryAccounting::add("Thread", pcName,
+                          MemoryAccounting::taskBytes(usStackDepth) +
+                              MemoryAccounting::semaphoreBytes(),
+                          sizeof(*this));
   }
   ~Thread() { detach(); }
   bool joinable() const { return pxCreatedTask != NULL; }
   void join(TickType_t xBlockTime = portMAX_DELAY) {
     xSemaphoreTake(xSemaphore, xBlockTime);
   }
+  bool join(const Deadline &deadline) {
+    return pdTRUE == xSemaphoreTake(xSemaphore, deadline.remaining());
+  }
   void detach() {
     if (pxCreatedTask == NULL)
       return;
+    /* セマフォは削除されないので，タスクの分だけ減らす */
+    MemoryAccounting::remove("Thread", pcName,
+                             MemoryAccounting::taskBytes(usStackDepth),
+                             sizeof(*this));
+    SchedLatency::remove(pxCreatedTask);
     vTaskDelete(pxCreatedTask);
     pxCreatedTask = NULL;
     xSemaphoreGive(xSemaphore);
   }
 
 private:
+  const char *pcName;
+  unsigned short usStackDepth;
   TaskHandle_t pxCreatedTask = NULL;
   SemaphoreHandle_t xSemaphore = NULL;
   std::function<void()> func;
 
   static void entry_point(void *arg) {
     auto obj = static_cast<Thread *>(arg);
+    BootProfiler::firstRun();
+    /* 生成した側より先に終わることがあるので，自分で登録する */
+    SchedLatency::add(xTaskGetCurrentTaskHandle(), obj->pcName);
     obj->func();
     obj->detach();
   }
@@ -0,0 +1,279 @@
+/**
+ * @brief Timer service that batches expiries within tolerance windows
+ *
+ * @file timer_service.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+
+#include <functional>
+
+namespace FreeRTOSpp {
+
+class TimerService;
+
+/**
+ * @brief 許容幅 (slack) をもつタイマ
+ *
+ * 満了時刻から満了時刻 + slack の間ならいつ呼ばれてもよいことを宣言する．
+ * TimerService は重なる区間をもつタイマをまとめて1回の起床で呼ぶ．
+ * 記憶領域は利用者がもち，TimerService は割り当てを行わない．
+ */
+class CoalescingTimer {
+public:
+  /**
+   * @brief Construct a new Coalescing Timer object
+   *
+   * @param callback 満了時に TimerService のタスクで呼ばれる関数
+   * @param xPeriod 周期，0 なら1回だけ
+   * @param xSlack 満了を遅らせてよい幅
+   */
+  CoalescingTimer(std::function<void()> callback, TickType_t xPeriod = 0,
+                  TickType_t xSlack = 0)
+      : callback(callback), xPeriod(xPeriod), xSlack(xSlack) {}
+  inline ~CoalescingTimer();
+  CoalescingTimer(const CoalescingTimer &) = delete;
+  CoalescingTimer &operator=(const CoalescingTimer &) = delete;
+
+  bool isActive() const { return armed; }
+  TickType_t getPeriod() const { return xPeriod; }
+  TickType_t getSlack() const { return xSlack; }
+  /**
+   * @brief 次の満了時刻
+   */
+  TickType_t getExpiry() const { return xExpiry; }
+
+private:
+  friend class TimerService;
+  std::function<void()> callback;
+  TickType_t xPeriod;
+  TickType_t xSlack;
+  TickType_t xExpiry = 0;
+  /* 登録されているか，呼ばれるのを待っているか，呼ばれている間は設定される */
+  TimerService *service = NULL;
+  bool armed = false;            //< 登録されたタイマの列にある
+  CoalescingTimer *next = NULL;  //< 登録されたタイマの列
+  CoalescingTimer *fired = NULL; //< 今回の起床で呼ぶタイマの列
+};
+
+/**
+ * @brief CoalescingTimer を動かすタスク
+ *
+ * 登録されたタイマのうち最も早い「満了時刻 + slack」まで眠り，
+ * 起きた時点で満了時刻を過ぎているタイマをすべて呼ぶ．
+ * 周期タイマの次の満了時刻は呼ばれた時刻ではなく前回の満了時刻から
+ * 数えるので，まとめて呼ばれても周期はずれない．
+ */
+class TimerService : public TaskBase {
+public:
+  /**
+   * @brief 統計
+   */
+  struct Stats {
+    uint32_t wakeups;  //< タイマを呼ぶために起きた回数
+    uint32_t expiries; //< タイマを呼んだ回数
+    uint32_t missed;   //< 遅れにより飛ばした周期の数
+    uint32_t maxBatch; //< 1回の起床で呼んだタイマの最大数
+    /**
+     * @brief まとめたことで減った起床の回数
+     */
+    uint32_t saved() const { return expiries - wakeups; }
+  };
+
+  bool start(UBaseType_t uxPriority = configMAX_PRIORITIES - 3,
+             const uint16_t usStackDepth = 4096,
+             const BaseType_t xCoreID = tskNO_AFFINITY) {
+    return createTask("TimerService", uxPriority, usStackDepth, xCoreID);
+  }
+  /**
+   * @brief タイマを開始する関数．開始済みなら満了時刻を設定し直す．
+   *
+   * @param xDelay 最初の満了までの時間
+   */
+  bool add(CoalescingTimer &timer, TickType_t xDelay) {
+    if (timer.service != NULL && timer.service != this) {
+      ESP_LOGW(tag, "timer is added to another service");
+      return false;
+    }
+    portENTER_CRITICAL(&mux);
+    timer.xExpiry = xTaskGetTickCount() + xDelay;
+    timer.service = this;
+    if (!timer.armed) {
+      timer.armed = true;
+      timer.next = head;
+      head = &timer;
+    }
+    portEXIT_CRITICAL(&mux);
+    wake();
+    return true;
+  }
+  /**
+   * @brief 周期を初めの満了までの時間としてタイマを開始する関数
+   */
+  bool add(CoalescingTimer &timer) { return add(timer, timer.xPeriod); }
+  /**
+   * @brief タイマを止める関数
+   * 今回の起床で呼ぶ予定のタイマは呼ばれなくなる．他のタスクから呼んだ
+   * ときにそのタイマの関数が実行中なら，終わるまで待つので，戻った後は
+   * タイマを破棄してよい．
+   */
+  void remove(CoalescingTimer &timer) {
+    portENTER_CRITICAL(&mux);
+    if (timer.service == this) {
+      if (timer.armed)
+        unlink(timer);
+      for (CoalescingTimer **p = &pending; *p != NULL; p = &(*p)->fired) {
+        if (*p == &timer) {
+          *p = timer.fired;
+          break;
+        }
+      }
+      timer.fired = NULL;
+      if (running == &timer) {
+        if (xTaskGetCurrentTaskHandle() == pxCreatedTask) {
+          /* 関数の中で自身を止めたので，戻った後に触れないようにする */
+          running = NULL;
+        } else {
+          while (running == &timer) {
+            portEXIT_CRITICAL(&mux);
+            vTaskDelay(1);
+            portENTER_CRITICAL(&mux);
+          }
+        }
+      }
+      timer.service = NULL;
+    }
+    portEXIT_CRITICAL(&mux);
+  }
+  Stats getStats() {
+    portENTER_CRITICAL(&mux);
+    const Stats s = stats;
+    portEXIT_CRITICAL(&mux);
+    return s;
+  }
+  void print() {
+    const Stats s = getStats();
+    ESP_LOGI(tag,
+             "%u expiries in %u wakeups (%u saved), max batch %u, %u missed",
+             (unsigned)s.expiries, (unsigned)s.wakeups, (unsigned)s.saved(),
+             (unsigned)s.maxBatch, (unsigned)s.missed);
+  }
+
+protected:
+  const char *tag = "TimerService";
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  CoalescingTimer *head = NULL;
+  CoalescingTimer *pending = NULL; //< 今回の起床でまだ呼んでいないタイマ
+  CoalescingTimer *running = NULL; //< 関数を実行中のタイマ
+  Stats stats = {};
+
+  static bool reached(TickType_t xTime, TickType_t xNow) {
+    return int32_t(xNow - xTime) >= 0;
+  }
+  void wake() {
+    if (pxCreatedTask != NULL)
+      xTaskNotifyGive(pxCreatedTask);
+  }
+  void unlink(CoalescingTimer &timer) {
+    for (CoalescingTimer **p = &head; *p != NULL; p = &(*p)->next) {
+      if (*p == &timer) {
+        *p = timer.next;
+        break;
+      }
+    }
+    timer.next = NULL;
+    timer.armed = false;
+  }
+  /**
+   * @brief 起きるべき時刻までのティック数を求める
+   */
+  TickType_t timeout(TickType_t xNow) {
+    bool found = false;
+    TickType_t xWake = 0;
+    for (CoalescingTimer *t = head; t != NULL; t = t->next) {
+      const TickType_t xLatest = t->xExpiry + t->xSlack;
+      if (!found || int32_t(xLatest - xWake) < 0)
+        xWake = xLatest;
+      found = true;
+    }
+    if (!found)
+      return portMAX_DELAY;
+    return reached(xWake, xNow) ? 0 : xWake - xNow;
+  }
+  /**
+   * @brief 許容幅の終わりに達したタイマがあれば，満了したものをすべて集める
+   */
+  CoalescingTimer *collect(TickType_t xNow) {
+    bool due = false;
+    for (CoalescingTimer *t = head; t != NULL && !due; t = t->next)
+      due = reached(t->xExpiry + t->xSlack, xNow);
+    if (!due)
+      return NULL;
+    CoalescingTimer *fired = NULL;
+    uint32_t batch = 0;
+    for (CoalescingTimer **p = &head; *p != NULL;) {
+      CoalescingTimer *t = *p;
+      if (!reached(t->xExpiry, xNow)) {
+        p = &t->next;
+        continue;
+      }
+      t->fired = fired;
+      fired = t;
+      ++batch;
+      if (t->xPeriod == 0) {
+        *p = t->next;
+        t->next = NULL;
+        t->armed = false;
+        continue;
+      }
+      t->xExpiry += t->xPeriod;
+      while (reached(t->xExpiry, xNow)) {
+        t->xExpiry += t->xPeriod;
+        ++stats.missed;
+      }
+      p = &t->next;
+    }
+    ++stats.wakeups;
+    stats.expiries += batch;
+    if (batch > stats.maxBatch)
+      stats.maxBatch = batch;
+    return fired;
+  }
+
+  virtual void task() override {
+    while (1) {
+      portENTER_CRITICAL(&mux);
+      const TickType_t xWait = timeout(xTaskGetTickCount());
+      portEXIT_CRITICAL(&mux);
+      if (xWait > 0)
+        ulTaskNotifyTake(pdTRUE, xWait);
+      /* 呼ぶ前に毎回 pending から外すので，先に呼んだ関数が後のタイマを
+         止めたり破棄したりしても，そのタイマには触れない */
+      portENTER_CRITICAL(&mux);
+      pending = collect(xTaskGetTickCount());
+      while (pending != NULL) {
+        CoalescingTimer *t = pending;
+        pending = t->fired;
+        t->fired = NULL;
+        running = t;
+        portEXIT_CRITICAL(&mux);
+        t->callback();
+        portENTER_CRITICAL(&mux);
+        if (running == t) {
+          running = NULL;
+          if (!t->armed)
+            t->service = NULL;
+        }
+      }
+      portEXIT_CRITICAL(&mux);
+    }
+  }
+};
+
+inline CoalescingTimer::~CoalescingTimer() {
+  if (service != NULL)
+    service->remove(*this);
+}
+
+} // namespace FreeRTOSpp
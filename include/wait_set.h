@@ -0,0 +1,331 @@
+/**
+ * @brief Wait for any or all of several semaphores, mutexes, queues and
+ * event groups
+ *
+ * @file wait_set.h
+ */
+#pragma once
+
+#include "FreeRTOSpp.h"
+
+#include <cstddef>
+
+namespace FreeRTOSpp {
+
+/**
+ * @brief 複数の Semaphore, Mutex, Queue, EventGroup をまとめて待つ集合
+ *
+ * FreeRTOS のキューセットの上に作り，待つときは1回だけブロックする．
+ * EventGroup はキューセットに入らないので，setBits() で与えられる
+ * 通知用のセマフォを代わりに入れる．
+ *
+ * キューセットの規則により，登録したものは他のタスクの分も含めて
+ * すべての取り出し (take(), receive()) を WaitSet を通して行うこと．
+ * 直接取り出すと，与えるたびにキューセットへ入る通知が取り出されずに
+ * 溜まり，キューセットがあふれて configASSERT で止まる．特に Mutex を
+ * 登録すると，その Mutex を使うすべてのタスクが WaitSet で取ることになる．
+ * Mutex は登録時に空いていてもよい．Queue は空のときに登録すること．
+ * キューセット経由で取った Mutex には優先度継承がはたらかない．
+ *
+ * @tparam N 登録できる数
+ */
+template <size_t N = 8> class WaitSet {
+public:
+  static const int Timeout = -1; //< waitAny() の時間切れ
+
+  /**
+   * @param uxLength 登録するものの容量の合計．Semaphore, Mutex,
+   * EventGroup は 1，Queue はその長さ
+   */
+  explicit WaitSet(UBaseType_t uxLength) : uxLength(uxLength) {
+    xQueueSet = xQueueCreateSet(uxLength);
+    if (xQueueSet == NULL) {
+      ESP_LOGE(tag, "xQueueCreateSet() failed");
+    }
+    MemoryAccounting::add(
+        "WaitSet", NULL,
+        MemoryAccounting::queueBytes(uxLength, sizeof(QueueSetMemberHandle_t)),
+        sizeof(*this));
+  }
+  ~WaitSet() {
+    for (size_t i = 0; i < uxCount; ++i)
+      detach(entries[i]);
+    MemoryAccounting::remove(
+        "WaitSet", NULL,
+        MemoryAccounting::queueBytes(uxLength, sizeof(QueueSetMemberHandle_t)),
+        sizeof(*this));
+    vQueueDelete(xQueueSet);
+  }
+  WaitSet(const WaitSet &) = delete;
+  WaitSet &operator=(const WaitSet &) = delete;
+
+  /**
+   * @brief 登録する関数．waitAny() はこの番号を返す．
+   *
+   * @return 番号．失敗したら -1
+   */
+  int add(Semaphore &semaphore) {
+    return addSemaphore(semaphore.getHandle(), KindSemaphore);
+  }
+  int add(Mutex &mutex) { return addSemaphore(mutex.getHandle(), KindMutex); }
+  /**
+   * @brief Queue を登録する関数
+   * waitAny() / waitAll() が返したら，要素を1つ receive(item, 0) すること．
+   */
+  template <typename T> int add(Queue<T> &queue) {
+    Entry *e = append(KindQueue, queue.capacity());
+    if (e == NULL)
+      return -1;
+    e->xMember = queue.getHandle();
+    if (pdPASS != xQueueAddToSet(e->xMember, xQueueSet)) {
+      ESP_LOGW(tag, "queue must be empty when added");
+      rollback(queue.capacity());
+      return -1;
+    }
+    return uxCount - 1;
+  }
+  /**
+   * @brief EventGroup を登録する関数
+   *
+   * @param uxBits 待つビット
+   * @param clearOnExit 返すときに uxBits を下ろす
+   * @param waitForAll uxBits がすべて立つまで待つ
+   */
+  int add(EventGroup &group, EventBits_t uxBits, bool clearOnExit = true,
+          bool waitForAll = false) {
+    if (group.hasSignal()) {
+      ESP_LOGW(tag, "event group is already in a wait set");
+      return -1;
+    }
+    Entry *e = append(KindEventGroup, 1);
+    if (e == NULL)
+      return -1;
+    const SemaphoreHandle_t xSignal = xSemaphoreCreateBinary();
+    if (xSignal == NULL || pdPASS != xQueueAddToSet(xSignal, xQueueSet)) {
+      ESP_LOGE(tag, "couldn't add the event group");
+      if (xSignal != NULL)
+        vSemaphoreDelete(xSignal);
+      rollback(1);
+      return -1;
+    }
+    group.setSignal(xSignal);
+    e->xMember = xSignal;
+    e->group = &group;
+    e->uxBits = uxBits;
+    e->clearOnExit = clearOnExit;
+    e->waitForAll = waitForAll;
+    return uxCount - 1;
+  }
+
+  /**
+   * @brief どれか1つが使えるようになるまで待つ関数
+   *
+   * Semaphore と Mutex は取った状態で返す．同時に使えるものがあれば
+   * 番号の小さいものを返す．
+   *
+   * @return 使えるようになったものの番号．時間切れなら Timeout
+   */
+  int waitAny(TickType_t xBlockTime = portMAX_DELAY) {
+    return waitAny(Deadline(xBlockTime));
+  }
+  int waitAny(const Deadline &deadline) {
+    while (1) {
+      for (size_t i = 0; i < uxCount; ++i)
+        if (ready(entries[i]) && acquire(entries[i]))
+          return i;
+      if (!select(deadline))
+        return Timeout;
+    }
+  }
+  /**
+   * @brief すべてが同時に使えるようになるまで待つ関数
+   *
+   * 揃ったときにまとめて取るので，待っている間は何も保持しない．
+   *
+   * @return false 時間切れ
+   */
+  bool waitAll(TickType_t xBlockTime = portMAX_DELAY) {
+    return waitAll(Deadline(xBlockTime));
+  }
+  bool waitAll(const Deadline &deadline) {
+    while (1) {
+      bool all = true;
+      for (size_t i = 0; i < uxCount && all; ++i)
+        all = ready(entries[i]);
+      if (all && acquireAll())
+        return true;
+      if (!select(deadline))
+        return false;
+    }
+  }
+  size_t size() const { return uxCount; }
+
+private:
+  enum Kind { KindSemaphore, KindMutex, KindQueue, KindEventGroup };
+  struct Entry {
+    Kind kind;
+    QueueSetMemberHandle_t xMember;
+    /* キューセットから受け取ったが，まだ取り出していない数 */
+    UBaseType_t uxUnits;
+    EventGroup *group;
+    EventBits_t uxBits;
+    bool clearOnExit;
+    bool waitForAll;
+  };
+
+  const char *tag = "WaitSet";
+  QueueSetHandle_t xQueueSet = NULL;
+  UBaseType_t uxLength;
+  UBaseType_t uxUsed = 0; //< 登録したものの容量の合計
+  size_t uxCount = 0;
+  Entry entries[N];
+
+  Entry *append(Kind kind, UBaseType_t uxCapacity) {
+    if (uxCount == N || uxUsed + uxCapacity > uxLength) {
+      ESP_LOGW(tag, "wait set is full");
+      return NULL;
+    }
+    Entry &e = entries[uxCount++];
+    e = Entry();
+    e.kind = kind;
+    uxUsed += uxCapacity;
+    return &e;
+  }
+  /**
+   * @brief 最後に append() したものを取り消す
+   */
+  void rollback(UBaseType_t uxCapacity) {
+    --uxCount;
+    uxUsed -= uxCapacity;
+  }
+  int addSemaphore(SemaphoreHandle_t xSemaphore, Kind kind) {
+    Entry *e = append(kind, 1);
+    if (e == NULL)
+      return -1;
+    e->xMember = xSemaphore;
+    if (pdPASS != xQueueAddToSet(xSemaphore, xQueueSet)) {
+      /* 与えられた状態では入れられないので，一度取ってから入れて戻す */
+      const bool taken = pdTRUE == xSemaphoreTake(xSemaphore, 0);
+      const bool added =
+          taken && pdPASS == xQueueAddToSet(xSemaphore, xQueueSet);
+      if (taken)
+        xSemaphoreGive(xSemaphore);
+      if (!added) {
+        ESP_LOGE(tag, "couldn't add the semaphore");
+        rollback(1);
+        return -1;
+      }
+    }
+    return uxCount - 1;
+  }
+  void detach(Entry &e) {
+    if (e.kind == KindQueue) {
+      if (pdPASS != xQueueRemoveFromSet(e.xMember, xQueueSet))
+        ESP_LOGE(tag, "queue must be empty when the wait set is destroyed");
+      return;
+    }
+    /* 先に EventGroup から外して，setBits() が与えないようにする */
+    if (e.kind == KindEventGroup)
+      e.group->clearSignal();
+    /* セマフォは空でないと外せないので，一度取って外してから戻す */
+    UBaseType_t uxTaken = 0;
+    while (pdTRUE == xSemaphoreTake(e.xMember, 0))
+      ++uxTaken;
+    xQueueRemoveFromSet(e.xMember, xQueueSet);
+    if (e.kind == KindEventGroup) {
+      vSemaphoreDelete(e.xMember);
+      return;
+    }
+    while (uxTaken-- > 0)
+      xSemaphoreGive(e.xMember);
+  }
+  Entry *find(QueueSetMemberHandle_t xMember) {
+    for (size_t i = 0; i < uxCount; ++i)
+      if (entries[i].xMember == xMember)
+        return &entries[i];
+    return NULL;
+  }
+  /**
+   * @brief キューセットで1回ブロックし，届いた通知を数える
+   *
+   * @return false 時間切れ
+   */
+  bool select(const Deadline &deadline) {
+    const QueueSetMemberHandle_t xMember =
+        xQueueSelectFromSet(xQueueSet, deadline.remaining());
+    if (xMember == NULL)
+      return false;
+    Entry *e = find(xMember);
+    if (e == NULL)
+      return true;
+    if (e->kind == KindEventGroup)
+      xSemaphoreTake(xMember, 0); // ビットは ready() で直接調べる
+    else
+      ++e->uxUnits;
+    return true;
+  }
+  bool matches(const Entry &e, EventBits_t uxBits) const {
+    const EventBits_t uxMatched = uxBits & e.uxBits;
+    return e.waitForAll ? uxMatched == e.uxBits : uxMatched != 0;
+  }
+  bool ready(const Entry &e) const {
+    if (e.kind == KindEventGroup)
+      return matches(e, e.group->getBits());
+    return e.uxUnits > 0;
+  }
+  /**
+   * @brief ready() なものを1つ取る
+   */
+  bool acquire(Entry &e) {
+    switch (e.kind) {
+    case KindSemaphore:
+    case KindMutex:
+      --e.uxUnits;
+      return pdTRUE == xSemaphoreTake(e.xMember, 0);
+    case KindQueue:
+      --e.uxUnits; // 要素は呼び出し側が受け取る
+      return true;
+    case KindEventGroup: {
+      const EventBits_t uxBits = e.group->getBits();
+      if (!matches(e, uxBits))
+        return false;
+      if (e.clearOnExit)
+        e.group->clearBits(uxBits & e.uxBits);
+      return true;
+    }
+    }
+    return false;
+  }
+  /**
+   * @brief すべてを取る．取れないものがあれば取ったものを戻す
+   */
+  bool acquireAll() {
+    size_t i = 0;
+    for (; i < uxCount; ++i) {
+      if (entries[i].kind == KindEventGroup) {
+        if (!matches(entries[i], entries[i].group->getBits()))
+          break;
+      } else if (!acquire(entries[i])) {
+        break;
+      }
+    }
+    if (i == uxCount) {
+      for (size_t j = 0; j < uxCount; ++j) {
+        Entry &e = entries[j];
+        if (e.kind == KindEventGroup && e.clearOnExit)
+          e.group->clearBits(e.group->getBits() & e.uxBits);
+      }
+      return true;
+    }
+    while (i-- > 0) {
+      Entry &e = entries[i];
+      if (e.kind == KindQueue)
+        ++e.uxUnits;
+      else if (e.kind != KindEventGroup)
+        xSemaphoreGive(e.xMember); // 通知はキューセットに届き直す
+    }
+    return false;
+  }
+};
+
+} // namespace FreeRTOSpp
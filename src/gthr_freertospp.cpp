@@ -0,0 +1,300 @@
+/**
+ * @brief Kernel side of the gthreads backend in gthr-freertospp.h
+ *
+ * @file gthr_freertospp.cpp
+ *
+ * FREERTOSPP_GTHREADS を 1 にしたときだけビルドされる．
+ * スレッドローカルなキーとスレッドの制御ブロックは，タスクの
+ * スレッドローカルストレージの FREERTOSPP_GTHR_TLS_INDEX 番に置く．
+ * 0 番は ESP-IDF の pthread が使うので，
+ * CONFIG_FREERTOS_THREAD_LOCAL_STORAGE_POINTERS を 2 以上にすること．
+ */
+#ifndef FREERTOSPP_GTHREADS
+#define FREERTOSPP_GTHREADS 0
+#endif
+
+#if FREERTOSPP_GTHREADS
+
+#include "atomic_wait.h"
+#include "gthr-freertospp.h"
+#include "memory_accounting.h"
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+#ifndef FREERTOSPP_GTHR_KEYS
+#define FREERTOSPP_GTHR_KEYS 8
+#endif
+#ifndef FREERTOSPP_GTHR_TLS_INDEX
+#define FREERTOSPP_GTHR_TLS_INDEX (configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1)
+#endif
+static_assert(FREERTOSPP_GTHR_TLS_INDEX > 0,
+              "TLS index 0 is used by ESP-IDF pthread; set "
+              "CONFIG_FREERTOS_THREAD_LOCAL_STORAGE_POINTERS to 2 or more");
+#ifndef FREERTOSPP_GTHR_STACK_SIZE
+#define FREERTOSPP_GTHR_STACK_SIZE 8192
+#endif
+#ifndef FREERTOSPP_GTHR_PRIORITY
+#define FREERTOSPP_GTHR_PRIORITY 5
+#endif
+
+using namespace FreeRTOSpp;
+
+/**
+ * @brief タスクごとのキーの値と，std::thread の制御ブロック
+ */
+struct freertospp_gthr_task {
+  enum State { Running, Finished, Detached };
+  void *values[FREERTOSPP_GTHR_KEYS] = {};
+  void *(*func)(void *) = nullptr;
+  void *args = nullptr;
+  void *result = nullptr;
+  std::atomic<int> state{Running};
+  bool thread = false; //< __gthread_create() で生成した
+};
+
+namespace {
+
+typedef freertospp_gthr_task GthrTask;
+
+struct Key {
+  std::atomic<bool> used{false};
+  void (*dtor)(void *) = nullptr;
+};
+
+/* 静的初期化の順序に依存しないよう，定数初期化される関数内 static に置く */
+Key *keys() {
+  static Key table[FREERTOSPP_GTHR_KEYS];
+  return table;
+}
+
+GthrTask *currentBlock() {
+  return static_cast<GthrTask *>(
+      pvTaskGetThreadLocalStoragePointer(NULL, FREERTOSPP_GTHR_TLS_INDEX));
+}
+
+/* pthread と同じく，値を NULL にしてからデストラクタを呼ぶのを 4 回まで */
+void runDestructors(GthrTask *t) {
+  for (int round = 0; round < 4; ++round) {
+    bool called = false;
+    for (int i = 0; i < FREERTOSPP_GTHR_KEYS; ++i) {
+      void *value = t->values[i];
+      if (value == nullptr)
+        continue;
+      t->values[i] = nullptr;
+      Key &key = keys()[i];
+      if (key.used.load(std::memory_order_acquire) && key.dtor != nullptr) {
+        key.dtor(value);
+        called = true;
+      }
+    }
+    if (!called)
+      break;
+  }
+}
+
+/* std::thread 以外のタスクが終了したとき */
+void deleteBlock(int, void *ptr) {
+  auto t = static_cast<GthrTask *>(ptr);
+  runDestructors(t);
+  delete t;
+}
+
+void releaseThread(GthrTask *t) {
+  MemoryAccounting::remove(
+      "gthread", NULL, MemoryAccounting::taskBytes(FREERTOSPP_GTHR_STACK_SIZE),
+      sizeof(*t));
+  delete t;
+}
+
+void entry_point(void *arg) {
+  auto t = static_cast<GthrTask *>(arg);
+  vTaskSetThreadLocalStoragePointer(NULL, FREERTOSPP_GTHR_TLS_INDEX, t);
+  t->result = t->func(t->args);
+  runDestructors(t);
+  vTaskSetThreadLocalStoragePointer(NULL, FREERTOSPP_GTHR_TLS_INDEX, NULL);
+  int expected = GthrTask::Running;
+  if (t->state.compare_exchange_strong(expected, GthrTask::Finished)) {
+    /* これ以降 t は join() で解放されうるので，通知にはアドレスだけを使う */
+    atomicNotifyAll(t->state);
+  } else {
+    releaseThread(t);
+  }
+  vTaskDelete(NULL);
+}
+
+/* 絶対時刻 (CLOCK_REALTIME) までの tick 数．切り上げる */
+Deadline deadlineOf(const __gthread_time_t *abs_timeout) {
+  if (abs_timeout == NULL)
+    return Deadline::never();
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t ns = int64_t(abs_timeout->tv_sec - now.tv_sec) * 1000000000 +
+               (abs_timeout->tv_nsec - now.tv_nsec);
+  if (ns <= 0)
+    return Deadline(0);
+  const int64_t limit = int64_t(portMAX_DELAY - 1) * 1000000000 /
+                        configTICK_RATE_HZ;
+  if (ns > limit)
+    ns = limit;
+  return Deadline(
+      TickType_t((ns * configTICK_RATE_HZ + 999999999) / 1000000000));
+}
+
+} // namespace
+
+extern "C" {
+
+int freertospp_gthr_wait(int *addr, int expected,
+                         const __gthread_time_t *abs_timeout) {
+  return AtomicWait::wait(
+             addr,
+             [&]() {
+               return __atomic_load_n(addr, __ATOMIC_ACQUIRE) == expected;
+             },
+             deadlineOf(abs_timeout))
+             ? 0
+             : ETIMEDOUT;
+}
+
+void freertospp_gthr_wake(int *addr, int all) {
+  if (all)
+    AtomicWait::notifyAll(addr);
+  else
+    AtomicWait::notifyOne(addr);
+}
+
+void *freertospp_gthr_current(void) { return xTaskGetCurrentTaskHandle(); }
+
+int freertospp_gthr_create(__gthread_t *thread, void *(*func)(void *),
+                           void *args) {
+  auto t = new (std::nothrow) GthrTask;
+  if (t == nullptr)
+    return EAGAIN;
+  t->func = func;
+  t->args = args;
+  t->thread = true;
+  TaskHandle_t handle;
+  if (pdPASS != xTaskCreatePinnedToCore(entry_point, "gthread",
+                                        FREERTOSPP_GTHR_STACK_SIZE, t,
+                                        FREERTOSPP_GTHR_PRIORITY, &handle,
+                                        tskNO_AFFINITY)) {
+    delete t;
+    return EAGAIN;
+  }
+  MemoryAccounting::add(
+      "gthread", NULL, MemoryAccounting::taskBytes(FREERTOSPP_GTHR_STACK_SIZE),
+      sizeof(*t));
+  *thread = t;
+  return 0;
+}
+
+int freertospp_gthr_join(__gthread_t thread, void **value_ptr) {
+  if (thread == freertospp_gthr_self())
+    return EDEADLK;
+  atomicWait(thread->state, int(GthrTask::Running));
+  if (value_ptr != NULL)
+    *value_ptr = thread->result;
+  releaseThread(thread);
+  return 0;
+}
+
+int freertospp_gthr_detach(__gthread_t thread) {
+  int expected = GthrTask::Running;
+  if (!thread->state.compare_exchange_strong(expected, GthrTask::Detached))
+    releaseThread(thread); // すでに終了していた
+  return 0;
+}
+
+__gthread_t freertospp_gthr_self(void) {
+  GthrTask *t = currentBlock();
+  if (t != nullptr && t->thread)
+    return t;
+  /* 他で生成されたタスクはタスクハンドルで区別する */
+  return reinterpret_cast<__gthread_t>(xTaskGetCurrentTaskHandle());
+}
+
+int freertospp_gthr_yield(void) {
+  taskYIELD();
+  return 0;
+}
+
+int freertospp_gthr_once(__gthread_once_t *once, void (*func)(void)) {
+  enum { Idle, Running, Done };
+  int *state = &once->state;
+  while (1) {
+    int expected = Idle;
+    if (__atomic_compare_exchange_n(state, &expected, Running, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      break;
+    if (expected == Done)
+      return 0;
+    freertospp_gthr_wait(state, Running, NULL);
+  }
+#ifdef __cpp_exceptions
+  try {
+    func();
+  } catch (...) {
+    /* 未実行に戻し，待っていたタスクに再度試みさせる */
+    __atomic_store_n(state, Idle, __ATOMIC_RELEASE);
+    freertospp_gthr_wake(state, 1);
+    throw;
+  }
+#else
+  func();
+#endif
+  __atomic_store_n(state, Done, __ATOMIC_RELEASE);
+  freertospp_gthr_wake(state, 1);
+  return 0;
+}
+
+int freertospp_gthr_key_create(__gthread_key_t *key, void (*dtor)(void *)) {
+  for (int i = 0; i < FREERTOSPP_GTHR_KEYS; ++i) {
+    Key &k = keys()[i];
+    bool expected = false;
+    if (!k.used.load(std::memory_order_relaxed) &&
+        k.used.compare_exchange_strong(expected, true)) {
+      k.dtor = dtor;
+      *key = i;
+      return 0;
+    }
+  }
+  return EAGAIN;
+}
+
+int freertospp_gthr_key_delete(__gthread_key_t key) {
+  if (key < 0 || key >= FREERTOSPP_GTHR_KEYS)
+    return EINVAL;
+  keys()[key].used.store(false, std::memory_order_release);
+  return 0;
+}
+
+void *freertospp_gthr_getspecific(__gthread_key_t key) {
+  GthrTask *t = currentBlock();
+  if (t == nullptr || key < 0 || key >= FREERTOSPP_GTHR_KEYS)
+    return NULL;
+  return t->values[key];
+}
+
+int freertospp_gthr_setspecific(__gthread_key_t key, const void *ptr) {
+  if (key < 0 || key >= FREERTOSPP_GTHR_KEYS)
+    return EINVAL;
+  GthrTask *t = currentBlock();
+  if (t == nullptr) {
+    if (ptr == NULL)
+      return 0;
+    /* std::thread 以外のタスクでは初めて値を設定したときに確保する */
+    t = new (std::nothrow) GthrTask;
+    if (t == nullptr)
+      return ENOMEM;
+    vTaskSetThreadLocalStoragePointerAndDelCallback(
+        NULL, FREERTOSPP_GTHR_TLS_INDEX, t, deleteBlock);
+  }
+  t->values[key] = const_cast<void *>(ptr);
+  return 0;
+}
+
+} // extern "C"
+
+#endif // FREERTOSPP_GTHREADS
@@ -0,0 +1,32 @@
+/**
+ * @brief Trace hook entry points for sched_latency.h
+ *
+ * @file sched_latency.cpp
+ *
+ * FREERTOSPP_SCHED_LATENCY を 1 にしたときだけビルドされる．
+ * スケジューラの中から呼ばれるので IRAM に置く．
+ */
+#include "sched_latency.h"
+
+#if FREERTOSPP_SCHED_LATENCY
+
+#include "esp_timer.h"
+#include "sched_latency_trace.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+using namespace FreeRTOSpp;
+
+extern "C" IRAM_ATTR void freertospp_sched_ready(void *pxTCB) {
+  SchedLatency::ready(pxTCB, esp_timer_get_time());
+}
+
+extern "C" IRAM_ATTR void freertospp_sched_switched_in(void *pxTCB) {
+  SchedLatency::switchedIn(pxTCB, esp_timer_get_time());
+}
+
+#endif // FREERTOSPP_SCHED_LATENCY
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""Decode binary telemetry frames written by FreeRTOSpp::Telemetry.
+
+Usage:
+    telemetry_decode.py [FILE]             read a file or pipe (stdin if omitted)
+    telemetry_decode.py --serial PORT [--baud BAUD]   read a UART (needs pyserial)
+    add --json to print one JSON object per frame
+"""
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"\xa5\x5a"
+VERSION = 1
+HEADER = struct.Struct("<2sBHIH")
+
+RECORD_TASK = 1
+RECORD_CORE = 2
+RECORD_LOCK = 3
+RECORD_COUNTER = 4
+RECORD_MEMORY = 5
+RECORD_HEAP = 6
+RECORD_QUEUE = 7
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+class Body:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def u8(self):
+        v = self.data[self.pos]
+        self.pos += 1
+        return v
+
+    def varint(self):
+        v = shift = 0
+        while True:
+            b = self.u8()
+            v |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                return v
+
+    def str(self):
+        n = self.u8()
+        s = self.data[self.pos:self.pos + n].decode("utf-8", "replace")
+        self.pos += n
+        return s
+
+
+def decode_record(rtype, body):
+    b = Body(body)
+    if rtype == RECORD_TASK:
+        name, core = b.str(), b.u8()
+        return {"type": "task", "name": name,
+                "core": None if core == 0xFF else core,
+                "priority": b.varint(), "load": b.varint() / 10.0,
+                "stack": b.varint()}
+    if rtype == RECORD_CORE:
+        return {"type": "core", "core": b.u8(), "load": b.u8()}
+    if rtype == RECORD_LOCK:
+        return {"type": "lock", "name": b.str(), "takes": b.varint(),
+                "contended": b.varint(), "wait_us": b.varint(),
+                "max_wait_us": b.varint()}
+    if rtype == RECORD_COUNTER:
+        return {"type": "counter", "name": b.str(), "value": b.varint()}
+    if rtype == RECORD_MEMORY:
+        return {"type": "memory", "kind": b.str(), "name": b.str(),
+                "count": b.varint(), "heap": b.varint(),
+                "static": b.varint()}
+    if rtype == RECORD_HEAP:
+        return {"type": "heap", "free": b.varint(), "min_free": b.varint()}
+    if rtype == RECORD_QUEUE:
+        return {"type": "queue", "name": b.str(), "capacity": b.varint(),
+                "max_depth": b.varint(), "p99_depth": b.varint(),
+                "full": b.varint(), "empty": b.varint(),
+                "p99_latency_us": b.varint(), "recommended": b.varint()}
+    return {"type": rtype, "raw": body.hex()}
+
+
+def decode_payload(payload):
+    records = []
+    pos = 0
+    while pos + 2 <= len(payload):
+        rtype, size = payload[pos], payload[pos + 1]
+        records.append(decode_record(rtype, payload[pos + 2:pos + 2 + size]))
+        pos += 2 + size
+    return records
+
+
+def read_chunk(stream):
+    """Return whatever bytes are available without waiting for a full block.
+
+    Serial ports are opened with a timeout, so an empty result there only
+    means nothing arrived yet; None is returned at end of input.
+    """
+    if hasattr(stream, "in_waiting"):
+        return stream.read(stream.in_waiting or 1)
+    if hasattr(stream, "read1"):
+        chunk = stream.read1(256)
+    else:
+        chunk = stream.read(256)
+    return chunk if chunk else None
+
+
+def frames(stream):
+    """Yield decoded frames, resynchronising on the magic after errors."""
+    buf = b""
+    while True:
+        chunk = read_chunk(stream)
+        if chunk is None:
+            return
+        if not chunk:
+            continue
+        buf += chunk
+        while True:
+            i = buf.find(MAGIC)
+            if i < 0:
+                buf = buf[-1:]
+                break
+            buf = buf[i:]
+            if len(buf) < HEADER.size:
+                break
+            _, version, seq, tick, length = HEADER.unpack_from(buf)
+            end = HEADER.size + length + 2
+            if len(buf) < end:
+                break
+            (crc,) = struct.unpack_from("<H", buf, end - 2)
+            if version != VERSION or crc != crc16(buf[2:end - 2]):
+                buf = buf[1:]
+                continue
+            yield {"seq": seq, "tick": tick,
+                   "records": decode_payload(buf[HEADER.size:end - 2])}
+            buf = buf[end:]
+
+
+def print_frame(frame):
+    print("frame %d @ tick %d" % (frame["seq"], frame["tick"]))
+    for r in frame["records"]:
+        t = r["type"]
+        if t == "task":
+            core = "-" if r["core"] is None else r["core"]
+            print("  task    %-16s core %s prio %2d load %5.1f%% stack %d" %
+                  (r["name"], core, r["priority"], r["load"], r["stack"]))
+        elif t == "core":
+            print("  core    %d load %d%%" % (r["core"], r["load"]))
+        elif t == "lock":
+            print("  lock    %-16s takes %d contended %d wait %d us max %d us"
+                  % (r["name"], r["takes"], r["contended"], r["wait_us"],
+                     r["max_wait_us"]))
+        elif t == "counter":
+            print("  counter %-16s %d" % (r["name"], r["value"]))
+        elif t == "memory":
+            print("  memory  %-16s %-16s count %d heap %d static %d" %
+                  (r["kind"], r["name"], r["count"], r["heap"], r["static"]))
+        elif t == "heap":
+            print("  heap    free %d min %d" % (r["free"], r["min_free"]))
+        elif t == "queue":
+            print("  queue   %-16s depth max %d p99 %d / %d full %d empty %d "
+                  "latency p99 %d us recommended %d" %
+                  (r["name"], r["max_depth"], r["p99_depth"], r["capacity"],
+                   r["full"], r["empty"], r["p99_latency_us"],
+                   r["recommended"]))
+        else:
+            print("  record  %s %s" % (t, r["raw"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="input file (default: stdin)")
+    parser.add_argument("--serial", help="serial port to read from")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--json", action="store_true")
+    args = parser.parse_args()
+    if args.serial:
+        import serial
+        stream = serial.Serial(args.serial, args.baud, timeout=0.1)
+    elif args.file:
+        stream = open(args.file, "rb")
+    else:
+        stream = sys.stdin.buffer
+    for frame in frames(stream):
+        if args.json:
+            print(json.dumps(frame))
+        else:
+            print_frame(frame)
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()